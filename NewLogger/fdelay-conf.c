@@ -0,0 +1,312 @@
+/*
+ * Board configuration shared by the logger and the daemon: the
+ * configuration file, and how it is applied to the boards.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "fdelay-lib.h"
+#include "fdelay-conf.h"
+
+struct board_def boards[MAX_BOARDS];
+
+int64_t parse_num(const char *n_str)
+{
+	struct {
+		char unit;
+		int64_t multiplier;
+	} units[] = {
+		{'p', 1LL},
+		{'n', 1000LL},
+		{'u', 1000000LL},
+		{'m', 1000000000LL},
+		{'s', 1000000000000LL},
+		{' ', 0}
+	};
+	
+	int64_t n;
+	char unit;
+	
+ 	int rv = sscanf(n_str,"%lli%c", &n, &unit);
+ 
+ 	if(rv == 1)
+ 		return n;
+ 	else if (rv == 2) 
+ 	{
+ 		int i;
+ 		for(i=0; units[i].multiplier; i++)
+ 			if(units[i].unit == unit)
+ 				return units[i].multiplier * n;
+ 		
+ 		fprintf(stderr,"Unrecognized numeric constant '%s' (wrong units?)\n", n_str);
+ 		exit(-1);
+ 	}	
+
+	fprintf(stderr,"Unrecognized numeric constant '%s'\n", n_str);
+ 	exit(-1);
+}
+
+/* returns: tokenized arguments to tokens, command (1st word) to cmd */
+int next_command(FILE *f_config, char *cmd, token_array tokens)
+{
+	char line [1024];
+	char *running;
+	const char *delims=" \n\r\t";
+	int i;
+	int n = 0;
+	
+	do {
+		if(feof(f_config))
+			return -1;
+		
+		fgets(line, sizeof(line), f_config);
+	
+		running = strdupa(line);
+		while(*running == ' ' || *running == '\t') running++;
+	
+		strncpy(cmd, strsep (&running , delims), MAX_TOK_LENGTH);
+
+	} while(cmd[0] == '#' || cmd[0] == ' ' || cmd[0] == '\n' || cmd[0] == '\r' || !cmd[0]);
+
+	for(i=0;i<MAX_TOKENS;i++)
+	{
+		char *token = strsep (&running , delims);
+		
+		if(token == NULL)
+			return n;
+
+		if(strlen(token) > 0)
+		{
+//			printf("tok %p\n", tokens[0]);
+			strncpy(&tokens[n][0], token, MAX_TOK_LENGTH);
+			n++;
+		}
+	}
+	
+	return 0;
+}
+
+#define CUR boards[current_board]
+
+/* Commands not about boards are passed to "extra", if not NULL */
+void load_config(const char *config_file, config_extra_fn extra)
+{
+	token_array args;
+	char cmd [MAX_TOK_LENGTH];
+	int current_board = 0;
+	int n_args;
+	
+
+	FILE *f_config=fopen(config_file, "r");
+	
+	if(!f_config)
+	{
+		fprintf(stderr,"Can't open configuration file '%s'\n", config_file);
+		exit(-1);
+	}
+
+	memset(boards, 0, sizeof(boards));
+	
+	while((n_args = next_command(f_config, cmd, args)) >= 0)
+	{
+		if(!strcmp(cmd, "board"))
+		{
+			current_board = parse_num(args[0]);
+			CUR.in_use = 1;
+		}	
+		
+
+
+		if(!strcmp(cmd, "hw_index"))
+		{
+			CUR.hw_index = parse_num(args[0]);
+			printf("Adding board %d, hw_index %x\n", current_board, CUR.hw_index);
+		
+		}
+			
+		if(!strcmp(cmd, "termination"))
+			CUR.term_on = parse_num(args[0]);
+
+		if(!strcmp(cmd, "input_offset"))
+			CUR.input_offset = parse_num(args[0]);
+
+		if(!strcmp(cmd, "output_offset"))
+			CUR.output_offset = parse_num(args[0]);
+
+		if(!strcmp(cmd, "out"))
+		{
+			int index = parse_num(args[0]) - 1;
+			
+			if(index < 0 || index > 3)
+			{
+				fprintf(stderr,"Invalid output index\n");
+				exit(-1);
+			}
+
+			CUR.outs[index].offset_pps = parse_num(args[1]);
+			CUR.outs[index].width = parse_num(args[2]);
+			CUR.outs[index].period = parse_num(args[3]);
+			CUR.outs[index].enabled = 1;
+			
+//			printf("OutCfg: %d %lli %lli %lli\n", index, CUR.outs[index].offset_pps, CUR.outs[index].width, CUR.outs[index].period);
+		}	
+		
+		if(extra)
+			extra(cmd, args);
+	
+	}
+	
+	fclose(f_config);
+}
+
+#undef CUR
+
+/* Lock all boards to WR together: the wait is paid once, not per board */
+void enable_wr_all(void)
+{
+	int i, unlocked, lock_retries = 10;
+
+	printf("Locking to WR network...");
+	fflush(stdout);
+	for (i = 0; i < MAX_BOARDS; i++)
+		if (boards[i].in_use)
+			fdelay_wr_mode(boards[i].b, 0);
+	sleep(2);
+	for (i = 0; i < MAX_BOARDS; i++)
+		if (boards[i].in_use)
+			fdelay_wr_mode(boards[i].b, 1);
+
+	for (;;)
+	{
+	    for (i = unlocked = 0; i < MAX_BOARDS; i++)
+		if (boards[i].in_use && fdelay_check_wr_mode(boards[i].b))
+		    unlocked++;
+	    if (!unlocked)
+		break;
+	    printf(".");
+	    fflush(stdout);
+	    sleep(1);
+	    if(lock_retries-- == 0)
+	    {
+				fprintf(stderr," WR lock timed out\n");
+				exit(1);
+	    }
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+                                                                    
+
+int configure_board(struct board_def *bdef)
+{
+	struct fdelay_board *b;
+	struct fd_config c;
+	int i;
+	
+	b = fdelay_open(-1, bdef->hw_index);
+	
+	if(!b)
+	{
+		fprintf(stderr,"Can't open fdelay board @ hw_index %x\n", bdef->hw_index);
+		exit(-1);
+	}
+	
+	bdef->b = b;
+	
+	/* Flags and offsets in a single write; termination is rewritten */
+	if (fdelay_get_config(b, &c) < 0)
+	{
+		fprintf(stderr,"Can't read configuration of board %x: %s\n",
+			bdef->hw_index, strerror(errno));
+		exit(-1);
+	}
+	c.valid = FD_CONFIG_TDC_FLAGS | FD_CONFIG_TDC_USER_OFF
+		| FD_CONFIG_CH_USER_OFF;
+	if(bdef->term_on)
+	    c.tdc_flags |= FD_TDCF_TERM_50;
+	else
+	    c.tdc_flags &= ~FD_TDCF_TERM_50;
+	c.tdc_user_offset = bdef->input_offset;
+	for(i=0;i<4;i++)
+	    c.ch_user_offset[i] = bdef->output_offset;
+	if (fdelay_set_config(b, &c) < 0)
+	{
+		fprintf(stderr,"Can't configure board %x: %s\n",
+			bdef->hw_index, strerror(errno));
+		exit(-1);
+	}
+    return 0;
+}
+
+/*
+ * Outputs of all boards are staged, then armed in one parallel pass.
+ * Boards share WR time, so one reading of time is enough for all.
+ */
+int configure_outputs(void)
+{
+	static struct fdelay_multi_pulses mp[MAX_BOARDS];
+	static struct fdelay_board *bl[MAX_BOARDS];
+	struct fd_time t_cur, t_start, pps_offset, width;
+	struct fdelay_pulse *p;
+	struct board_def *bdef;
+	int i, j, n = 0, nb = 0;
+	int64_t skew;
+	uint32_t err;
+
+	for (i = 0; i < MAX_BOARDS; i++)
+		if (boards[i].in_use)
+			bl[nb++] = boards[i].b;
+	if (!nb)
+		return 0;
+	if (fdelay_get_time_fast(bl[0], &t_cur, NULL) < 0)
+		fdelay_get_time(bl[0], &t_cur);
+	t_cur.utc += 2;
+	t_cur.coarse = 0;
+	t_cur.frac = 0;
+
+	for (i = 0; i < MAX_BOARDS; i++) {
+		if (!boards[i].in_use)
+			continue;
+		bdef = boards + i;
+		mp[n].b = bdef->b;
+		mp[n].mask = 0;
+		for (j = 0; j < 4; j++) {
+			if (!bdef->outs[j].enabled)
+				continue;
+			printf("Configure output %d of board %x\n", j + 1,
+			       bdef->hw_index);
+			fdelay_pico_to_time(&bdef->outs[j].offset_pps, &pps_offset);
+			fdelay_pico_to_time(&bdef->outs[j].width, &width);
+			t_start = pps_offset;
+			fd_time_add(&t_start, &t_cur);
+
+			p = mp[n].pulses + j;
+			p->rep = -1;
+			p->mode = FD_OUT_MODE_PULSE;
+			p->start = t_start;
+			p->end = t_start;
+			fd_time_add(&p->end, &width);
+			fdelay_pico_to_time(&bdef->outs[j].period, &p->loop);
+			mp[n].mask |= 1 << j;
+		}
+		if (mp[n].mask)
+			n++;
+	}
+	if (n && fdelay_config_pulses_multi(mp, n) < 0) {
+		fprintf(stderr, "Can't configure outputs: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	if (nb > 1 && fdelay_check_skew(bl, nb, &skew, &err) == 0)
+		printf("Board skew: %lli ns (+- %u)\n", (long long)skew, err);
+	return 0;
+}
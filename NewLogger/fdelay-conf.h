@@ -0,0 +1,43 @@
+/*
+ * Board configuration shared by the logger and the daemon
+ */
+#ifndef __FDELAY_CONF_H__
+#define __FDELAY_CONF_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "fdelay-lib.h"
+
+#define MAX_BOARDS 64
+
+struct board_def {
+	struct fdelay_board *b;
+	int term_on;
+	int64_t input_offset;
+	int64_t output_offset;
+	int hw_index;
+	int in_use;
+	
+	struct {
+		int64_t offset_pps, width, period;
+		int enabled;
+	} outs [4];
+};
+
+extern struct board_def boards[MAX_BOARDS];
+
+#define MAX_TOKENS 16
+#define MAX_TOK_LENGTH 256
+
+typedef char token_array[MAX_TOKENS][MAX_TOK_LENGTH];
+
+typedef void (*config_extra_fn)(char *cmd, token_array args);
+
+extern int64_t parse_num(const char *n_str);
+extern int next_command(FILE *f_config, char *cmd, token_array tokens);
+extern void load_config(const char *config_file, config_extra_fn extra);
+extern int configure_board(struct board_def *bdef);
+extern void enable_wr_all(void);
+extern int configure_outputs(void);
+
+#endif /* __FDELAY_CONF_H__ */
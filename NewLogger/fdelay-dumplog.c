@@ -13,18 +13,7 @@
 
 #define FDELAY_INTERNAL // for sysfs_get/set
 #include "fdelay-lib.h"
-
-#define PACKED __attribute__((packed))
-
-#define TYPE_START_LOGGING 1
-#define TYPE_END_LOGGING 2
-#define TYPE_TIMESTAMP 3
-
-PACKED struct binary_timestamp {
-	int32_t card_id;
-	uint8_t type;
-	PACKED struct fdelay_time ts;
-};
+#include "fdelay-log.h"
 
 
 #define MAX_BOARDS 64
@@ -48,12 +37,13 @@ struct board_def boards[MAX_BOARDS];
 
 static FILE *log_file = NULL;
 
-void log_write(struct fdelay_time *t, int card_id)
+void log_write(struct fd_time *t, int card_id)
 {
 	struct binary_timestamp bt;
 	if(!log_file)
 		return;
-	bt.ts = *t;
+	memset(&bt, 0, sizeof(bt));
+	memcpy(bt.ts, t, sizeof(bt.ts));
 	bt.type = TYPE_TIMESTAMP;
 	bt.card_id = card_id;
 	fwrite(&bt, sizeof(struct binary_timestamp), 1, log_file);
@@ -71,7 +61,7 @@ void log_start(char *log_file_name)
 			exit(-1);
 		}
 
-		bt.card_id = 0;
+		memset(&bt, 0, sizeof(bt));
 		bt.type = TYPE_START_LOGGING;
 		fwrite(&bt, sizeof(struct binary_timestamp), 1, log_file);
 		fflush(log_file);
@@ -82,7 +72,7 @@ void log_stop()
 		struct binary_timestamp bt;
 		if(!log_file)
 			return;
-		bt.card_id = 0;
+		memset(&bt, 0, sizeof(bt));
 		bt.type = TYPE_END_LOGGING;
 		fwrite(&bt, sizeof(struct binary_timestamp), 1, log_file);
 		fflush(log_file);
@@ -287,24 +277,6 @@ void enable_wr(struct fdelay_board *b, int index)
 	fflush(stdout);
 }
 
-/* Add two timestamps */
-static struct fdelay_time ts_add(struct fdelay_time a, struct fdelay_time b)
-{
-    a.frac += b.frac;
-    if(a.frac >= 4096)
-    {
-        a.frac -= 4096;
-	a.coarse++;
-    }
-    a.coarse += b.coarse;
-    if(b.coarse >= 125000000)
-    {
-        a.coarse -= 125000000;
-	a.utc ++;
-    }
-    a.utc += b.utc;
-    return a;
-}
                                                                     
 
 int configure_board(struct board_def *bdef)
@@ -341,7 +313,7 @@ int configure_board(struct board_def *bdef)
 	{
 	    if(bdef->outs[i].enabled)
 	    {
-		struct fdelay_time t_cur, pps_offset, width;
+		struct fd_time t_cur, pps_offset, width;
 		struct fdelay_pulse p;
 		
 		printf("Configure output %d\n", i+1);
@@ -354,12 +326,13 @@ int configure_board(struct board_def *bdef)
 		t_cur.utc += 2;
 		t_cur.coarse = 0;
 		t_cur.frac = 0;
-		t_cur = ts_add(pps_offset, t_cur);
+		fd_time_add(&t_cur, &pps_offset);
 		
 		p.rep = -1;
 		p.mode = FD_OUT_MODE_PULSE;
 		p.start = t_cur;
-		p.end = ts_add(t_cur, width);
+		p.end = t_cur;
+		fd_time_add(&p.end, &width);
 		fdelay_pico_to_time(&bdef->outs[i].period, &p.loop);
 		fdelay_config_pulse(bdef->b, i, &p);
 	    }
@@ -370,7 +343,7 @@ int configure_board(struct board_def *bdef)
 void handle_readout(struct board_def *bdef)
 {
     int64_t t_ps;
-    struct fdelay_time t;
+    struct fd_time t;
 
     while(fdelay_read(bdef->b, &t, 1, O_NONBLOCK) == 1)
     {	    
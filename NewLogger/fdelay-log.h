@@ -0,0 +1,28 @@
+/*
+ * Binary log record shared by the logger and the dump tool
+ */
+#ifndef __FDELAY_LOG_H__
+#define __FDELAY_LOG_H__
+
+#include <stdint.h>
+#include "fdelay-lib.h"
+
+#define PACKED __attribute__((packed))
+
+#define TYPE_START_LOGGING 1
+#define TYPE_END_LOGGING 2
+#define TYPE_TIMESTAMP 3
+
+/*
+ * The log record is 32 bytes, with the time at offset 5 (see pp.py).
+ * fd_time is 8-aligned, so it is kept as bytes and copied in, and
+ * the layout is spelled out, padding and alignment included.
+ */
+struct binary_timestamp {
+	int32_t card_id;
+	uint8_t type;
+	uint8_t ts[sizeof(struct fd_time)];
+	uint8_t pad[3];
+} PACKED __attribute__((aligned(4)));
+
+#endif /* __FDELAY_LOG_H__ */
@@ -0,0 +1,116 @@
+/*
+ * fdelayd-cat: subscribe to fdelayd and print the stamps it sends
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fdelay-lib.h"
+#include "fdelayd.h"
+
+#define CREDIT 4 /* frames in flight */
+
+static void send_msg(int fd, void *m, int len, char *prog)
+{
+	if (send(fd, m, len, 0) != len) {
+		fprintf(stderr, "%s: send(): %s\n", prog, strerror(errno));
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static union {
+		struct fdelayd_hdr h;
+		struct fdelayd_stamps s;
+		char buf[sizeof(struct fdelayd_stamps)
+			 + FDELAYD_MAX_BATCH * sizeof(struct fdelay_merge_item)];
+	} f;
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct fdelayd_sub sub = {{FDELAYD_SUBSCRIBE, 0}};
+	struct fdelayd_hdr credit = {FDELAYD_CREDIT, CREDIT};
+	struct fdelay_merge_item *it;
+	char *name = FDELAYD_SOCKET;
+	uint64_t lost = 0;
+	int64_t t_ps;
+	int i, n, fd;
+
+	while ((i = getopt(argc, argv, "s:b:c:n:l:q:")) != -1) {
+		switch(i) {
+		case 's':
+			name = optarg;
+			break;
+		case 'b':
+			sub.boards = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			sub.channels = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			sub.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			sub.latency_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			sub.queue = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Use: \"%s [-s <socket>] [-b <board-mask>] "
+				"[-c <channel-mask>] [-n <batch>] "
+				"[-l <latency-ms>] [-q <queue>]\"\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], name, strerror(errno));
+		exit(1);
+	}
+	send_msg(fd, &sub, sizeof(sub), argv[0]);
+	send_msg(fd, &credit, sizeof(credit), argv[0]);
+	credit.arg = 1;
+
+	while ((n = recv(fd, &f, sizeof(f), 0)) >= (int)sizeof(f.h)) {
+		if (f.h.type == FDELAYD_REPLY) {
+			if (f.h.arg) {
+				fprintf(stderr, "%s: subscribe: %s\n", argv[0],
+					strerror(f.h.arg));
+				exit(1);
+			}
+			continue;
+		}
+		if (f.h.type != FDELAYD_STAMPS)
+			continue;
+		if (f.s.lost != lost) {
+			fprintf(stderr, "%s: lost %lli stamps\n", argv[0],
+				(long long)(f.s.lost - lost));
+			lost = f.s.lost;
+		}
+		for (i = 0; i < f.h.arg; i++) {
+			it = f.s.item + i;
+			t_ps = fd_time_cf_to_ps(it->t.coarse, it->t.frac);
+			printf("board %2i ch %i seq %5i: time %lli s, "
+			       "%lli.%03lli ns%s\n", it->stream, it->t.channel,
+			       it->t.seq_id, (long long)it->t.utc,
+			       (long long)t_ps / 1000LL,
+			       (long long)t_ps % 1000LL,
+			       it->flags & FDELAY_MERGE_LATE ? " late" : "");
+		}
+		fflush(stdout);
+		send_msg(fd, &credit, sizeof(credit), argv[0]);
+	}
+	if (n < 0)
+		fprintf(stderr, "%s: recv(): %s\n", argv[0], strerror(errno));
+	return 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * fdelayd: own all the boards, and serve their time-stamps to local clients
+ *
+ * Boards are configured like fdelay-gs does, from the same file, and
+ * their stamps are merged in time order. Each client subscribes with
+ * its own filters (see fdelayd.h) and gets stamps in batched frames,
+ * only as long as it has credit. A slow client loses its oldest
+ * stamps, but never delays the boards: they are always drained.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "fdelay-lib.h"
+#include "fdelay-conf.h"
+#include "fdelayd.h"
+
+#define MERGE_DEPTH 4096
+#define MAX_CLIENTS 64
+#define CLIENT_QUEUE 65536	/* stamps, default */
+#define CLIENT_BATCH 256	/* stamps, default */
+#define TICK_MS 10		/* for latency and idle boards */
+
+/* epoll data: a client index, or one of these */
+#define EP_LISTEN MAX_CLIENTS
+#define EP_BOARDS (MAX_CLIENTS + 1)
+
+struct client {
+	int fd;			/* -1 if the slot is free */
+	int subscribed;
+	struct fdelayd_sub sub;
+	uint32_t credit;	/* frames we may send */
+	struct fdelay_merge_item *q;
+	unsigned qsize;		/* a power of two */
+	unsigned head, tail;	/* free running */
+	uint64_t lost;
+	uint64_t since_ms;	/* the oldest queued stamp waits since then */
+};
+
+static struct client clients[MAX_CLIENTS];
+static char *sock_name = FDELAYD_SOCKET;
+static struct fdelay_merge *merge;
+static int stream_board[MAX_BOARDS]; /* one stream per board in use */
+static int nstreams;
+static int64_t merge_window = 10000000000LL; /* 10ms */
+static volatile int stop;
+
+/* Configuration commands for the daemon, not about boards */
+void fdelayd_config(char *cmd, token_array args)
+{
+	if(!strcmp(cmd, "socket"))
+		sock_name = strdup(args[0]);
+
+	if(!strcmp(cmd, "merge_window"))
+		merge_window = parse_num(args[0]);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void client_close(int i)
+{
+	struct client *c = clients + i;
+
+	close(c->fd); /* this removes it from epoll, too */
+	free(c->q);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static void client_reply(int i, int err)
+{
+	struct fdelayd_hdr h = {FDELAYD_REPLY, err};
+
+	if (send(clients[i].fd, &h, sizeof(h), MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+	    && errno != EAGAIN)
+		client_close(i);
+}
+
+static int client_match(struct client *c, struct fdelay_merge_item *it)
+{
+	struct fdelayd_sub *s = &c->sub;
+
+	if (s->boards && !(s->boards & (1ULL << it->stream)))
+		return 0;
+	if (s->channels && (it->t.channel >= 32
+			    || !(s->channels & (1U << it->t.channel))))
+		return 0;
+	if (s->from.utc && fd_time_cmp(&it->t, &s->from) < 0)
+		return 0;
+	if (s->to.utc && fd_time_cmp(&it->t, &s->to) >= 0)
+		return 0;
+	return 1;
+}
+
+/*
+ * Send as many frames as credit allows: full ones, or a partial one if
+ * the oldest stamp waited more than the latency (or "force" is set)
+ */
+static void client_flush(int i, uint64_t now, int force)
+{
+	static union {
+		struct fdelayd_stamps s;
+		char buf[sizeof(struct fdelayd_stamps)
+			 + FDELAYD_MAX_BATCH * sizeof(struct fdelay_merge_item)];
+	} f;
+	struct client *c = clients + i;
+	unsigned n, k;
+
+	while (c->credit && c->tail != c->head) {
+		n = c->tail - c->head;
+		if (n < c->sub.batch && !force
+		    && now - c->since_ms < c->sub.latency_ms)
+			return;
+		if (n > c->sub.batch)
+			n = c->sub.batch;
+		f.s.h.type = FDELAYD_STAMPS;
+		f.s.h.arg = n;
+		f.s.lost = c->lost;
+		for (k = 0; k < n; k++)
+			f.s.item[k] = c->q[(c->head + k) & (c->qsize - 1)];
+		if (send(c->fd, &f, sizeof(f.s) + n * sizeof(f.s.item[0]),
+			 MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			if (errno != EAGAIN)
+				client_close(i);
+			return; /* socket full: retry at next tick */
+		}
+		c->head += n;
+		c->credit--;
+		c->since_ms = now;
+	}
+}
+
+/* Queue merged stamps to the clients that want them */
+static void distribute(struct fdelay_merge_item *it, int n, uint64_t now)
+{
+	struct client *c;
+	int i, j;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		c = clients + i;
+		if (c->fd < 0 || !c->subscribed)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (!client_match(c, it + j))
+				continue;
+			if (c->tail == c->head)
+				c->since_ms = now;
+			if (c->tail - c->head == c->qsize) { /* drop the oldest */
+				c->head++;
+				c->lost++;
+			}
+			c->q[c->tail++ & (c->qsize - 1)] = it[j];
+		}
+		client_flush(i, now, 0);
+	}
+}
+
+/* Distribute what the merge stage releases; "now" may be NULL */
+void merge_output(struct fd_time *now, int flags)
+{
+	struct fdelay_merge_item it[256];
+	uint64_t ms = now_ms();
+	int i, n;
+
+	while ((n = fdelay_merge_pop(merge, it, 256, now, flags)) > 0) {
+		/* Clients see boards as numbered in the configuration file */
+		for (i = 0; i < n; i++)
+			it[i].stream = stream_board[it[i].stream];
+		distribute(it, n, ms);
+	}
+}
+
+/* Called by fdelay_poll_wait, for boards with data only */
+int readout_cb(struct fdelay_board *b, void *arg)
+{
+	struct fd_time t[256];
+	int i, k, n;
+
+	while ((n = fdelay_read(b, t, 256, O_NONBLOCK)) > 0) {
+		for (i = 0; i < n; i += k) {
+			k = fdelay_merge_push(merge, (long)arg, t + i, n - i);
+			if (k < 0) { /* this board is too far ahead */
+				merge_output(NULL, FDELAY_MERGE_DRAIN);
+				k = 0;
+			}
+		}
+	}
+	return 0; /* drained */
+}
+
+static int client_subscribe(struct client *c, struct fdelayd_sub *s)
+{
+	struct fdelay_merge_item *q;
+	unsigned size = 1;
+
+	if (!s->batch)
+		s->batch = CLIENT_BATCH;
+	if (s->batch > FDELAYD_MAX_BATCH)
+		s->batch = FDELAYD_MAX_BATCH;
+	if (!s->queue)
+		s->queue = CLIENT_QUEUE;
+	if (s->queue > (1 << 24))
+		return EINVAL;
+	while (size < s->queue || size < s->batch)
+		size <<= 1;
+	q = calloc(size, sizeof(*q));
+	if (!q)
+		return ENOMEM;
+	/* Pending stamps matched the old filter: drop them */
+	free(c->q);
+	c->q = q;
+	c->qsize = size;
+	c->head = c->tail = 0;
+	c->sub = *s;
+	c->subscribed = 1;
+	return 0;
+}
+
+static int client_pulse(struct fdelayd_pulse *p)
+{
+	if (p->board >= MAX_BOARDS || !boards[p->board].in_use)
+		return ENODEV;
+	if (fdelay_config_pulse(boards[p->board].b, p->channel, &p->p) < 0)
+		return errno;
+	return 0;
+}
+
+static void client_msg(int i)
+{
+	union {
+		struct fdelayd_hdr h;
+		struct fdelayd_sub s;
+		struct fdelayd_pulse p;
+	} m;
+	struct client *c = clients + i;
+	int n;
+
+	n = recv(c->fd, &m, sizeof(m), MSG_DONTWAIT);
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n < (int)sizeof(m.h)) {
+		client_close(i); /* gone, or talking nonsense */
+		return;
+	}
+	switch (m.h.type) {
+	case FDELAYD_SUBSCRIBE:
+		if (n != sizeof(m.s))
+			client_reply(i, EINVAL);
+		else
+			client_reply(i, client_subscribe(c, &m.s));
+		break;
+	case FDELAYD_CREDIT:
+		c->credit += m.h.arg;
+		if (c->credit < m.h.arg)
+			c->credit = ~0U;
+		client_flush(i, now_ms(), 0);
+		break;
+	case FDELAYD_PULSE:
+		if (n != sizeof(m.p))
+			client_reply(i, EINVAL);
+		else
+			client_reply(i, client_pulse(&m.p));
+		break;
+	default:
+		client_reply(i, EINVAL);
+	}
+}
+
+static void client_accept(int lfd, int ep)
+{
+	struct epoll_event ev;
+	int i, fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd < 0)
+			break;
+	if (i == MAX_CLIENTS) {
+		fprintf(stderr, "fdelayd: too many clients\n");
+		close(fd);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		return;
+	}
+	clients[i].fd = fd;
+}
+
+static int open_socket(const char *name)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int fd;
+
+	if (strlen(name) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, name);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(name); /* left over by a previous run */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void sighandler(int sig)
+{
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev, evs[16];
+	struct fdelay_poll *p;
+	struct fd_time now;
+	int i, n, ep, lfd, first = -1;
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	if(argc < 2)
+	{
+		printf("usage: %s <configuration-file>\n", argv[0]);
+		return 0;
+	}
+
+	load_config(argv[1], fdelayd_config);
+
+	i = fdelay_init();
+	if (i < 0) {
+		fprintf(stderr, "%s: fdelay_init(): %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+
+	if (i == 0) {
+		fprintf(stderr, "%s: no boards found\n", argv[0]);
+		exit(1);
+	}
+
+	p = fdelay_poll_create();
+	if (!p) {
+		fprintf(stderr, "%s: can't allocate: %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+	for(i=0;i<MAX_BOARDS;i++)
+		if(boards[i].in_use) {
+			configure_board(&boards[i]);
+			if (fdelay_poll_add(p, boards[i].b, readout_cb,
+					    (void *)(long)nstreams) < 0) {
+				fprintf(stderr, "%s: fdelay_poll_add(): %s\n",
+					argv[0], strerror(errno));
+				exit(1);
+			}
+			if (first < 0)
+				first = i;
+			stream_board[nstreams++] = i;
+		}
+	enable_wr_all();
+	configure_outputs();
+
+	/* Only boards in use: an idle stream would hold the others back */
+	merge = fdelay_merge_create(nstreams, MERGE_DEPTH, merge_window);
+	if (!merge) {
+		fprintf(stderr, "%s: can't allocate: %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+	lfd = open_socket(sock_name);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], sock_name,
+			strerror(errno));
+		exit(1);
+	}
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) {
+		fprintf(stderr, "%s: epoll_create(): %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = EP_LISTEN;
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+	/* The boards are a nested epoll set; their callbacks do the work */
+	ev.data.u32 = EP_BOARDS;
+	epoll_ctl(ep, EPOLL_CTL_ADD, fdelay_poll_fileno(p), &ev);
+	printf("Serving on %s\n", sock_name);
+
+	while (!stop) {
+		n = epoll_wait(ep, evs, 16, TICK_MS);
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.u32 == EP_LISTEN)
+				client_accept(lfd, ep);
+			else if (evs[i].data.u32 < MAX_CLIENTS)
+				client_msg(evs[i].data.u32);
+		}
+		fdelay_poll_wait(p, 0);
+		/* All boards share WR time: one of them is enough */
+		if (first >= 0 && fdelay_get_time_fast(boards[first].b, &now,
+							NULL) == 0)
+			merge_output(&now, 0);
+		else
+			merge_output(NULL, 0);
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0 && clients[i].subscribed)
+				client_flush(i, now_ms(), 0);
+	}
+
+	fprintf(stderr, "%s: cleaning up\n", argv[0]);
+	merge_output(NULL, FDELAY_MERGE_DRAIN);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0) {
+			if (clients[i].subscribed)
+				client_flush(i, now_ms(), 1);
+			client_close(i);
+		}
+	close(lfd);
+	unlink(sock_name);
+	return 0;
+}
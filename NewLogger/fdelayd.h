@@ -0,0 +1,62 @@
+/*
+ * The protocol of fdelayd, the time-stamp distribution daemon
+ *
+ * Clients connect to a Unix seqpacket socket, so every message is a
+ * frame of its own. Each frame starts with struct fdelayd_hdr. Both
+ * sides run on the same host, so structures are in host order.
+ */
+#ifndef __FDELAYD_H__
+#define __FDELAYD_H__
+
+#include <stdint.h>
+#include "fdelay-lib.h"
+
+#define FDELAYD_SOCKET		"/var/run/fdelayd"	/* "socket" in config */
+#define FDELAYD_MAX_BATCH	1024	/* stamps per frame */
+
+enum fdelayd_type {
+	FDELAYD_SUBSCRIBE = 1,	/* client: struct fdelayd_sub */
+	FDELAYD_CREDIT,		/* client: "arg" more frames may be sent */
+	FDELAYD_PULSE,		/* client: struct fdelayd_pulse */
+	FDELAYD_REPLY,		/* daemon: "arg" is 0 or an errno value */
+	FDELAYD_STAMPS,		/* daemon: struct fdelayd_stamps */
+};
+
+struct fdelayd_hdr {
+	uint32_t type;
+	uint32_t arg;
+};
+
+/*
+ * A subscription replaces the previous one. Stamps are filtered by
+ * board (the number in the configuration file), channel (0 is the
+ * input, 1-4 the outputs, if the driver logs them) and time. They
+ * are sent "batch" at a time, or after "latency_ms" if fewer; but
+ * only while the client has credit left. The daemon queues up to
+ * "queue" stamps (or a default) for a client; older ones are dropped.
+ */
+struct fdelayd_sub {
+	struct fdelayd_hdr h;
+	uint64_t boards;		/* mask; 0 is all */
+	uint32_t channels;		/* mask; 0 is all */
+	uint32_t batch;
+	uint32_t latency_ms;
+	uint32_t queue;
+	struct fd_time from, to;	/* utc == 0: no limit */
+};
+
+/* Program a pulse, as fdelay_config_pulse does */
+struct fdelayd_pulse {
+	struct fdelayd_hdr h;
+	uint32_t board, channel;
+	struct fdelay_pulse p;
+};
+
+/* "arg" is the number of items; "stream" is the board number */
+struct fdelayd_stamps {
+	struct fdelayd_hdr h;
+	uint64_t lost;			/* dropped for this client, in total */
+	struct fdelay_merge_item item[];
+};
+
+#endif /* __FDELAYD_H__ */
@@ -15,6 +15,7 @@
 #include <linux/slab.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/spinlock.h>
 //#include <linux/math64.h>
 #include "fine-delay.h"
 #include "hw/fd_main_regs.h"
@@ -78,7 +79,7 @@ static uint64_t output_delay_ps(struct fd_dev *fd, int ch, int fine, int n,
 		    | AR0_HQSel | AR0_ROsc, 0);
 
 	/* Program the output delay line setpoint */
-	fd_ch_writel(fd, ch, fine, FD_REG_FRR);
+	fd_ch_writel_shadow(fd, ch, fine, FD_REG_FRR);
 	fd_ch_writel(fd, ch, FD_DCR_ENABLE | FD_DCR_MODE | FD_DCR_UPDATE,
 		    FD_REG_DCR);
 	fd_ch_writel(fd, ch, FD_DCR_FORCE_DLY | FD_DCR_ENABLE, FD_REG_DCR);
@@ -193,7 +194,7 @@ int fd_calibrate_outputs(struct fd_dev *fd)
 		new = measured;
 		fd->ch[ch].frr_offset = new - fitted;
 
-		fd_ch_writel(fd, ch, new, FD_REG_FRR);
+		fd_ch_writel_shadow(fd, ch, new, FD_REG_FRR);
 		fd->ch[ch].frr_cur = new;
 		if (1) {
 			dev_info(&fd->fmc->dev,
@@ -210,6 +211,7 @@ int fd_calibrate_outputs(struct fd_dev *fd)
 void fd_update_calibration(unsigned long arg)
 {
 	struct fd_dev *fd = (void *)arg;
+	unsigned long flags;
 	int ch, fitted, new;
 
 	fd_read_temp(fd, 0 /* not verbose */);
@@ -217,8 +219,11 @@ void fd_update_calibration(unsigned long arg)
 
 	for (ch = FD_CH_1; ch <= FD_CH_LAST; ch++) {
 		new = fitted + fd->ch[ch].frr_offset;
-		fd_ch_writel(fd, ch, new, FD_REG_FRR);
+		/* The shadow is shared with output programming */
+		spin_lock_irqsave(&fd->lock, flags);
+		fd_ch_writel_shadow(fd, ch, new, FD_REG_FRR);
 		fd->ch[ch].frr_cur = new;
+		spin_unlock_irqrestore(&fd->lock, flags);
 		if (0) {
 			dev_info(&fd->fmc->dev,
 				 "%s: ch%i: 8ns @%i (f %i, off %i, t %i.%02i)\n",
@@ -44,6 +44,7 @@ module_param_named(show_sdb, fd_show_sdb, int, 0444);
 /* The reset function (by Tomasz) */
 static void fd_do_reset(struct fd_dev *fd, int hw_reset)
 {
+	fd_ch_shadow_invalidate(fd);
 	if (hw_reset) {
 		fd_writel(fd, FD_RSTR_LOCK_W(0xdead) | FD_RSTR_RST_CORE_MASK,
 		       FD_REG_RSTR);
@@ -118,8 +119,10 @@ static struct fd_modlist mods[] = {
 	{"reset-again", fd_reset_again},
 	SUBSYS(acam),
 	SUBSYS(time),
+	SUBSYS(queue),
 	SUBSYS(i2c),
 	SUBSYS(zio),
+	SUBSYS(sysfs),
 };
 
 /* probe and remove are called by the FMC bus core */
@@ -178,6 +181,7 @@ int fd_probe(struct fmc_device *fmc)
 	fd->fd_owregs_base = fd->fd_regs_base + 0x500;
 
 	spin_lock_init(&fd->lock);
+	mutex_init(&fd->config_lock);
 	fmc->mezzanine_data = fd;
 	fd->fmc = fmc;
 	fd->verbose = fd_verbose;
@@ -310,6 +314,9 @@ static int fd_init(void)
 {
 	int ret;
 
+	/* User space relies on this layout (raw data, "triggers") */
+	BUILD_BUG_ON(sizeof(struct fd_time) != 24);
+
 	ret = fd_zio_register();
 	if (ret < 0)
 		return ret;
@@ -27,6 +27,7 @@
 #include <linux/fmc.h>
 
 #include "fine-delay.h"
+#include "fd-time.h"
 #include "hw/fd_main_regs.h"
 #include "hw/fd_channel_regs.h"
 #include "hw/vic_regs.h"
@@ -34,50 +35,6 @@
 static int fd_sw_fifo_len = FD_SW_FIFO_LEN;
 module_param_named(fifo_len, fd_sw_fifo_len, int, 0444);
 
-/* Subtract an offset (used for the input timestamp) */
-static void fd_ts_sub(struct fd_time *t, uint64_t pico)
-{
-	uint32_t coarse, frac;
-
-	/* FIXME: we really need to pre-convert pico to internal repres. */
-	fd_split_pico(pico, &coarse, &frac);
-	if (t->frac >= frac) {
-		t->frac -= frac;
-	} else {
-		t->frac = 4096 + t->frac - frac;
-		coarse++;
-	}
-	if (t->coarse >= coarse) {
-		t->coarse -= coarse;
-	} else {
-		t->coarse = 125*1000*1000 + t->coarse - coarse;
-		t->utc--;
-	}
-}
-
-static void fd_ts_add(struct fd_time *t, int64_t pico)
-{
-	uint32_t coarse, frac;
-
-	/* FIXME: we really need to pre-convert pico to internal repres. */
-	if (pico < 0) {
-		fd_ts_sub(t, -pico);
-		return;
-	}
-
-	fd_split_pico(pico, &coarse, &frac);
-	t->frac += frac;
-	t->coarse += coarse;
-	if (t->frac >= 4096) {
-		t->frac -= 4096;
-		t->coarse++;
-	}
-	if (t->coarse >= 125*1000*1000) {
-		t->coarse -= 125*1000*1000;
-		t->utc++;
-	}
-}
-
 static inline void fd_normalize_time(struct fd_dev *fd, struct fd_time *t)
 {
 	/* The coarse count may be negative, because of how it works */
@@ -91,7 +48,7 @@ static inline void fd_normalize_time(struct fd_dev *fd, struct fd_time *t)
 		t->utc++;
 	}
 
-	fd_ts_add(t, fd->calib.tdc_zero_offset);
+	fd_time_add_ps(t, fd->calib.tdc_zero_offset);
 }
 
 
@@ -104,6 +61,7 @@ int fd_read_sw_fifo(struct fd_dev *fd, struct zio_channel *chan)
 	int i, j;
 	struct fd_time t, *tp;
 	unsigned long flags;
+	uint32_t dropped, dropped_ch[FD_CH_NUMBER + 1];
 
 	if (fd->sw_fifo.tail == fd->sw_fifo.head)
 		return -EAGAIN;
@@ -119,6 +77,8 @@ int fd_read_sw_fifo(struct fd_dev *fd, struct zio_channel *chan)
 	i = fd->sw_fifo.tail % fd_sw_fifo_len;
 	t = fd->sw_fifo.t[i];
 	fd->sw_fifo.tail++;
+	dropped = fd->sw_fifo.dropped;
+	memcpy(dropped_ch, fd->sw_fifo.dropped_ch, sizeof(dropped_ch));
 	spin_unlock_irqrestore(&fd->lock, flags);
 
 	fd_normalize_time(fd, &t);
@@ -145,6 +105,8 @@ int fd_read_sw_fifo(struct fd_dev *fd, struct zio_channel *chan)
 	v[FD_ATTR_TDC_FLAGS]	= fd->tdc_flags;
 	v[FD_ATTR_TDC_OFFSET]	= fd->calib.tdc_zero_offset;
 	v[FD_ATTR_TDC_USER_OFF]	= fd->tdc_user_offset;
+	v[FD_ATTR_TDC_DROPPED]	= dropped;
+	memcpy(v + FD_ATTR_TDC_DROPPED_0, dropped_ch, sizeof(dropped_ch));
 
 	fd_apply_offset(v + FD_ATTR_TDC_UTC_H, fd->tdc_user_offset);
 
@@ -181,18 +143,37 @@ int fd_read_sw_fifo(struct fd_dev *fd, struct zio_channel *chan)
 	return 0;
 }
 
+/* Drop the oldest n stamps, counting them per channel. Lock held */
+static void __fd_sw_fifo_drop(struct fd_dev *fd, int n)
+{
+	struct fd_sw_fifo *f = &fd->sw_fifo;
+	uint32_t ch;
+
+	while (n--) {
+		ch = f->t[f->tail++ % fd_sw_fifo_len].channel;
+		if (ch < ARRAY_SIZE(f->dropped_ch))
+			f->dropped_ch[ch]++;
+		f->dropped++;
+	}
+}
+
 /* This is local: reads the hw fifo and stores to the sw fifo */
 static int fd_read_hw_fifo(struct fd_dev *fd)
 {
 	uint32_t reg;
-	struct fd_time *t;
+	struct fd_time *t, rt;
 	unsigned long flags;
 	signed long diff;
+	int fired;
 
 	if ((fd_readl(fd, FD_REG_TSBCR) & FD_TSBCR_EMPTY))
 		return -EAGAIN;
 
 	spin_lock_irqsave(&fd->lock, flags);
+	/* If full, drop the older half before its first stamp is overwritten */
+	diff = fd->sw_fifo.head - fd->sw_fifo.tail;
+	if (diff >= fd_sw_fifo_len)
+		__fd_sw_fifo_drop(fd, fd_sw_fifo_len / 2);
 	t = fd->sw_fifo.t;
 	t += fd->sw_fifo.head % fd_sw_fifo_len;
 
@@ -209,13 +190,21 @@ static int fd_read_hw_fifo(struct fd_dev *fd)
 	t->channel = FD_TSBR_FID_CHANNEL_R(reg);
 	t->seq_id = FD_TSBR_FID_SEQID_R(reg);
 
-	/* Then, increment head and make some checks */
-	diff = fd->sw_fifo.head - fd->sw_fifo.tail;
+	/* Reactive rules act now, before the stamp reaches user space */
+	fired = 0;
+	if (fd->rules_active) {
+		rt = *t;
+		fd_normalize_time(fd, &rt);
+		fired = __fd_rules_run(fd, &rt);
+	}
+
+	/* Then, increment head */
 	fd->sw_fifo.head++;
-	if (diff >= fd_sw_fifo_len)
-		fd->sw_fifo.tail += fd_sw_fifo_len / 2;
 	spin_unlock_irqrestore(&fd->lock, flags);
 
+	/* This may be hardirq context: the tasklet starts the output timer */
+	if (fired)
+		set_bit(FD_FLAG_QUEUE_WATCH, &fd->flags);
 	BUG_ON(diff < 0);
 	if (diff >= fd_sw_fifo_len)
 		dev_warn(fd->fmc->hwdev, "Fifo overflow: "
@@ -249,6 +238,10 @@ static void fd_tlet(unsigned long arg)
 		mod_timer(&fd->fifo_timer, jiffies + fd_timer_period_jiffies);
 	}
 
+	/* Reactive rules armed some outputs: poll them */
+	if (test_and_clear_bit(FD_FLAG_QUEUE_WATCH, &fd->flags))
+		fd_queue_watch(fd);
+
 	/* FIXME: race condition */
 	if (!test_bit(FD_FLAG_INPUT_READY, &fd->flags))
 		return;
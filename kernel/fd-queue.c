@@ -0,0 +1,282 @@
+/*
+ * Queues of pulse programs, and trigger notification, for the outputs
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
+
+#include <linux/zio.h>
+
+#include "fine-delay.h"
+#include "hw/fd_channel_regs.h"
+
+/* Number of programs that can wait in each queue */
+static int fd_queue_len = 64;
+module_param_named(queue_len, fd_queue_len, int, 0444);
+
+/*
+ * The hardware raises no interrupt when an output triggers, so we poll
+ * the DCR register of armed channels. FD_DCR_PG_TRIG is set by the first
+ * pulse of a train, so after it we compare board time with the end of
+ * the train before loading the next program. The gateware only fires
+ * when board time equals the start: if the start passed and the flag is
+ * still clear, the program was missed, and the next one is loaded. The
+ * timer only runs while at least one pulse program is armed.
+ *
+ * Until the start (or the end) of the train is closer than near_us,
+ * according to the time page, the timer just sleeps. Then it polls
+ * every poll_us, so triggers are reported and the next program is
+ * loaded with the same latency whoever is waiting for them.
+ */
+static int fd_queue_poll_us = 10;
+module_param_named(queue_poll_us, fd_queue_poll_us, int, 0444);
+static int fd_queue_near_us = 1000;
+module_param_named(queue_near_us, fd_queue_near_us, int, 0444);
+
+#define FD_QUEUE_MAX_WAIT	NSEC_PER_SEC	/* notice board time steps */
+#define FD_QUEUE_ARM_NS		1000		/* arming is three writes */
+
+/*
+ * Load and arm the next valid program, if any. A program that starts
+ * before it can be armed is skipped and counted as missed. Called with
+ * the lock held; returns the number of programs missed.
+ */
+static int __fd_queue_load(struct fd_dev *fd, int ch)
+{
+	struct fd_out_queue *q = fd->queue + ch;
+	struct fd_time_sample now;
+	uint32_t *a;
+	int dcr, captured = 0, missed = 0;
+
+	q->armed = q->trig = 0;
+	while (q->tail != q->head) {
+		a = q->a[q->tail++ & (fd_queue_len - 1)];
+		dcr = __fd_zio_output_stage(fd, ch, a);
+		if (dcr < 0)
+			continue; /* invalid: skip it, like a single request */
+		if (!captured++)
+			__fd_time_capture(fd, &now);
+		if (q->staged_begin < now.board_ns + FD_QUEUE_ARM_NS) {
+			q->missed++;
+			missed++;
+			continue;
+		}
+		__fd_zio_output_arm(fd, ch, dcr);
+		q->armed = 1;
+		break;
+	}
+	return missed;
+}
+
+/* Record a trigger for the "triggers" file. Called with the lock held */
+static void __fd_queue_trig(struct fd_dev *fd, int ch)
+{
+	uint32_t seq = fd->trig[ch].seq_id + 1;
+
+	fd->trig[ch] = fd->queue[ch].start;
+	fd->trig[ch].channel = ch;
+	fd->trig[ch].seq_id = seq;
+}
+
+/* sysfs_notify() may sleep, so the timer defers it to a work queue */
+static void fd_queue_notify(struct work_struct *w)
+{
+	struct fd_dev *fd = container_of(w, struct fd_dev, trig_work);
+
+	if (test_bit(FD_FLAG_NOTIFY, &fd->flags))
+		sysfs_notify(&fd->zdev->head.dev.kobj, NULL, "triggers");
+}
+
+static enum hrtimer_restart fd_queue_timer_fn(struct hrtimer *t)
+{
+	struct fd_dev *fd = container_of(t, struct fd_dev, out_timer);
+	struct fd_time_sample now;
+	struct fd_out_queue *q;
+	unsigned long flags;
+	uint64_t est, ev, wait, poll, near;
+	int ch, armed = 0, trig = 0, missed = 0, captured = 0, est_ok;
+
+	poll = fd_queue_poll_us * NSEC_PER_USEC;
+	near = fd_queue_near_us * NSEC_PER_USEC;
+	wait = FD_QUEUE_MAX_WAIT;
+
+	spin_lock_irqsave(&fd->lock, flags);
+	est_ok = __fd_time_board_now(fd, &est) == 0;
+	for (ch = 0, q = fd->queue; ch < FD_CH_NUMBER; ch++, q++) {
+		if (!q->armed)
+			continue;
+		ev = q->trig ? q->end : q->begin;
+		if (q->trig && ev == ~0ULL)
+			continue; /* continuous: nothing more to wait for */
+		if (est_ok && ev > est + near) {
+			/* Far from now: sleep until it is close */
+			wait = min(wait, ev - est - near);
+			armed = 1;
+			continue;
+		}
+		/* Board time is captured once, before any DCR is read */
+		if (!captured++)
+			__fd_time_capture(fd, &now);
+		if (!q->trig) {
+			if (fd_ch_readl(fd, ch, FD_REG_DCR) & FD_DCR_PG_TRIG) {
+				__fd_queue_trig(fd, ch);
+				q->trig = 1;
+				trig++;
+			} else if (now.board_ns >= q->begin) {
+				/* Not fired at its start: it never will */
+				q->missed++;
+				missed++;
+				missed += __fd_queue_load(fd, ch);
+			}
+		}
+		if (q->trig && now.board_ns >= q->end)
+			missed += __fd_queue_load(fd, ch);
+		if (!q->armed)
+			continue;
+		armed = 1;
+		wait = min(wait, poll);
+	}
+	spin_unlock_irqrestore(&fd->lock, flags);
+
+	/* Programs were consumed: who waits on a full queue must know */
+	if (trig || missed)
+		schedule_work(&fd->trig_work);
+	if (!armed)
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(t, ns_to_ktime(wait));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Add the programs of a batch to the queues of their channels: either
+ * all of them or none, so the caller knows what was accepted. If no
+ * pulse program is armed on a channel, the new one is armed at once,
+ * unless it is already late. Only pulse mode is allowed, because we need
+ * FD_DCR_PG_TRIG to know when to move on, and a continuous train never
+ * ends, so nothing could follow it.
+ */
+int fd_queue_add(struct fd_dev *fd, struct fd_out_batch *b)
+{
+	struct fd_out_queue *q;
+	unsigned long flags;
+	uint32_t *attrs;
+	int ch, armed = 0, missed = 0;
+
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		attrs = b->attrs[ch];
+		if ((b->mask & (1 << ch))
+		    && (attrs[FD_ATTR_OUT_MODE] != FD_OUT_MODE_PULSE
+			|| (int)attrs[FD_ATTR_OUT_REP] < 0))
+			return -EINVAL;
+	}
+
+	spin_lock_irqsave(&fd->lock, flags);
+	for (ch = 0, q = fd->queue; ch < FD_CH_NUMBER; ch++, q++) {
+		if ((b->mask & (1 << ch)) && q->head - q->tail >= fd_queue_len) {
+			spin_unlock_irqrestore(&fd->lock, flags);
+			return -EAGAIN;
+		}
+	}
+	for (ch = 0, q = fd->queue; ch < FD_CH_NUMBER; ch++, q++) {
+		if (!(b->mask & (1 << ch)))
+			continue;
+		memcpy(q->a[q->head++ & (fd_queue_len - 1)], b->attrs[ch],
+		       sizeof(*q->a));
+		if (!q->armed)
+			missed += __fd_queue_load(fd, ch);
+		armed |= q->armed;
+	}
+	spin_unlock_irqrestore(&fd->lock, flags);
+
+	if (missed)
+		schedule_work(&fd->trig_work);
+	if (armed)
+		fd_queue_watch(fd);
+	return 0;
+}
+
+/*
+ * Start polling after a pulse program is armed. A pending expiry is
+ * kept, not pushed back, unless it is a long sleep: the new program may
+ * start earlier. If the callback is running it may have missed the new
+ * program and stop, so wait for it and start again.
+ * Must be called without the lock, and not in hardirq context, as
+ * hrtimer_cancel() waits for the callback.
+ */
+void fd_queue_watch(struct fd_dev *fd)
+{
+	struct hrtimer *t = &fd->out_timer;
+
+	if (hrtimer_active(t) && !hrtimer_callback_running(t)
+	    && ktime_to_ns(hrtimer_get_remaining(t))
+	    <= fd_queue_poll_us * NSEC_PER_USEC)
+		return;
+	hrtimer_cancel(t);
+	hrtimer_start(t, ns_to_ktime(fd_queue_poll_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+/* A direct configuration of the channel discards the queue (lock held) */
+void __fd_queue_flush(struct fd_dev *fd, int ch)
+{
+	struct fd_out_queue *q = fd->queue + ch;
+
+	q->head = q->tail = 0;
+	q->armed = q->trig = 0;
+}
+
+int fd_queue_init(struct fd_dev *fd)
+{
+	int ch;
+
+	if (fd_queue_len <= 0 || (fd_queue_len & (fd_queue_len - 1))) {
+		dev_err(&fd->fmc->dev,
+			"queue len must be a power of 2 (not %d = 0x%x)\n",
+			fd_queue_len, fd_queue_len);
+		return -EINVAL;
+	}
+	if (fd_queue_poll_us <= 0)
+		fd_queue_poll_us = 1;
+	if (fd_queue_near_us < fd_queue_poll_us)
+		fd_queue_near_us = fd_queue_poll_us;
+
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		fd->queue[ch].a = kmalloc(fd_queue_len * sizeof(*fd->queue[ch].a),
+					  GFP_KERNEL);
+		if (!fd->queue[ch].a)
+			goto out;
+	}
+	hrtimer_init(&fd->out_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	fd->out_timer.function = fd_queue_timer_fn;
+	INIT_WORK(&fd->trig_work, fd_queue_notify);
+	return 0;
+out:
+	while (--ch >= 0)
+		kfree(fd->queue[ch].a);
+	return -ENOMEM;
+}
+
+void fd_queue_exit(struct fd_dev *fd)
+{
+	int ch;
+
+	hrtimer_cancel(&fd->out_timer);
+	cancel_work_sync(&fd->trig_work);
+	for (ch = 0; ch < FD_CH_NUMBER; ch++)
+		kfree(fd->queue[ch].a);
+}
@@ -0,0 +1,201 @@
+/*
+ * Reactive rules: program outputs from input stamps, within the driver
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+
+#include <linux/zio.h>
+
+#include "fine-delay.h"
+#include "fd-time.h"
+#include "hw/fd_channel_regs.h"
+
+/* Precompute what can be: offsets, split times, RCR and DCR */
+static int fd_rule_prepare(struct fd_dev *fd, struct fd_rule *r,
+			   struct fd_rule_hw *h)
+{
+	int ch = r->channel;
+	int64_t user, start;
+
+	if (ch >= FD_CH_NUMBER || r->rep == 0 || r->rep < -1
+	    || r->rep > (int)FD_RCR_REP_CNT_MASK + 1)
+		return -EINVAL;
+	if (!r->width_ps || (r->rep != 1 && r->width_ps >= r->period_ps))
+		return -EINVAL;
+	if (r->period_ps >= 16 * FD_TIME_PS_PER_SEC) /* U_DELTA is 4 bits */
+		return -EINVAL;
+	if (!r->divider)
+		r->divider = 1;
+
+	/* Input stamps already include tdc_zero_offset (fd_normalize_time) */
+	user = r->delay_ps + fd->tdc_user_offset;
+	start = user + fd->calib.zero_offset[ch] + fd->ch_user_offset[ch];
+	if (user < 0 || start < 0)
+		return -EINVAL;
+
+	memset(h, 0, sizeof(*h));
+	fd_time_from_ps(&h->user, user);
+	fd_time_from_ps(&h->start, start);
+	fd_time_from_ps(&h->width, r->width_ps);
+	fd_time_from_ps(&h->delta, r->period_ps);
+	h->delay_ns = div_u64(r->delay_ps, 1000);
+	/* The fine part is rounded up to a cycle, like in staging */
+	h->train_ns = ~0ULL;
+	if (r->rep > 0)
+		h->train_ns = div_u64(r->width_ps + (r->rep - 1) * r->period_ps,
+				      1000) + 8;
+
+	h->rcr = FD_RCR_REP_CNT_W(r->rep < 0 ? 0 : r->rep - 1)
+		| (r->rep < 0 ? FD_RCR_CONT : 0);
+	/* Same as in __fd_zio_output_stage: no fine delay below 200ns */
+	h->dcr = FD_DCR_MODE;
+	if (r->width_ps < 200 * 1000
+	    || (r->rep != 1 && r->period_ps - r->width_ps < 200 * 1000))
+		h->dcr |= FD_DCR_NO_FINE;
+	return 0;
+}
+
+/* Replace the whole table: statistics are reset */
+int fd_rules_set(struct fd_dev *fd, struct fd_rule *rules)
+{
+	struct fd_rule_hw hw[FD_RULES_N];
+	unsigned long flags;
+	int i, err, active = 0;
+
+	for (i = 0; i < FD_RULES_N; i++) {
+		rules[i].edges = rules[i].fired = rules[i].late = 0;
+		rules[i].lat_last_ns = rules[i].lat_max_ns = 0;
+		if (!(rules[i].flags & FD_RULE_ENABLE))
+			continue;
+		err = fd_rule_prepare(fd, rules + i, hw + i);
+		if (err)
+			return err;
+		active++;
+	}
+
+	spin_lock_irqsave(&fd->lock, flags);
+	memcpy(fd->rules, rules, sizeof(fd->rules));
+	memcpy(fd->rules_hw, hw, sizeof(fd->rules_hw));
+	fd->rules_active = active;
+	spin_unlock_irqrestore(&fd->lock, flags);
+
+	if (active)
+		fd_input_enable(fd);
+	return 0;
+}
+
+void fd_rules_get(struct fd_dev *fd, struct fd_rule *rules)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&fd->lock, flags);
+	memcpy(rules, fd->rules, sizeof(fd->rules));
+	spin_unlock_irqrestore(&fd->lock, flags);
+}
+
+/*
+ * Program and arm the output: like __fd_zio_output_stage, but faster.
+ * As any direct configuration, this discards the queue of the channel.
+ */
+static void __fd_rule_fire(struct fd_dev *fd, struct fd_rule *r,
+			   struct fd_rule_hw *h, struct fd_time *t)
+{
+	struct fd_out_queue *q = fd->queue + r->channel;
+	struct fd_time start = *t, end;
+	int ch = r->channel;
+
+	__fd_queue_flush(fd, ch);
+	fd_time_add(&start, &h->start);
+	end = start;
+	fd_time_add(&end, &h->width);
+
+	fd_ch_writel_cached(fd, ch, fd->ch[ch].frr_cur, FD_REG_FRR);
+
+	fd_ch_writel_cached(fd, ch, start.utc >> 32,  FD_REG_U_STARTH);
+	fd_ch_writel_cached(fd, ch, start.utc,        FD_REG_U_STARTL);
+	fd_ch_writel_cached(fd, ch, start.coarse,     FD_REG_C_START);
+	fd_ch_writel_cached(fd, ch, start.frac,       FD_REG_F_START);
+
+	fd_ch_writel_cached(fd, ch, end.utc >> 32,    FD_REG_U_ENDH);
+	fd_ch_writel_cached(fd, ch, end.utc,          FD_REG_U_ENDL);
+	fd_ch_writel_cached(fd, ch, end.coarse,       FD_REG_C_END);
+	fd_ch_writel_cached(fd, ch, end.frac,         FD_REG_F_END);
+
+	fd_ch_writel_cached(fd, ch, h->delta.utc,     FD_REG_U_DELTA);
+	fd_ch_writel_cached(fd, ch, h->delta.coarse,  FD_REG_C_DELTA);
+	fd_ch_writel_cached(fd, ch, h->delta.frac,    FD_REG_F_DELTA);
+
+	fd_ch_writel_cached(fd, ch, h->rcr, FD_REG_RCR);
+	fd_ch_writel(fd, ch, h->dcr, FD_REG_DCR);
+
+	/* The "triggers" file reports the start time as the user sees it */
+	q->staged = *t;
+	fd_time_add(&q->staged, &h->user);
+	/* The output timer needs the train in board time */
+	q->staged_begin = start.utc * NSEC_PER_SEC + start.coarse * 8;
+	q->staged_end = ~0ULL;
+	if (h->train_ns != ~0ULL)
+		q->staged_end = q->staged_begin + h->train_ns;
+	__fd_zio_output_arm(fd, ch, h->dcr);
+}
+
+/*
+ * Evaluate the rules for a new (normalized) input stamp. Called with the
+ * lock held, from fd_read_hw_fifo(). Returns the number of outputs armed.
+ */
+int __fd_rules_run(struct fd_dev *fd, struct fd_time *t)
+{
+	struct fd_rule *r;
+	struct fd_rule_hw *h;
+	uint64_t t_ns, now_ns, start_ns;
+	int i, skip, fired = 0, now_ok = -1;
+
+	if (!fd->rules_active)
+		return 0;
+	t_ns = t->utc * NSEC_PER_SEC + t->coarse * 8;
+
+	for (i = 0, r = fd->rules, h = fd->rules_hw; i < FD_RULES_N;
+	     i++, r++, h++) {
+		if (!(r->flags & FD_RULE_ENABLE))
+			continue;
+		if (t_ns < r->gate_start_ns)
+			continue;
+		if (r->gate_end_ns && t_ns >= r->gate_end_ns)
+			continue;
+		r->edges++;
+		/* Divider: act on the first edge of every group */
+		skip = h->div_count++;
+		if (h->div_count >= r->divider)
+			h->div_count = 0;
+		if (skip)
+			continue;
+
+		__fd_rule_fire(fd, r, h, t);
+		r->fired++;
+		fired++;
+
+		/* Latency: estimated from the time page, no register access */
+		if (now_ok < 0)
+			now_ok = __fd_time_board_now(fd, &now_ns);
+		if (now_ok != 0 || now_ns < t_ns)
+			continue;
+		r->lat_last_ns = min_t(uint64_t, now_ns - t_ns, ~0U);
+		if (r->lat_last_ns > r->lat_max_ns)
+			r->lat_max_ns = r->lat_last_ns;
+		start_ns = t_ns + h->delay_ns;
+		if (now_ns > start_ns)
+			r->late++;
+	}
+	return fired;
+}
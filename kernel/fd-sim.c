@@ -0,0 +1,1222 @@
+/*
+ * A fake FMC carrier with simulated fine-delay cards: no hardware needed
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+
+/*
+ * This module registers "boards" mezzanines on the fmc bus, and answers
+ * the register accesses of the real driver the way the gateware does:
+ * the SDB tree, the core registers with the chips behind them (ACAM,
+ * PLL, DAC, GPIO expander, thermometer), the time-stamp buffer, the
+ * four output channels and the VIC. The eeprom holds a valid calibration.
+ *
+ * The board time is the host monotonic clock plus an offset. A timer
+ * running every "tick_us" feeds the input with "rate" pulses per second,
+ * runs the output pulse trains and raises the interrupt like the
+ * gateware does, so the driver, zio and the library above it can be
+ * loaded with a known stream of stamps in a virtual machine.
+ *
+ * What is not there: White Rabbit never locks, the DMTD and the raw
+ * TDC registers read as zero, and the outputs in delay mode are
+ * counted but not time-stamped.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/device.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/fmc.h>
+#include <linux/fmc-sdb.h>
+
+#include "fine-delay.h"
+#include "fd-time.h"
+#include "hw/fd_main_regs.h"
+#include "hw/fd_channel_regs.h"
+#include "hw/vic_regs.h"
+#include "hw/acam_gpx.h"
+
+static int fds_boards = 1;
+module_param_named(boards, fds_boards, int, 0444);
+
+/* Pulses per second on the input of each board; 0 to stop them */
+static unsigned int fds_rate = 1000;
+module_param_named(rate, fds_rate, uint, 0644);
+
+static int fds_tick_us = 100;
+module_param_named(tick_us, fds_tick_us, int, 0444);
+
+/* Depth of the hardware time-stamp buffer, in stamps */
+static int fds_tsb_len = 1024;
+module_param_named(tsb_len, fds_tsb_len, int, 0444);
+
+/* Temperature of the thermometer, in 1/16 degrees (like the DS18B20) */
+static int fds_temp = 45 * 16;
+module_param_named(temp, fds_temp, int, 0644);
+
+#define FDS_MAX_BOARDS	16
+#define FDS_DEVICE_ID	0xfd00		/* then 0xfd01 and so on */
+
+/* The memory map of the gateware, as described by SDB */
+#define FDS_CORE_ADDR	0x80000
+#define FDS_CORE_LEN	0x800
+#define FDS_VIC_ADDR	0x90000
+#define FDS_VIC_LEN	0x100
+#define FDS_MEMLEN	0xa0000
+#define FDS_CORE_REGS	64		/* 0x00..0xfc, then the channels */
+#define FDS_CH_BASE	0x100
+#define FDS_CH_SIZE	0x100
+#define FDS_OW_BASE	0x500
+
+/* The eeprom: FRU information, then SDBFS, then the calibration file */
+#define FDS_EE_LEN	8192
+#define FDS_EE_SDBFS	0x200
+#define FDS_EE_CALIB	0x400
+
+/* Pulses of a train run in one tick, at most; the rest is left for later */
+#define FDS_TRAIN_MAX	4096
+
+/* The delay line: bias and taps per 8ns of each channel (the real ~860) */
+#define FDS_DELAY_BIAS	1000
+static const int fds_taps_8ns[FD_CH_NUMBER] = {859, 867, 854, 859};
+
+/* The 1-wire master: onewire.c has the complete list */
+#define FDS_OW_CSR	0x0
+#define FDS_OW_CDR	0x4
+#define FDS_OW_DAT	(1 << 0)
+#define FDS_OW_RST	(1 << 1)
+#define FDS_OW_CYC	(1 << 3)
+
+enum fds_ow_state {
+	FDS_OW_ROM = 0,		/* after reset: a ROM command */
+	FDS_OW_MATCH,		/* receiving the 8 bytes of a ROM match */
+	FDS_OW_FUNC,		/* a function command */
+	FDS_OW_WRITE,		/* receiving the 3 bytes of the scratchpad */
+};
+
+struct fds_ch {
+	uint32_t r[FD_CH_SHADOW_N];	/* as written, DCR status excluded */
+	int upd_done, armed, trig;
+	struct fd_time seen;		/* the comparator ran up to here */
+
+	/* Latched by DCR_UPDATE, like the gateware does */
+	struct fd_time start;
+	int64_t delta_ps;
+	int reps;			/* -1 is continuous */
+
+	/* The train being output */
+	struct fd_time next;
+	int left;
+};
+
+struct fds {
+	struct fmc_device *fmc;
+	spinlock_t lock;
+	struct hrtimer timer;
+	irq_handler_t handler;
+	int irq_on, vic_busy;
+
+	union sdb_record sdb[3];
+	uint8_t eeprom[FDS_EE_LEN];
+
+	/* Core registers and what lives behind them */
+	uint32_t r[FDS_CORE_REGS];
+	uint32_t eic_imr;
+	uint32_t acam[16];
+	uint8_t mcp[32];
+	uint32_t dac;
+	struct fds_ch ch[FD_CH_NUMBER];
+
+	/* The 1-wire thermometer */
+	uint32_t ow_csr, ow_cdr;
+	enum fds_ow_state ow_state;
+	uint8_t ow_rom[8], ow_scratch[9], ow_out[9];
+	int ow_out_bits, ow_out_pos;	/* what we are sending */
+	int ow_in, ow_in_bits, ow_count; /* what we are receiving */
+
+	/* VIC */
+	uint32_t vic_ctl, vic_imr, vic_swir;
+
+	/* Board time is host time plus this, and the input */
+	struct fd_time offset;
+	struct fd_time in_next;
+	uint64_t in_period_ps;
+	unsigned int in_rate;
+
+	/* Time-stamp buffer: the channel is 0 for the input, 1..4 outputs */
+	struct fd_time *tsb;
+	int tsb_head, tsb_n;
+	s64 tsb_since;			/* host ns, when it became non-empty */
+	uint16_t seq[FD_CH_NUMBER + 1];
+
+	u64 stamps, lost, pulses, irqs, missed;
+};
+
+static struct fds *fds_boards_s[FDS_MAX_BOARDS];
+static struct fmc_device *fds_fmc[FDS_MAX_BOARDS];
+
+static void fds_carrier_release(struct device *dev)
+{
+	/* nothing to do: it's static */
+}
+
+static struct device fds_carrier = {
+	.init_name = "fmc-fd-sim",
+	.release = fds_carrier_release,
+};
+
+/*
+ * Time
+ */
+static void fds_host_time(struct fd_time *t, s64 ns)
+{
+	uint32_t rem;
+
+	t->utc = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+	t->coarse = rem >> 3;
+	t->frac = (rem & 7) * (FD_TIME_FRAC_N / 8);
+}
+
+static void fds_now(struct fds *s, struct fd_time *t, s64 *host_ns)
+{
+	s64 ns = ktime_to_ns(ktime_get());
+
+	fds_host_time(t, ns);
+	fd_time_add(t, &s->offset);
+	if (host_ns)
+		*host_ns = ns;
+}
+
+/* The input starts again after the time or the rate change */
+static void fds_input_restart(struct fds *s, struct fd_time *now)
+{
+	s->in_rate = ACCESS_ONCE(fds_rate);
+	s->in_period_ps = s->in_rate ? div_u64(FD_TIME_PS_PER_SEC, s->in_rate)
+		: 0;
+	s->in_next = *now;
+	if (s->in_period_ps)
+		fd_time_add_ps(&s->in_next, s->in_period_ps);
+}
+
+/*
+ * Time-stamp buffer
+ */
+static void fds_tsb_flush(struct fds *s)
+{
+	s->tsb_head = s->tsb_n = 0;
+}
+
+/* Returns 0 if not stamped at all, -1 if lost because the buffer is full */
+static int fds_tsb_push(struct fds *s, struct fd_time *t, int channel,
+			s64 host_ns)
+{
+	uint32_t tsbcr = s->r[FD_REG_TSBCR / 4];
+	struct fd_time *e;
+
+	if (!(tsbcr & FD_TSBCR_ENABLE)
+	    || !(FD_TSBCR_CHAN_MASK_R(tsbcr) & (1 << channel)))
+		return 0;
+	if (s->tsb_n == fds_tsb_len) {
+		s->seq[channel]++;
+		s->lost++;
+		return -1;
+	}
+	e = s->tsb + (s->tsb_head + s->tsb_n) % fds_tsb_len;
+	*e = *t;
+	e->channel = channel;
+	e->seq_id = s->seq[channel]++;
+	if (!s->tsb_n++)
+		s->tsb_since = host_ns;
+	s->stamps++;
+	return 1;
+}
+
+static void fds_tsb_pop(struct fds *s)
+{
+	struct fd_time *e = s->tsb + s->tsb_head;
+
+	if (!s->tsb_n)
+		return; /* the registers keep the last one */
+	s->r[FD_REG_TSBR_SECH / 4] = (e->utc >> 32) & 0xff;
+	s->r[FD_REG_TSBR_SECL / 4] = e->utc & 0xffffffff;
+	s->r[FD_REG_TSBR_CYCLES / 4] = e->coarse;
+	s->r[FD_REG_TSBR_FID / 4] = FD_TSBR_FID_CHANNEL_W(e->channel)
+		| FD_TSBR_FID_FINE_W(e->frac)
+		| FD_TSBR_FID_SEQID_W(e->seq_id);
+	s->tsb_head = (s->tsb_head + 1) % fds_tsb_len;
+	s->tsb_n--;
+}
+
+static uint32_t fds_tsbcr(struct fds *s)
+{
+	uint32_t v = s->r[FD_REG_TSBCR / 4];
+
+	v &= FD_TSBCR_CHAN_MASK_MASK | FD_TSBCR_ENABLE | FD_TSBCR_RAW;
+	v |= FD_TSBCR_COUNT_W(min(s->tsb_n, (int)FD_TSBCR_COUNT_MASK
+				  >> FD_TSBCR_COUNT_SHIFT));
+	if (!s->tsb_n)
+		v |= FD_TSBCR_EMPTY;
+	if (s->tsb_n == fds_tsb_len)
+		v |= FD_TSBCR_FULL;
+	return v;
+}
+
+/*
+ * The interrupt is pending when the threshold is reached or the oldest
+ * stamp timed out. The timeout counts milliseconds (see fd-irq.c)
+ */
+static uint32_t fds_eic_isr(struct fds *s, s64 host_ns)
+{
+	uint32_t tsbir = s->r[FD_REG_TSBIR / 4];
+
+	if (!s->tsb_n)
+		return 0;
+	if (s->tsb_n >= FD_TSBIR_THRESHOLD_R(tsbir)
+	    || host_ns - s->tsb_since
+	       >= (s64)FD_TSBIR_TIMEOUT_R(tsbir) * NSEC_PER_MSEC)
+		return FD_EIC_ISR_TS_BUF_NOTEMPTY;
+	return 0;
+}
+
+static uint32_t fds_vic_risr(struct fds *s)
+{
+	s64 ns = ktime_to_ns(ktime_get());
+
+	return ((fds_eic_isr(s, ns) & s->eic_imr) ? 1 : 0) | s->vic_swir;
+}
+
+/*
+ * Output channels
+ */
+static void fds_ch_update(struct fds_ch *c)
+{
+	uint32_t rcr = c->r[FD_REG_RCR / 4];
+
+	c->start.utc = ((uint64_t)(c->r[FD_REG_U_STARTH / 4] & 0xff) << 32)
+		| c->r[FD_REG_U_STARTL / 4];
+	c->start.coarse = c->r[FD_REG_C_START / 4];
+	c->start.frac = c->r[FD_REG_F_START / 4] & (FD_TIME_FRAC_N - 1);
+	c->delta_ps = (int64_t)(c->r[FD_REG_U_DELTA / 4] & 0xf)
+		* FD_TIME_PS_PER_SEC
+		+ fd_time_cf_to_ps(c->r[FD_REG_C_DELTA / 4],
+				   c->r[FD_REG_F_DELTA / 4]
+				   & (FD_TIME_FRAC_N - 1));
+	c->reps = rcr & FD_RCR_CONT ? -1 : FD_RCR_REP_CNT_R(rcr) + 1;
+	c->upd_done = 1;
+}
+
+static void fds_ch_dcr(struct fds *s, int ch, uint32_t v)
+{
+	struct fds_ch *c = s->ch + ch;
+
+	c->r[FD_REG_DCR / 4] = v & (FD_DCR_ENABLE | FD_DCR_MODE
+				    | FD_DCR_FORCE_DLY | FD_DCR_NO_FINE
+				    | FD_DCR_FORCE_HI);
+	c->upd_done = 0;
+	if (v & FD_DCR_UPDATE)
+		fds_ch_update(c);
+	if (!(v & FD_DCR_ENABLE)) {
+		c->armed = c->trig = c->left = 0;
+		return;
+	}
+	if ((v & FD_DCR_PG_ARM) && (v & FD_DCR_MODE)) {
+		c->armed = 1;
+		c->trig = 0;
+		fds_now(s, &c->seen, NULL);
+	}
+}
+
+/*
+ * Trigger and run the pulse train of one channel. Called with the lock.
+ * The gateware fires when the time counter equals the start: only a
+ * start between the previous run (or arming) and now does it. A start
+ * that was already past when armed is missed, and PG_TRIG stays clear.
+ */
+static void fds_ch_run(struct fds *s, int ch, struct fd_time *now,
+		       s64 host_ns)
+{
+	struct fds_ch *c = s->ch + ch;
+	int n;
+
+	if (c->armed && fd_time_cmp(now, &c->start) >= 0) {
+		c->armed = 0;
+		if (fd_time_cmp(&c->start, &c->seen) >= 0) {
+			c->trig = 1;
+			c->next = c->start;
+			c->left = c->reps;
+		} else {
+			s->missed++;
+		}
+	}
+	c->seen = *now;
+	for (n = 0; c->left && n < FDS_TRAIN_MAX; n++) {
+		if (fd_time_cmp(&c->next, now) > 0)
+			break;
+		s->pulses++;
+		fds_tsb_push(s, &c->next, ch + 1, host_ns);
+		if (c->left > 0)
+			c->left--;
+		if (!c->delta_ps)
+			c->left = 0;
+		fd_time_add_ps(&c->next, c->delta_ps);
+	}
+}
+
+/*
+ * The chips behind the core: ACAM (through TDR/TDCSR), SPI devices
+ */
+static uint32_t fds_acam_read(struct fds *s, int reg)
+{
+	if (reg == 12)
+		return s->acam[12] & ~AR12_NotLocked;
+	return s->acam[reg];
+}
+
+/* A calibration pulse: the delay of the channel, in ACAM bins */
+static void fds_cal_pulse(struct fds *s, uint32_t calr)
+{
+	uint32_t ar7 = s->acam[7], hsdiv, refdiv;
+	uint64_t tref_fp, bin_fp, ps;
+	int ch;
+
+	ch = ffs(FD_CALR_PSEL_R(calr)) - 1;
+	if (ch < 0 || ch >= FD_CH_NUMBER)
+		return;
+	hsdiv = ar7 & 0xff;
+	refdiv = (ar7 >> 8) & 7;
+	tref_fp = div_u64(1000ULL * 1000 * 1000 << 16, ACAM_CLOCK_FREQ_KHZ);
+	bin_fp = 80 << 16;
+	if (hsdiv)
+		bin_fp = div_u64(div_u64(tref_fp << refdiv, 216), hsdiv) + 1;
+
+	ps = FDS_DELAY_BIAS + div_u64((uint64_t)s->ch[ch].r[FD_REG_FRR / 4]
+				      * 8000, fds_taps_8ns[ch]);
+	s->acam[8] = div64_u64(ps << 16, bin_fp) & 0x1ffff;
+}
+
+static uint32_t fds_spi(struct fds *s, uint32_t scr)
+{
+	uint32_t d = FD_SCR_DATA_R(scr), reg;
+
+	if (scr & FD_SCR_SEL_PLL) {
+		/* AD9516: bit 23 is read, 13 bits of address, 8 of data */
+		reg = (d >> 8) & 0x1fff;
+		if (!(d & (1 << 23)))
+			return d;
+		if (reg == 0x003)
+			return 0xc3; /* part ID */
+		if (reg == 0x01f)
+			return 0x01; /* locked */
+		return 0;
+	}
+	if (scr & FD_SCR_SEL_GPIO) {
+		/* MCP23S17: opcode, register, data */
+		reg = (d >> 8) & 0x1f;
+		if ((d >> 16) == 0x4e)
+			s->mcp[reg] = d & 0xff;
+		else if ((d >> 16) == 0x4f)
+			d = (d & ~0xff) | s->mcp[reg];
+		return d;
+	}
+	s->dac = d & 0xffff;
+	return d;
+}
+
+/*
+ * The DS18B20 thermometer, on the 1-wire master
+ */
+static uint8_t fds_ow_crc(uint8_t *data, int len)
+{
+	uint8_t crc = 0;
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x8c : crc >> 1;
+	}
+	return crc;
+}
+
+static void fds_ow_send(struct fds *s, uint8_t *data, int len)
+{
+	memcpy(s->ow_out, data, len);
+	s->ow_out_bits = len * 8;
+	s->ow_out_pos = 0;
+}
+
+static void fds_ow_byte(struct fds *s, uint8_t b)
+{
+	int t;
+
+	switch (s->ow_state) {
+	case FDS_OW_ROM:
+		if (b == 0x33) { /* read ROM */
+			fds_ow_send(s, s->ow_rom, 8);
+			s->ow_state = FDS_OW_FUNC;
+		} else if (b == 0xcc) { /* skip ROM */
+			s->ow_state = FDS_OW_FUNC;
+		} else if (b == 0x55) { /* match ROM */
+			s->ow_state = FDS_OW_MATCH;
+			s->ow_count = 8;
+		}
+		break;
+	case FDS_OW_MATCH:
+		if (!--s->ow_count)
+			s->ow_state = FDS_OW_FUNC;
+		break;
+	case FDS_OW_WRITE: /* TH, TL, config */
+		s->ow_scratch[5 - s->ow_count] = b;
+		if (!--s->ow_count)
+			s->ow_state = FDS_OW_FUNC;
+		break;
+	case FDS_OW_FUNC:
+		if (b == 0x44) { /* convert */
+			t = ACCESS_ONCE(fds_temp);
+			s->ow_scratch[0] = t & 0xff;
+			s->ow_scratch[1] = (t >> 8) & 0xff;
+		} else if (b == 0xbe) { /* read scratchpad */
+			s->ow_scratch[8] = fds_ow_crc(s->ow_scratch, 8);
+			fds_ow_send(s, s->ow_scratch, 9);
+		} else if (b == 0x4e) { /* write scratchpad */
+			s->ow_state = FDS_OW_WRITE;
+			s->ow_count = 3;
+		}
+		break;
+	}
+}
+
+/* Every access is a complete cycle: CYC is never seen busy */
+static void fds_ow_csr_write(struct fds *s, uint32_t v)
+{
+	int bit = v & FDS_OW_DAT;
+
+	s->ow_csr = v & ~FDS_OW_CYC;
+	if (!(v & FDS_OW_CYC))
+		return;
+	if (v & FDS_OW_RST) {
+		s->ow_state = FDS_OW_ROM;
+		s->ow_out_bits = s->ow_in = s->ow_in_bits = 0;
+		s->ow_csr &= ~FDS_OW_DAT; /* presence pulse */
+		return;
+	}
+	if (s->ow_out_pos < s->ow_out_bits) {
+		/* read slot: the master writes 1 and we pull down for 0 */
+		bit &= s->ow_out[s->ow_out_pos / 8] >> (s->ow_out_pos % 8);
+		s->ow_out_pos++;
+	} else {
+		s->ow_in |= bit << s->ow_in_bits;
+		if (++s->ow_in_bits == 8) {
+			fds_ow_byte(s, s->ow_in);
+			s->ow_in = s->ow_in_bits = 0;
+		}
+	}
+	s->ow_csr = (s->ow_csr & ~FDS_OW_DAT) | (bit & 1);
+}
+
+static void fds_ow_reset(struct fds *s, int index)
+{
+	static const uint8_t scratch[] = {
+		0x50, 0x05, 0x4b, 0x46, 0x7f, 0xff, 0x0c, 0x10 /* 85 C */
+	};
+
+	s->ow_rom[0] = 0x28; /* DS18B20 family */
+	s->ow_rom[1] = 0x5d;
+	s->ow_rom[2] = 0xf1;
+	s->ow_rom[3] = index;
+	s->ow_rom[7] = fds_ow_crc(s->ow_rom, 7);
+	memcpy(s->ow_scratch, scratch, sizeof(scratch));
+	s->ow_state = FDS_OW_ROM;
+	s->ow_out_bits = s->ow_in = s->ow_in_bits = 0;
+}
+
+/*
+ * Resets, as requested through RSTR
+ */
+static void fds_reset_fmc(struct fds *s)
+{
+	memset(s->acam, 0, sizeof(s->acam));
+	memset(s->mcp, 0, sizeof(s->mcp));
+	s->mcp[0x00] = s->mcp[0x01] = 0xff; /* IODIR: all inputs */
+	s->dac = 0;
+	fds_ow_reset(s, s->fmc->slot_id);
+}
+
+static void fds_reset_core(struct fds *s)
+{
+	struct fd_time now;
+
+	memset(s->r, 0, sizeof(s->r));
+	memset(s->ch, 0, sizeof(s->ch));
+	memset(s->seq, 0, sizeof(s->seq));
+	s->eic_imr = 0;
+	fds_tsb_flush(s);
+	memset(&s->offset, 0, sizeof(s->offset));
+	fds_host_time(&now, ktime_to_ns(ktime_get()));
+	fd_time_sub(&s->offset, &now); /* the counter restarts from 0 */
+	fds_now(s, &now, NULL);
+	fds_input_restart(s, &now);
+}
+
+/*
+ * Register access: everything is under the lock, called by read32/write32
+ */
+static uint32_t fds_ch_read(struct fds *s, int ch, int reg)
+{
+	struct fds_ch *c = s->ch + ch;
+	struct fd_time now;
+	s64 ns;
+	uint32_t v;
+
+	if (reg != FD_REG_DCR)
+		return c->r[reg / 4];
+	fds_now(s, &now, &ns);
+	fds_ch_run(s, ch, &now, ns); /* so PG_TRIG is exact */
+	v = c->r[FD_REG_DCR / 4];
+	if (c->upd_done)
+		v |= FD_DCR_UPD_DONE;
+	if (c->trig)
+		v |= FD_DCR_PG_TRIG;
+	return v;
+}
+
+static uint32_t fds_core_read(struct fds *s, int off)
+{
+	struct fd_time now;
+	s64 ns;
+
+	if (off >= FDS_OW_BASE)
+		return off == FDS_OW_BASE + FDS_OW_CSR ? s->ow_csr
+			: off == FDS_OW_BASE + FDS_OW_CDR ? s->ow_cdr : 0;
+	if (off >= FDS_CH_BASE) {
+		off -= FDS_CH_BASE;
+		if (off / FDS_CH_SIZE >= FD_CH_NUMBER
+		    || off % FDS_CH_SIZE >= FD_CH_SHADOW_N * 4)
+			return 0;
+		return fds_ch_read(s, off / FDS_CH_SIZE, off % FDS_CH_SIZE);
+	}
+
+	switch (off) {
+	case FD_REG_IDR:
+		return FD_MAGIC_FPGA;
+	case FD_REG_GCR:
+		return s->r[off / 4] | FD_GCR_DDR_LOCKED | FD_GCR_FMC_PRESENT;
+	case FD_REG_TSBCR:
+		return fds_tsbcr(s);
+	case FD_REG_EIC_IMR:
+		return s->eic_imr;
+	case FD_REG_EIC_ISR:
+		fds_now(s, &now, &ns);
+		return fds_eic_isr(s, ns);
+	case FD_REG_SCR:
+		return s->r[off / 4] | FD_SCR_READY;
+	case FD_REG_I2CR: /* nobody on the bus: lines read what we drive */
+		return (s->r[off / 4] & (FD_I2CR_SCL_OUT | FD_I2CR_SDA_OUT))
+			| (s->r[off / 4] & FD_I2CR_SCL_OUT ? FD_I2CR_SCL_IN : 0)
+			| (s->r[off / 4] & FD_I2CR_SDA_OUT ? FD_I2CR_SDA_IN : 0);
+	}
+	return s->r[off / 4];
+}
+
+static void fds_core_write(struct fds *s, int off, uint32_t v)
+{
+	struct fd_time now, t;
+	int ch;
+
+	if (off >= FDS_OW_BASE) {
+		if (off == FDS_OW_BASE + FDS_OW_CSR)
+			fds_ow_csr_write(s, v);
+		else if (off == FDS_OW_BASE + FDS_OW_CDR)
+			s->ow_cdr = v;
+		return;
+	}
+	if (off >= FDS_CH_BASE) {
+		off -= FDS_CH_BASE;
+		ch = off / FDS_CH_SIZE;
+		off %= FDS_CH_SIZE;
+		if (ch >= FD_CH_NUMBER || off >= FD_CH_SHADOW_N * 4)
+			return;
+		if (off == FD_REG_DCR)
+			fds_ch_dcr(s, ch, v);
+		else
+			s->ch[ch].r[off / 4] = v;
+		return;
+	}
+
+	switch (off) {
+	case FD_REG_RSTR:
+		if (FD_RSTR_LOCK_R(v) != 0xdead)
+			return;
+		/* Reset is active low */
+		if (!(v & FD_RSTR_RST_CORE_MASK))
+			fds_reset_core(s);
+		if (!(v & FD_RSTR_RST_FMC_MASK))
+			fds_reset_fmc(s);
+		s->r[off / 4] = v & ~FD_RSTR_LOCK_MASK;
+		return;
+	case FD_REG_IDR:
+		return;
+	case FD_REG_GCR:
+		s->r[off / 4] = v & (FD_GCR_BYPASS | FD_GCR_INPUT_EN);
+		return;
+	case FD_REG_TCR:
+		if (v & FD_TCR_CAP_TIME) {
+			fds_now(s, &now, NULL);
+			s->r[FD_REG_TM_SECH / 4] = (now.utc >> 32) & 0xff;
+			s->r[FD_REG_TM_SECL / 4] = now.utc & 0xffffffff;
+			s->r[FD_REG_TM_CYCLES / 4] = now.coarse;
+		}
+		if (v & FD_TCR_SET_TIME) {
+			t.utc = ((uint64_t)(s->r[FD_REG_TM_SECH / 4] & 0xff)
+				 << 32) | s->r[FD_REG_TM_SECL / 4];
+			t.coarse = s->r[FD_REG_TM_CYCLES / 4];
+			t.frac = 0;
+			fds_host_time(&now, ktime_to_ns(ktime_get()));
+			s->offset = t;
+			fd_time_sub(&s->offset, &now);
+			fds_input_restart(s, &t);
+			/* The counter jumped: compare from the new time */
+			for (ch = 0; ch < FD_CH_NUMBER; ch++)
+				s->ch[ch].seen = t;
+		}
+		s->r[off / 4] = v & FD_TCR_WR_ENABLE; /* WR never locks */
+		return;
+	case FD_REG_TDCSR:
+		/* The address is on the GPIO expander, port B */
+		if (v & FD_TDCSR_READ)
+			s->r[FD_REG_TDR / 4] =
+				fds_acam_read(s, s->mcp[0x15] & 0xf);
+		if (v & FD_TDCSR_WRITE)
+			s->acam[s->mcp[0x15] & 0xf] =
+				s->r[FD_REG_TDR / 4] & ACAM_MASK;
+		return;
+	case FD_REG_CALR:
+		if (v & FD_CALR_CAL_PULSE)
+			fds_cal_pulse(s, v);
+		s->r[off / 4] = v & ~FD_CALR_CAL_PULSE;
+		return;
+	case FD_REG_SCR:
+		v &= ~FD_SCR_READY;
+		if (v & FD_SCR_START)
+			v = (v & ~(FD_SCR_START | FD_SCR_DATA_MASK))
+				| FD_SCR_DATA_W(fds_spi(s, v));
+		s->r[off / 4] = v;
+		return;
+	case FD_REG_TSBCR:
+		if (v & FD_TSBCR_PURGE)
+			fds_tsb_flush(s);
+		if (v & FD_TSBCR_RST_SEQ)
+			memset(s->seq, 0, sizeof(s->seq));
+		s->r[off / 4] = v & (FD_TSBCR_CHAN_MASK_MASK
+				     | FD_TSBCR_ENABLE | FD_TSBCR_RAW);
+		return;
+	case FD_REG_TSBR_ADVANCE:
+		if (v & FD_TSBR_ADVANCE_ADV)
+			fds_tsb_pop(s);
+		return;
+	case FD_REG_EIC_IER:
+		s->eic_imr |= v;
+		return;
+	case FD_REG_EIC_IDR:
+		s->eic_imr &= ~v;
+		return;
+	case FD_REG_EIC_IMR:
+	case FD_REG_EIC_ISR: /* the only source is a level */
+		return;
+	}
+	s->r[off / 4] = v;
+}
+
+static uint32_t fds_vic_read(struct fds *s, int off)
+{
+	switch (off) {
+	case VIC_REG_CTL:
+		return s->vic_ctl;
+	case VIC_REG_RISR:
+		return fds_vic_risr(s);
+	case VIC_REG_IMR:
+		return s->vic_imr;
+	}
+	return 0;
+}
+
+static void fds_vic_write(struct fds *s, int off, uint32_t v)
+{
+	switch (off) {
+	case VIC_REG_CTL:
+		s->vic_ctl = v;
+		break;
+	case VIC_REG_IER:
+		s->vic_imr |= v & 1;
+		break;
+	case VIC_REG_IDR:
+		s->vic_imr &= ~v;
+		break;
+	case VIC_REG_SWIR:
+		s->vic_swir |= v & 1;
+		break;
+	case VIC_REG_EOIR:
+		s->vic_busy = 0;
+		s->vic_swir = 0;
+		break;
+	}
+}
+
+/*
+ * The carrier: fmc operations
+ */
+static uint32_t fds_read32(struct fmc_device *fmc, int offset)
+{
+	struct fds *s = fmc->carrier_data;
+	unsigned long flags;
+	uint32_t v = 0;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (offset < sizeof(s->sdb))
+		v = be32_to_cpu(*(__be32 *)((void *)s->sdb + (offset & ~3)));
+	else if (offset >= FDS_CORE_ADDR
+		 && offset < FDS_CORE_ADDR + FDS_CORE_LEN)
+		v = fds_core_read(s, (offset - FDS_CORE_ADDR) & ~3);
+	else if (offset >= FDS_VIC_ADDR && offset < FDS_VIC_ADDR + FDS_VIC_LEN)
+		v = fds_vic_read(s, (offset - FDS_VIC_ADDR) & ~3);
+	spin_unlock_irqrestore(&s->lock, flags);
+	return v;
+}
+
+static void fds_write32(struct fmc_device *fmc, uint32_t val, int offset)
+{
+	struct fds *s = fmc->carrier_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (offset >= FDS_CORE_ADDR && offset < FDS_CORE_ADDR + FDS_CORE_LEN)
+		fds_core_write(s, (offset - FDS_CORE_ADDR) & ~3, val);
+	else if (offset >= FDS_VIC_ADDR && offset < FDS_VIC_ADDR + FDS_VIC_LEN)
+		fds_vic_write(s, (offset - FDS_VIC_ADDR) & ~3, val);
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+static int fds_validate(struct fmc_device *fmc, struct fmc_driver *drv)
+{
+	int i;
+
+	if (!drv->busid_n)
+		return 0; /* everything is accepted */
+	for (i = 0; i < drv->busid_n; i++)
+		if (drv->busid_val[i] == fmc->device_id)
+			return i;
+	return -ENOENT;
+}
+
+/* Nothing to load: the gateware is always there, just like new */
+static int fds_reprogram(struct fmc_device *fmc, struct fmc_driver *drv,
+			 char *gw)
+{
+	struct fds *s = fmc->carrier_data;
+	unsigned long flags;
+
+	fmc_free_sdb_tree(fmc); /* fmc_reprogram scans it again */
+	spin_lock_irqsave(&s->lock, flags);
+	fds_reset_core(s);
+	fds_reset_fmc(s);
+	s->vic_ctl = s->vic_imr = s->vic_swir = s->vic_busy = 0;
+	spin_unlock_irqrestore(&s->lock, flags);
+	dev_info(&fmc->dev, "simulated gateware ready\n");
+	return 0;
+}
+
+static int fds_irq_request(struct fmc_device *fmc, irq_handler_t h,
+			   char *name, int flags)
+{
+	struct fds *s = fmc->carrier_data;
+	unsigned long f;
+
+	spin_lock_irqsave(&s->lock, f);
+	if (s->handler) {
+		spin_unlock_irqrestore(&s->lock, f);
+		return -EBUSY;
+	}
+	s->handler = h;
+	spin_unlock_irqrestore(&s->lock, f);
+	return 0;
+}
+
+static void fds_irq_ack(struct fmc_device *fmc)
+{
+	/* nothing to do: the VIC is acked by the driver */
+}
+
+static int fds_irq_free(struct fmc_device *fmc)
+{
+	struct fds *s = fmc->carrier_data;
+
+	/* The handler may be running on another CPU: wait for it */
+	hrtimer_cancel(&s->timer);
+	s->handler = NULL;
+	hrtimer_start(&s->timer, ns_to_ktime(fds_tick_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	return 0;
+}
+
+static int fds_gpio_config(struct fmc_device *fmc, struct fmc_gpio *gpio,
+			   int ngpio)
+{
+	struct fds *s = fmc->carrier_data;
+	int i;
+
+	/* Only the interrupt line means something to us */
+	for (i = 0; i < ngpio; i++, gpio++)
+		s->irq_on = gpio->irqmode != 0;
+	return 0;
+}
+
+static int fds_read_ee(struct fmc_device *fmc, int pos, void *data, int len)
+{
+	struct fds *s = fmc->carrier_data;
+
+	if (pos < 0 || pos + len > FDS_EE_LEN)
+		return -EINVAL;
+	memcpy(data, s->eeprom + pos, len);
+	return len;
+}
+
+static int fds_write_ee(struct fmc_device *fmc, int pos, const void *data,
+			int len)
+{
+	struct fds *s = fmc->carrier_data;
+
+	if (pos < 0 || pos + len > FDS_EE_LEN)
+		return -EINVAL;
+	memcpy(s->eeprom + pos, data, len);
+	return len;
+}
+
+static struct fmc_operations fds_fmc_operations = {
+	.read32 =		fds_read32,
+	.write32 =		fds_write32,
+	.validate =		fds_validate,
+	.reprogram =		fds_reprogram,
+	.irq_request =		fds_irq_request,
+	.irq_ack =		fds_irq_ack,
+	.irq_free =		fds_irq_free,
+	.gpio_config =		fds_gpio_config,
+	.read_ee =		fds_read_ee,
+	.write_ee =		fds_write_ee,
+};
+
+/*
+ * The timer: the input, the outputs and the interrupt
+ */
+static void fds_input_run(struct fds *s, struct fd_time *now, s64 host_ns)
+{
+	uint64_t due, i;
+	int ch, reps, ret = 1;
+
+	if (s->in_rate != ACCESS_ONCE(fds_rate))
+		fds_input_restart(s, now);
+	if (!s->in_period_ps || fd_time_cmp(now, &s->in_next) < 0)
+		return;
+	due = div64_u64(fd_time_diff_ps(now, &s->in_next), s->in_period_ps)
+		+ 1;
+
+	if (!(s->r[FD_REG_GCR / 4] & FD_GCR_INPUT_EN)) {
+		fd_time_add_ps(&s->in_next, due * s->in_period_ps);
+		return;
+	}
+
+	/* Delay mode: every input pulse makes a train on the output */
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		if ((s->ch[ch].r[FD_REG_DCR / 4]
+		     & (FD_DCR_ENABLE | FD_DCR_MODE)) != FD_DCR_ENABLE)
+			continue;
+		reps = s->ch[ch].reps < 0 ? 1 : s->ch[ch].reps;
+		s->pulses += due * reps;
+	}
+
+	/* Once full, the rest is lost all at once: no need to loop */
+	for (i = 0; i < due; i++) {
+		ret = fds_tsb_push(s, &s->in_next, 0, host_ns);
+		if (ret <= 0)
+			break;
+		fd_time_add_ps(&s->in_next, s->in_period_ps);
+	}
+	if (ret < 0) {
+		s->seq[0] += due - i - 1;
+		s->lost += due - i - 1;
+	}
+	fd_time_add_ps(&s->in_next, (due - i) * s->in_period_ps);
+}
+
+static enum hrtimer_restart fds_timer_fn(struct hrtimer *t)
+{
+	struct fds *s = container_of(t, struct fds, timer);
+	struct fmc_device *fmc = s->fmc;
+	irq_handler_t handler = NULL;
+	struct fd_time now;
+	unsigned long flags;
+	s64 ns;
+	int ch;
+
+	spin_lock_irqsave(&s->lock, flags);
+	fds_now(s, &now, &ns);
+	fds_input_run(s, &now, ns);
+	for (ch = 0; ch < FD_CH_NUMBER; ch++)
+		fds_ch_run(s, ch, &now, ns);
+
+	/* The VIC holds the line until the driver writes EOIR */
+	if ((s->vic_ctl & VIC_CTL_ENABLE) && !s->vic_busy && s->irq_on
+	    && (fds_vic_risr(s) & s->vic_imr) && s->handler) {
+		s->vic_busy = 1;
+		s->irqs++;
+		handler = s->handler;
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (handler)
+		handler(fmc->irq, fmc);
+
+	hrtimer_forward_now(t, ns_to_ktime(fds_tick_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * The content of memory: SDB and eeprom
+ */
+static void fds_sdb_component(struct sdb_component *c, uint64_t first,
+			      uint64_t len, uint64_t vendor, uint32_t device,
+			      uint32_t version, char *name, int type)
+{
+	c->addr_first = cpu_to_be64(first);
+	c->addr_last = cpu_to_be64(first + len - 1);
+	c->product.vendor_id = cpu_to_be64(vendor);
+	c->product.device_id = cpu_to_be32(device);
+	c->product.version = cpu_to_be32(version);
+	c->product.date = cpu_to_be32(0x20130427);
+	memset(c->product.name, ' ', sizeof(c->product.name));
+	memcpy(c->product.name, name, strlen(name));
+	c->product.record_type = type;
+}
+
+static void fds_sdb_fill(struct fds *s)
+{
+	struct sdb_interconnect *i = (void *)s->sdb;
+
+	i->sdb_magic = cpu_to_be32(SDB_MAGIC);
+	i->sdb_records = cpu_to_be16(ARRAY_SIZE(s->sdb));
+	i->sdb_version = 1;
+	i->sdb_bus_type = sdb_wishbone;
+	fds_sdb_component(&i->sdb_component, 0, FDS_MEMLEN, 0x651,
+			  0xe6a542c9, 1, "WB4-Crossbar-GSI", sdb_type_interconnect);
+	fds_sdb_component(&s->sdb[1].dev.sdb_component, FDS_CORE_ADDR,
+			  FDS_CORE_LEN, 0xce42, 0xf19ede1a, 3,
+			  "Fine-Delay-Core", sdb_type_device);
+	fds_sdb_component(&s->sdb[2].dev.sdb_component, FDS_VIC_ADDR,
+			  FDS_VIC_LEN, 0xce42, 0x13, 1, "WB-VIC-Int.Control",
+			  sdb_type_device);
+}
+
+/* A FRU string: 8-bit ASCII type, and the length */
+static int fds_fru_string(uint8_t *p, char *str)
+{
+	int len = strlen(str);
+
+	p[0] = 0xc0 | len;
+	memcpy(p + 1, str, len);
+	return len + 1;
+}
+
+static uint8_t fds_fru_checksum(uint8_t *p, int len)
+{
+	uint8_t sum = 0;
+
+	while (len--)
+		sum += *p++;
+	return -sum;
+}
+
+static void fds_eeprom_fill(struct fds *s, int index)
+{
+	uint8_t *ee = s->eeprom, *b = ee + 8;
+	struct sdb_interconnect *i = (void *)(ee + FDS_EE_SDBFS);
+	struct sdb_device *d = (void *)(i + 1);
+	struct fd_calibration *c = (void *)(ee + FDS_EE_CALIB);
+	char serial[16];
+	int n, ch;
+	static const int32_t zero_offset[] = {-38186, -38155, -38147, -38362};
+	static const int64_t frr_poly[] = {
+		-165202LL, -29825595LL, 3801939743082LL
+	};
+
+	/* IPMI FRU: the common header points to the board area at 8 */
+	ee[0] = 1;
+	ee[3] = 1;
+	ee[7] = fds_fru_checksum(ee, 7);
+	b[0] = 1;
+	b[2] = 0; /* English */
+	n = 6;
+	sprintf(serial, "sim-%04x", FDS_DEVICE_ID + index);
+	n += fds_fru_string(b + n, "CERN");
+	n += fds_fru_string(b + n, "FmcDelay1ns4cha");
+	n += fds_fru_string(b + n, serial);
+	n += fds_fru_string(b + n, "EDA-02267-V5");
+	n += fds_fru_string(b + n, "");
+	b[n++] = 0xc1; /* end of fields */
+	n = ALIGN(n + 1, 8);
+	b[1] = n / 8;
+	b[n - 1] = fds_fru_checksum(b, n - 1);
+
+	/* SDBFS, with the calibration as "cali" by "FileData" */
+	i->sdb_magic = cpu_to_be32(SDB_MAGIC);
+	i->sdb_records = cpu_to_be16(2);
+	i->sdb_version = 1;
+	i->sdb_bus_type = sdb_data;
+	fds_sdb_component(&i->sdb_component, 0, FDS_EE_LEN,
+			  0x46696c6544617461LL, 0x5344422d, 1, "eeprom",
+			  sdb_type_interconnect);
+	fds_sdb_component(&d->sdb_component, FDS_EE_CALIB, sizeof(*c),
+			  0x46696c6544617461LL, 0x63616c69, 1, "calib",
+			  sdb_type_device);
+
+	/* The same values as calibration_default, with their hash */
+	c->magic = cpu_to_be32(0xf19ede1a);
+	c->size = cpu_to_be16(sizeof(*c));
+	c->version = cpu_to_be16(3);
+	c->date = cpu_to_be32(0x20130427);
+	for (n = 0; n < ARRAY_SIZE(frr_poly); n++)
+		c->frr_poly[n] = cpu_to_be64(frr_poly[n]);
+	for (ch = 0; ch < FD_CH_NUMBER; ch++)
+		c->zero_offset[ch] = cpu_to_be32(zero_offset[ch]);
+	c->tdc_zero_offset = cpu_to_be32(127500);
+	c->vcxo_default_tune = cpu_to_be32(41711);
+	c->hash = 0;
+	c->hash = cpu_to_be32(jhash(c, sizeof(*c), 0));
+}
+
+/*
+ * Module init and exit
+ */
+static void fds_free(int n)
+{
+	while (n--) {
+		kfree(fds_boards_s[n]->tsb);
+		kfree(fds_boards_s[n]);
+	}
+}
+
+static int fds_init(void)
+{
+	struct fmc_device *fmc;
+	struct fds *s;
+	int i, n, ret;
+
+	if (fds_boards < 1 || fds_boards > FDS_MAX_BOARDS
+	    || fds_tsb_len < 1 || fds_tsb_len > 4095 || fds_tick_us < 1) {
+		pr_err("%s: invalid parameters\n", KBUILD_MODNAME);
+		return -EINVAL;
+	}
+	ret = device_register(&fds_carrier);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < fds_boards; i++) {
+		s = kzalloc(sizeof(*s), GFP_KERNEL);
+		fmc = kzalloc(sizeof(*fmc), GFP_KERNEL); /* the bus frees it */
+		if (s)
+			s->tsb = kcalloc(fds_tsb_len, sizeof(*s->tsb),
+					 GFP_KERNEL);
+		if (!s || !s->tsb || !fmc) {
+			if (s)
+				kfree(s->tsb);
+			kfree(s);
+			kfree(fmc);
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		fds_boards_s[i] = s;
+		fds_fmc[i] = fmc;
+
+		fmc->version = FMC_VERSION;
+		fmc->owner = THIS_MODULE;
+		fmc->op = &fds_fmc_operations;
+		fmc->hwdev = &fds_carrier;
+		fmc->carrier_name = "FD-SIM";
+		fmc->carrier_data = s;
+		fmc->device_id = FDS_DEVICE_ID + i;
+		fmc->slot_id = i;
+		fmc->memlen = FDS_MEMLEN;
+		fmc->eeprom = s->eeprom;
+		fmc->eeprom_len = FDS_EE_LEN;
+
+		s->fmc = fmc;
+		spin_lock_init(&s->lock);
+		fds_sdb_fill(s);
+		fds_eeprom_fill(s, i);
+		fds_reset_core(s);
+		fds_reset_fmc(s);
+		hrtimer_init(&s->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		s->timer.function = fds_timer_fn;
+	}
+
+	for (i = 0; i < fds_boards; i++)
+		hrtimer_start(&fds_boards_s[i]->timer,
+			      ns_to_ktime(fds_tick_us * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	ret = fmc_device_register_n(fds_fmc, fds_boards);
+	if (ret < 0) {
+		for (i = 0; i < fds_boards; i++) {
+			hrtimer_cancel(&fds_boards_s[i]->timer);
+			kfree(fds_fmc[i]);
+		}
+		fds_free(fds_boards);
+		device_unregister(&fds_carrier);
+		return ret;
+	}
+	pr_info("%s: %i simulated boards, %u stamps/s each\n",
+		KBUILD_MODNAME, fds_boards, fds_rate);
+	return 0;
+
+out_free:
+	for (n = i; n--; )
+		kfree(fds_fmc[n]);
+	fds_free(i);
+	device_unregister(&fds_carrier);
+	return ret;
+}
+
+static void fds_exit(void)
+{
+	struct fds *s;
+	int i;
+
+	/* The driver's remove still accesses registers, so this is first */
+	fmc_device_unregister_n(fds_fmc, fds_boards);
+	for (i = 0; i < fds_boards; i++) {
+		s = fds_boards_s[i];
+		hrtimer_cancel(&s->timer);
+		pr_info("%s: board %i: %llu stamps, %llu lost, %llu pulses, "
+			"%llu missed, %llu irqs\n", KBUILD_MODNAME, i,
+			s->stamps, s->lost, s->pulses, s->missed, s->irqs);
+	}
+	fds_free(fds_boards);
+	device_unregister(&fds_carrier);
+}
+
+module_init(fds_init);
+module_exit(fds_exit);
+
+MODULE_LICENSE("GPL and additional rights"); /* LGPL */
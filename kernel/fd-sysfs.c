@@ -0,0 +1,262 @@
+/*
+ * Binary sysfs attributes for the fine-delay device
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/sysfs.h>
+#include <linux/device.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+
+#include <linux/zio.h>
+
+#include "fine-delay.h"
+
+/*
+ * ZIO attributes are 32-bit values, and we are limited to 32 of them
+ * in the control block. Whatever is bigger than that lives here, mostly
+ * as binary files in the sysfs directory of the device.
+ */
+static struct fd_dev *fd_kobj_to_fd(struct kobject *kobj)
+{
+	struct zio_device *zdev;
+
+	zdev = to_zio_dev(container_of(kobj, struct device, kobj));
+	return zdev->priv_d;
+}
+
+/* The time page: both read() and mmap() are supported */
+static ssize_t fd_time_page_read(struct file *f, struct kobject *kobj,
+				 struct bin_attribute *attr,
+				 char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+
+	if (off >= sizeof(*fd->time_page))
+		return 0;
+	if (off + count > sizeof(*fd->time_page))
+		count = sizeof(*fd->time_page) - off;
+	/* The reader must check the sequence number, as with mmap */
+	memcpy(buf, (void *)fd->time_page + off, count);
+	return count;
+}
+
+static int fd_time_page_mmap(struct file *f, struct kobject *kobj,
+			     struct bin_attribute *attr,
+			     struct vm_area_struct *vma)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	return vm_insert_page(vma, vma->vm_start,
+			      virt_to_page(fd->time_page));
+}
+
+/* Batched output configuration: one write of a whole fd_out_batch */
+static ssize_t fd_outputs_write(struct file *f, struct kobject *kobj,
+				struct bin_attribute *attr,
+				char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+	struct fd_out_batch b;
+	int err;
+
+	if (off != 0 || count != sizeof(b))
+		return -EINVAL;
+	memcpy(&b, buf, sizeof(b));
+	err = fd_zio_output_batch(fd, &b);
+	return err ? err : count;
+}
+
+/* The last trigger of each output; poll() is woken by fd-queue.c */
+static ssize_t fd_triggers_read(struct file *f, struct kobject *kobj,
+				struct bin_attribute *attr,
+				char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+	struct fd_time t[FD_CH_NUMBER];
+	unsigned long flags;
+
+	if (off >= sizeof(t))
+		return 0;
+	if (off + count > sizeof(t))
+		count = sizeof(t) - off;
+	spin_lock_irqsave(&fd->lock, flags);
+	memcpy(t, fd->trig, sizeof(t));
+	spin_unlock_irqrestore(&fd->lock, flags);
+	memcpy(buf, (void *)t + off, count);
+	return count;
+}
+
+/* The table of reactive rules: written as a whole, read with statistics */
+static ssize_t fd_rules_read(struct file *f, struct kobject *kobj,
+			     struct bin_attribute *attr,
+			     char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+	struct fd_rule r[FD_RULES_N];
+
+	if (off >= sizeof(r))
+		return 0;
+	if (off + count > sizeof(r))
+		count = sizeof(r) - off;
+	fd_rules_get(fd, r);
+	memcpy(buf, (void *)r + off, count);
+	return count;
+}
+
+static ssize_t fd_rules_write(struct file *f, struct kobject *kobj,
+			      struct bin_attribute *attr,
+			      char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+	struct fd_rule r[FD_RULES_N];
+	int err;
+
+	if (off != 0 || count != sizeof(r))
+		return -EINVAL;
+	memcpy(r, buf, sizeof(r));
+	err = fd_rules_set(fd, r);
+	return err ? err : count;
+}
+
+/* The whole configuration: a snapshot when read, applied when written */
+static ssize_t fd_config_read(struct file *f, struct kobject *kobj,
+			      struct bin_attribute *attr,
+			      char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+	struct fd_config c;
+
+	if (off >= sizeof(c))
+		return 0;
+	if (off + count > sizeof(c))
+		count = sizeof(c) - off;
+	fd_zio_config_get(fd, &c);
+	memcpy(buf, (void *)&c + off, count);
+	return count;
+}
+
+static ssize_t fd_config_write(struct file *f, struct kobject *kobj,
+			       struct bin_attribute *attr,
+			       char *buf, loff_t off, size_t count)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(kobj);
+	struct fd_config c;
+	int err;
+
+	if (off != 0 || count != sizeof(c))
+		return -EINVAL;
+	memcpy(&c, buf, sizeof(c));
+	err = fd_zio_config_set(fd, &c);
+	return err ? err : count;
+}
+
+/* Plain attributes, for what is not part of the ZIO control block */
+static ssize_t fd_mmio_saved_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(&dev->kobj);
+
+	return sprintf(buf, "%lu\n", fd->mmio_saved);
+}
+
+/* Pulse programs skipped because their start was past: "missed-<n>" */
+static ssize_t fd_missed_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct fd_dev *fd = fd_kobj_to_fd(&dev->kobj);
+	int ch = attr->attr.name[strlen(attr->attr.name) - 1] - '1';
+
+	return sprintf(buf, "%u\n", fd->queue[ch].missed);
+}
+
+static struct device_attribute fd_dev_attrs[] = {
+	__ATTR(mmio-saved, S_IRUGO, fd_mmio_saved_show, NULL),
+	__ATTR(missed-1, S_IRUGO, fd_missed_show, NULL),
+	__ATTR(missed-2, S_IRUGO, fd_missed_show, NULL),
+	__ATTR(missed-3, S_IRUGO, fd_missed_show, NULL),
+	__ATTR(missed-4, S_IRUGO, fd_missed_show, NULL),
+};
+
+static struct bin_attribute fd_bin_attrs[] = {
+	{
+		.attr = {.name = "time-page", .mode = S_IRUGO},
+		.size = PAGE_SIZE,
+		.read = fd_time_page_read,
+		.mmap = fd_time_page_mmap,
+	},
+	{
+		.attr = {.name = "outputs", .mode = S_IWUSR},
+		.size = sizeof(struct fd_out_batch),
+		.write = fd_outputs_write,
+	},
+	{
+		.attr = {.name = "triggers", .mode = S_IRUGO},
+		.size = sizeof(struct fd_time) * FD_CH_NUMBER,
+		.read = fd_triggers_read,
+	},
+	{
+		.attr = {.name = "rules", .mode = S_IRUGO | S_IWUSR},
+		.size = sizeof(struct fd_rule) * FD_RULES_N,
+		.read = fd_rules_read,
+		.write = fd_rules_write,
+	},
+	{
+		.attr = {.name = "config", .mode = S_IRUGO | S_IWUSR},
+		.size = sizeof(struct fd_config),
+		.read = fd_config_read,
+		.write = fd_config_write,
+	},
+};
+
+int fd_sysfs_init(struct fd_dev *fd)
+{
+	struct kobject *kobj = &fd->zdev->head.dev.kobj;
+	int i, j, err;
+
+	for (j = 0; j < ARRAY_SIZE(fd_dev_attrs); j++) {
+		err = device_create_file(&fd->zdev->head.dev, fd_dev_attrs + j);
+		if (err)
+			goto out_dev;
+	}
+	for (i = 0; i < ARRAY_SIZE(fd_bin_attrs); i++) {
+		err = sysfs_create_bin_file(kobj, fd_bin_attrs + i);
+		if (err)
+			goto out;
+	}
+	set_bit(FD_FLAG_NOTIFY, &fd->flags);
+	return 0;
+out:
+	while (--i >= 0)
+		sysfs_remove_bin_file(kobj, fd_bin_attrs + i);
+out_dev:
+	while (--j >= 0)
+		device_remove_file(&fd->zdev->head.dev, fd_dev_attrs + j);
+	return err;
+}
+
+void fd_sysfs_exit(struct fd_dev *fd)
+{
+	struct kobject *kobj = &fd->zdev->head.dev.kobj;
+	int i;
+
+	/* Stop notifications before the files (and zdev) go away */
+	clear_bit(FD_FLAG_NOTIFY, &fd->flags);
+	flush_work(&fd->trig_work);
+	for (i = 0; i < ARRAY_SIZE(fd_bin_attrs); i++)
+		sysfs_remove_bin_file(kobj, fd_bin_attrs + i);
+	for (i = 0; i < ARRAY_SIZE(fd_dev_attrs); i++)
+		device_remove_file(&fd->zdev->head.dev, fd_dev_attrs + i);
+}
@@ -0,0 +1,145 @@
+/*
+ * Time arithmetic on struct fd_time, for both the driver and user space
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#ifndef __FD_TIME_H__
+#define __FD_TIME_H__
+
+#include "fine-delay.h"
+
+/*
+ * A time is utc seconds, coarse 8ns ticks (less than 125M) and frac
+ * 1/4096 of a tick (1.953ps). Functions here expect normalized times,
+ * and return them. Picosecond values are converted with truncation
+ * (towards zero for negative offsets); carries are computed without
+ * branches. The driver can't use 64-bit divisions, so 10^12 is split
+ * as 2^12 * 5^12, and we only divide 64 bits by 32.
+ */
+#define FD_TIME_FRAC_N		4096
+#define FD_TIME_COARSE_N	(125 * 1000 * 1000)
+#define FD_TIME_PS_PER_COARSE	8000
+#define FD_TIME_PS_PER_SEC	(1000ULL * 1000 * 1000 * 1000)
+
+#ifdef __KERNEL__
+#define __fd_time_div(n, d, r)	div_u64_rem((n), (d), (r))
+#else
+static inline uint64_t __fd_time_div(uint64_t n, uint32_t d, uint32_t *r)
+{
+	*r = n % d;
+	return n / d;
+}
+#endif
+
+/* Picoseconds within a tick, from frac: frac * 8000 / 4096 */
+static inline uint64_t fd_time_cf_to_ps(uint32_t coarse, uint32_t frac)
+{
+	return (uint64_t)coarse * FD_TIME_PS_PER_COARSE + ((frac * 125) >> 6);
+}
+
+/* Split less than one second; uses 32-bit divisors only */
+static inline void fd_time_ps_to_cf(uint64_t ps, uint32_t *coarse,
+				    uint32_t *frac)
+{
+	uint32_t r;
+
+	*coarse = __fd_time_div(ps >> 6, 125, &r);
+	r = (r << 6) | (ps & 63); /* ps % 8000 */
+	*frac = (r << 12) / FD_TIME_PS_PER_COARSE;
+}
+
+/* Any amount of picoseconds. Only utc, coarse and frac are written */
+static inline void fd_time_from_ps(struct fd_time *t, uint64_t ps)
+{
+	uint32_t r;
+
+	t->utc = __fd_time_div(ps >> 12, 244140625 /* 5^12 */, &r);
+	fd_time_ps_to_cf(((uint64_t)r << 12) | (ps & 0xfff),
+			 &t->coarse, &t->frac);
+}
+
+/* This overflows after 213 days: use it for durations */
+static inline uint64_t fd_time_to_ps(const struct fd_time *t)
+{
+	return t->utc * FD_TIME_PS_PER_SEC + fd_time_cf_to_ps(t->coarse, t->frac);
+}
+
+static inline void fd_time_add(struct fd_time *t, const struct fd_time *d)
+{
+	uint32_t c;
+
+	t->frac += d->frac;
+	c = t->frac >= FD_TIME_FRAC_N;
+	t->frac -= c * FD_TIME_FRAC_N;
+	t->coarse += d->coarse + c;
+	c = t->coarse >= FD_TIME_COARSE_N;
+	t->coarse -= c * FD_TIME_COARSE_N;
+	t->utc += d->utc + c;
+}
+
+static inline void fd_time_sub(struct fd_time *t, const struct fd_time *d)
+{
+	uint32_t b, dc;
+
+	b = t->frac < d->frac;
+	t->frac = t->frac + b * FD_TIME_FRAC_N - d->frac;
+	dc = d->coarse + b;
+	b = t->coarse < dc;
+	t->coarse = t->coarse + b * FD_TIME_COARSE_N - dc;
+	t->utc -= d->utc + b;
+}
+
+/* Signed offsets, over the whole 64-bit range */
+static inline void fd_time_add_ps(struct fd_time *t, int64_t ps)
+{
+	struct fd_time d;
+
+	if (ps >= 0) {
+		fd_time_from_ps(&d, ps);
+		fd_time_add(t, &d);
+	} else {
+		fd_time_from_ps(&d, -(uint64_t)ps);
+		fd_time_sub(t, &d);
+	}
+}
+
+/* a - b, in picoseconds: the result overflows after 106 days */
+static inline int64_t fd_time_diff_ps(const struct fd_time *a,
+				      const struct fd_time *b)
+{
+	return (int64_t)(a->utc - b->utc) * (int64_t)FD_TIME_PS_PER_SEC
+		+ (int64_t)fd_time_cf_to_ps(a->coarse, a->frac)
+		- (int64_t)fd_time_cf_to_ps(b->coarse, b->frac);
+}
+
+static inline int fd_time_cmp(const struct fd_time *a, const struct fd_time *b)
+{
+	if (a->utc != b->utc)
+		return a->utc < b->utc ? -1 : 1;
+	if (a->coarse != b->coarse)
+		return a->coarse < b->coarse ? -1 : 1;
+	if (a->frac != b->frac)
+		return a->frac < b->frac ? -1 : 1;
+	return 0;
+}
+
+/*
+ * The hardware counts stamps in seq_id, in 16 bits: how many are
+ * missing between the one numbered "prev" and the next one, "seq".
+ * Consumers that unwrap sequences must all use this one (a gap of
+ * 64k stamps or more can only be told with the driver counters).
+ */
+#define FD_TIME_SEQ_MOD		0x10000
+
+static inline uint32_t fd_time_seq_gap(uint32_t prev, uint32_t seq)
+{
+	return (seq - prev - 1) & (FD_TIME_SEQ_MOD - 1);
+}
+
+#endif /* __FD_TIME_H__ */
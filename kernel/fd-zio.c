@@ -18,6 +18,7 @@
 #include <linux/jiffies.h>
 #include <linux/bitops.h>
 #include <linux/io.h>
+#include <linux/math64.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
@@ -26,6 +27,7 @@
 #include <linux/fmc.h>
 
 #include "fine-delay.h"
+#include "fd-time.h"
 #include "hw/fd_main_regs.h"
 #include "hw/fd_channel_regs.h"
 
@@ -63,6 +65,12 @@ static struct zio_attribute fd_zattr_input[] = {
 	ZIO_ATTR_EXT("flags", _RW_,		FD_ATTR_TDC_FLAGS, 0),
 	ZIO_ATTR_EXT("offset", _RW_,		FD_ATTR_TDC_OFFSET, 0),
 	ZIO_ATTR_EXT("user-offset", _RW_,	FD_ATTR_TDC_USER_OFF, 0),
+	ZIO_ATTR_EXT("dropped", S_IRUGO,	FD_ATTR_TDC_DROPPED, 0),
+	ZIO_ATTR_EXT("dropped-0", S_IRUGO,	FD_ATTR_TDC_DROPPED_0, 0),
+	ZIO_ATTR_EXT("dropped-1", S_IRUGO,	FD_ATTR_TDC_DROPPED_1, 0),
+	ZIO_ATTR_EXT("dropped-2", S_IRUGO,	FD_ATTR_TDC_DROPPED_2, 0),
+	ZIO_ATTR_EXT("dropped-3", S_IRUGO,	FD_ATTR_TDC_DROPPED_3, 0),
+	ZIO_ATTR_EXT("dropped-4", S_IRUGO,	FD_ATTR_TDC_DROPPED_4, 0),
 };
 
 /* Extended attributes for the output csets (most not-read-nor-write mode) */
@@ -123,6 +131,16 @@ static int fd_zio_info_tdc(struct device *dev, struct zio_attribute *zattr,
 		*usr_val = fd->tdc_flags;
 		return 0;
 	}
+	if (zattr->id == FD_ATTR_TDC_DROPPED) {
+		*usr_val = fd->sw_fifo.dropped;
+		return 0;
+	}
+	if (zattr->id >= FD_ATTR_TDC_DROPPED_0
+	    && zattr->id <= FD_ATTR_TDC_DROPPED_4) {
+		*usr_val = fd->sw_fifo.dropped_ch[zattr->id
+						  - FD_ATTR_TDC_DROPPED_0];
+		return 0;
+	}
 	/*
 	 * Following code is about TDC values, for the last TDC event.
 	 * For efficiency reasons at read_fifo() time, we store an
@@ -163,11 +181,9 @@ static int fd_zio_info_output(struct device *dev, struct zio_attribute *zattr,
 	return 0;
 }
 
-static int fd_wr_mode(struct fd_dev *fd, int on)
+/* Called with the lock held */
+static void __fd_wr_mode(struct fd_dev *fd, int on)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&fd->lock, flags);
 	if (on) {
 		fd_writel(fd, FD_TCR_WR_ENABLE, FD_REG_TCR);
 		set_bit(FD_FLAG_WR_MODE, &fd->flags);
@@ -178,6 +194,16 @@ static int fd_wr_mode(struct fd_dev *fd, int on)
 		fd_spi_xfer(fd, FD_CS_DAC, 24,
 			    fd->calib.vcxo_default_tune & 0xffff, NULL);
 	}
+	/* The board clock changes its source: restart the correlation */
+	__fd_time_page_reset(fd);
+}
+
+static int fd_wr_mode(struct fd_dev *fd, int on)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&fd->lock, flags);
+	__fd_wr_mode(fd, on);
 	spin_unlock_irqrestore(&fd->lock, flags);
 	return 0;
 }
@@ -232,37 +258,20 @@ static int fd_zio_info_get(struct device *dev, struct zio_attribute *zattr,
 	return 0;
 }
 
-/* TDC input attributes: the flags */
-static int fd_zio_conf_tdc(struct device *dev, struct zio_attribute *zattr,
-			    uint32_t  usr_val)
+/*
+ * Apply the TDC flags. Only changed bits are written to hardware, unless
+ * "force" is set (the termination lives in the GPIO expander, and it's
+ * better to write it again when restoring a configuration).
+ */
+static void __fd_zio_tdc_flags(struct fd_dev *fd, uint32_t usr_val, int force)
 {
-	struct zio_cset *cset;
-	struct fd_dev *fd;
 	uint32_t reg;
 	int change;
 
-	cset = to_zio_cset(dev);
-	fd = cset->zdev->priv_d;
-
-	switch (zattr->id) {
-	case FD_ATTR_TDC_OFFSET:
-		fd->calib.tdc_zero_offset = usr_val;
-		goto out;
-
-	case FD_ATTR_TDC_USER_OFF:
-		fd->tdc_user_offset = usr_val;
-		goto out;
-
-	case FD_ATTR_TDC_FLAGS:
-		break; /* code below */
-	default:
-		goto out;
-	}
-
-	/* This code is only about FD_ATTR_TDC_FLAGS */
 	change = fd->tdc_flags ^ usr_val; /* old xor new */
+	if (force)
+		change = ~0;
 
-	/* No need to lock, as configuration is serialized by zio-core */
 	if (change & FD_TDCF_DISABLE_INPUT) {
 		reg = fd_readl(fd, FD_REG_GCR);
 		if (usr_val & FD_TDCF_DISABLE_INPUT)
@@ -287,6 +296,39 @@ static int fd_zio_conf_tdc(struct device *dev, struct zio_attribute *zattr,
 		else
 			fd_gpio_clr(fd, FD_GPIO_TERM_EN);
 	}
+	fd->tdc_flags = usr_val;
+}
+
+/* TDC input attributes: the flags */
+static int fd_zio_conf_tdc(struct device *dev, struct zio_attribute *zattr,
+			    uint32_t  usr_val)
+{
+	struct zio_cset *cset;
+	struct fd_dev *fd;
+
+	cset = to_zio_cset(dev);
+	fd = cset->zdev->priv_d;
+
+	switch (zattr->id) {
+	case FD_ATTR_TDC_OFFSET:
+		fd->calib.tdc_zero_offset = usr_val;
+		goto out;
+
+	case FD_ATTR_TDC_USER_OFF:
+		fd->tdc_user_offset = usr_val;
+		goto out;
+
+	case FD_ATTR_TDC_FLAGS:
+		break; /* code below */
+	default:
+		goto out;
+	}
+
+	/* zio-core serializes its attributes, but not with "config" */
+	mutex_lock(&fd->config_lock);
+	__fd_zio_tdc_flags(fd, usr_val, 0);
+	mutex_unlock(&fd->config_lock);
+	return 0;
 out:
 	/* We need to store in the local array too (see info_tdc() above) */
 	fd->tdc_flags = usr_val;
@@ -377,66 +419,53 @@ static int fd_zio_conf_set(struct device *dev, struct zio_attribute *zattr,
 /* We need to change the time in attribute tuples, so here it is */
 enum attrs {__UTC_H, __UTC_L, __COARSE, __FRAC}; /* the order of our attrs */
 
-static void fd_attr_sub(uint32_t *a, uint32_t pico)
-{
-	uint32_t coarse, frac;
-
-	fd_split_pico(pico, &coarse, &frac);
-	if (a[__FRAC] >= frac) {
-		a[__FRAC] -= frac;
-	} else {
-		a[__FRAC] += 4096;
-		a[__FRAC] -= frac;
-		coarse++;
-	}
-	if (a[__COARSE] >= coarse) {
-		a[__COARSE] -= coarse;
-	} else {
-		a[__COARSE] += 125*1000*1000;
-		a[__COARSE] -= coarse;
-		if (likely(a[__UTC_L] != 0)) {
-			a[__UTC_L]--;
-		} else {
-			a[__UTC_L] = ~0;
-			a[__UTC_H]--;
-		}
-	}
-}
-
-static void fd_attr_add(uint32_t *a, uint32_t pico)
+/* The offset is at most 2ms, but the time may be any attribute value */
+void fd_apply_offset(uint32_t *a, int32_t off_pico)
 {
-	uint32_t coarse, frac;
+	struct fd_time t;
 
-	fd_split_pico(pico, &coarse, &frac);
-	a[__FRAC] += frac;
-	if (a[__FRAC] >= 4096) {
-		a[__FRAC] -= 4096;
-		coarse++;
-	}
-	a[__COARSE] += coarse;
-	if (a[__COARSE] >= 125*1000*1000) {
-		a[__COARSE] -= 125*1000*1000;
-		a[__UTC_L]++;
-		if (unlikely(a[__UTC_L] == 0))
-			a[__UTC_H]++;
-	}
+	if (!off_pico)
+		return;
+	t.utc = (uint64_t)a[__UTC_H] << 32 | a[__UTC_L];
+	t.coarse = a[__COARSE];
+	t.frac = a[__FRAC];
+	fd_time_add_ps(&t, off_pico);
+	a[__UTC_H] = t.utc >> 32;
+	a[__UTC_L] = t.utc;
+	a[__COARSE] = t.coarse;
+	a[__FRAC] = t.frac;
 }
 
-void fd_apply_offset(uint32_t *a, int32_t off_pico)
+/*
+ * End of the last pulse of a pulse-mode train, in board nanoseconds, or
+ * ~0 for a continuous train. The fine parts are rounded up to a cycle.
+ */
+static uint64_t fd_zio_train_end(uint32_t *attrs, int rep)
 {
-	if (off_pico) {
-		if (off_pico > 0)
-			fd_attr_add(a, off_pico);
-		else
-			fd_attr_sub(a, -off_pico);
-	}
+	uint64_t end, delta;
+
+	end = ((uint64_t)attrs[FD_ATTR_OUT_END_H] << 32
+	       | attrs[FD_ATTR_OUT_END_L]) * NSEC_PER_SEC
+		+ attrs[FD_ATTR_OUT_END_COARSE] * 8 + 8;
+	if (rep < 0)
+		return ~0ULL;
+	if (rep <= 1)
+		return end;
+	delta = (uint64_t)attrs[FD_ATTR_OUT_DELTA_L] * NSEC_PER_SEC
+		+ attrs[FD_ATTR_OUT_DELTA_COARSE] * 8 + 8;
+	if (delta > div64_u64(~0ULL - end, rep - 1))
+		return ~0ULL;
+	return end + (rep - 1) * delta;
 }
 
-/* Internal output engine */
-static void __fd_zio_output(struct fd_dev *fd, int index1_4, uint32_t *attrs)
+/*
+ * Internal output engine. Staging writes all timing registers of the
+ * channel and returns the DCR value to be armed, or -1 if the channel
+ * is disabled (or the request is invalid) and must not be armed.
+ */
+int __fd_zio_output_stage(struct fd_dev *fd, int ch, uint32_t *attrs)
 {
 	struct timespec delta, width, delay;
-	int ch = index1_4 - 1;
 	int mode = attrs[FD_ATTR_OUT_MODE];
 	int rep = attrs[FD_ATTR_OUT_REP];
 	int dcr;
@@ -445,18 +474,18 @@ static void __fd_zio_output(struct fd_dev *fd, int index1_4, uint32_t *attrs)
 		/* disable output via DCR register */
 		dcr = 0;
 		fd_ch_writel(fd, ch, dcr, FD_REG_DCR);
-		return;
+		return -1;
 	}
 
 	if (mode == FD_OUT_MODE_DELAY) {
 		if(rep < 0 || rep > 16) /* delay mode allows trains of 1 to 16 pulses. */
-			return;
+			return -1;
 
 		/* check delay lower limits. FIXME: raise an alarm */
 		delay.tv_sec = attrs[FD_ATTR_OUT_START_L];
 		delay.tv_nsec = attrs[FD_ATTR_OUT_START_COARSE] * 8;
 		if (delay.tv_sec == 0 && delay.tv_nsec < 600)
-			return;
+			return -1;
 
 		fd_apply_offset(attrs + FD_ATTR_OUT_START_H,
 			    fd->calib.tdc_zero_offset);
@@ -464,6 +493,14 @@ static void __fd_zio_output(struct fd_dev *fd, int index1_4, uint32_t *attrs)
 			    fd->calib.tdc_zero_offset);
 	}
 
+	/* Save the start time, as requested, for the "triggers" file */
+	if (mode == FD_OUT_MODE_PULSE) {
+		fd->queue[ch].staged.utc = (uint64_t)attrs[FD_ATTR_OUT_START_H]
+			<< 32 | attrs[FD_ATTR_OUT_START_L];
+		fd->queue[ch].staged.coarse = attrs[FD_ATTR_OUT_START_COARSE];
+		fd->queue[ch].staged.frac = attrs[FD_ATTR_OUT_START_FINE];
+	}
+
 	fd_apply_offset(attrs + FD_ATTR_OUT_START_H,
 			    fd->calib.zero_offset[ch]);
 
@@ -476,30 +513,38 @@ static void __fd_zio_output(struct fd_dev *fd, int index1_4, uint32_t *attrs)
 	fd_apply_offset(attrs + FD_ATTR_OUT_END_H,
 			  fd->ch_user_offset[ch]);
 
-	fd_ch_writel(fd, ch, fd->ch[ch].frr_cur,  FD_REG_FRR);
+	/* The queue polls near the start, and moves on after the end */
+	if (mode == FD_OUT_MODE_PULSE) {
+		fd->queue[ch].staged_begin = ((uint64_t)attrs[FD_ATTR_OUT_START_H]
+			<< 32 | attrs[FD_ATTR_OUT_START_L]) * NSEC_PER_SEC
+			+ attrs[FD_ATTR_OUT_START_COARSE] * 8;
+		fd->queue[ch].staged_end = fd_zio_train_end(attrs, rep);
+	}
+
+	fd_ch_writel_cached(fd, ch, fd->ch[ch].frr_cur,  FD_REG_FRR);
 
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_START_H],      FD_REG_U_STARTH);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_START_L],      FD_REG_U_STARTL);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_START_COARSE], FD_REG_C_START);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_START_FINE],   FD_REG_F_START);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_START_H],      FD_REG_U_STARTH);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_START_L],      FD_REG_U_STARTL);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_START_COARSE], FD_REG_C_START);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_START_FINE],   FD_REG_F_START);
 
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_END_H],      FD_REG_U_ENDH);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_END_L],      FD_REG_U_ENDL);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_END_COARSE], FD_REG_C_END);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_END_FINE],   FD_REG_F_END);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_END_H],      FD_REG_U_ENDH);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_END_L],      FD_REG_U_ENDL);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_END_COARSE], FD_REG_C_END);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_END_FINE],   FD_REG_F_END);
 
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_DELTA_L],      FD_REG_U_DELTA);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_DELTA_COARSE], FD_REG_C_DELTA);
-	fd_ch_writel(fd, ch, attrs[FD_ATTR_OUT_DELTA_FINE],   FD_REG_F_DELTA);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_DELTA_L],      FD_REG_U_DELTA);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_DELTA_COARSE], FD_REG_C_DELTA);
+	fd_ch_writel_cached(fd, ch, attrs[FD_ATTR_OUT_DELTA_FINE],   FD_REG_F_DELTA);
 
 	if (mode == FD_OUT_MODE_DELAY) {
 		dcr = 0;
-		fd_ch_writel(fd, ch, FD_RCR_REP_CNT_W(rep - 1)
-			     | (rep < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
+		fd_ch_writel_cached(fd, ch, FD_RCR_REP_CNT_W(rep - 1)
+				    | (rep < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
 	} else {
 		dcr = FD_DCR_MODE;
-		fd_ch_writel(fd, ch, FD_RCR_REP_CNT_W(rep < 0 ? 0 : rep - 1)
-			    | (rep < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
+		fd_ch_writel_cached(fd, ch, FD_RCR_REP_CNT_W(rep < 0 ? 0 : rep - 1)
+				    | (rep < 0 ? FD_RCR_CONT : 0), FD_REG_RCR);
 	}
 
 	/*
@@ -544,15 +589,178 @@ static void __fd_zio_output(struct fd_dev *fd, int index1_4, uint32_t *attrs)
 	if (delta.tv_sec == 0 && delta.tv_nsec < 200)
 		dcr |= FD_DCR_NO_FINE;;
 
-
+	/* Write the mode, but leave the channel disabled until armed */
 	fd_ch_writel(fd, ch, dcr, FD_REG_DCR);
+	return dcr;
+}
+
+/* Arming: this is the time-critical part, called with the lock held */
+void __fd_zio_output_arm(struct fd_dev *fd, int ch, int dcr)
+{
 	fd_ch_writel(fd, ch, dcr | FD_DCR_UPDATE, FD_REG_DCR);
 	fd_ch_writel(fd, ch, dcr | FD_DCR_ENABLE, FD_REG_DCR);
-	if (mode == FD_OUT_MODE_PULSE) {
+	if (dcr & FD_DCR_MODE) { /* pulse mode */
 		fd_ch_writel(fd, ch, dcr | FD_DCR_ENABLE | FD_DCR_PG_ARM,  FD_REG_DCR);
+		/* The output timer will notice the trigger */
+		fd->queue[ch].start = fd->queue[ch].staged;
+		fd->queue[ch].begin = fd->queue[ch].staged_begin;
+		fd->queue[ch].end = fd->queue[ch].staged_end;
+		fd->queue[ch].armed = 1;
+		fd->queue[ch].trig = 0;
 	}
 }
 
+static void __fd_zio_output(struct fd_dev *fd, int index1_4, uint32_t *attrs)
+{
+	int ch = index1_4 - 1;
+	unsigned long flags;
+	int dcr;
+
+	/* Under the lock, as batches, rules and queues use the same channel */
+	spin_lock_irqsave(&fd->lock, flags);
+	__fd_queue_flush(fd, ch);
+	dcr = __fd_zio_output_stage(fd, ch, attrs);
+	if (dcr >= 0)
+		__fd_zio_output_arm(fd, ch, dcr);
+	spin_unlock_irqrestore(&fd->lock, flags);
+	if (dcr >= 0 && (dcr & FD_DCR_MODE))
+		fd_queue_watch(fd);
+}
+
+/*
+ * Batched output: stage all the selected channels, then arm them in a
+ * row, so the arming window is as short and as predictable as possible.
+ * The attributes are modified in place (offsets are applied).
+ * With FD_OUT_BATCH_QUEUE, the programs are queued instead: all of
+ * them, or none if a queue is full (-EAGAIN).
+ */
+int fd_zio_output_batch(struct fd_dev *fd, struct fd_out_batch *b)
+{
+	int ch, pulse = 0, dcr[FD_CH_NUMBER];
+	unsigned long flags;
+
+	if ((b->flags & ~FD_OUT_BATCH_QUEUE)
+	    || (b->mask & ~((1 << FD_CH_NUMBER) - 1)))
+		return -EINVAL;
+	for (ch = 0; ch < FD_CH_NUMBER; ch++)
+		if ((b->mask & (1 << ch))
+		    && b->attrs[ch][FD_ATTR_OUT_MODE] > FD_OUT_MODE_PULSE)
+			return -EINVAL;
+
+	if (b->flags & FD_OUT_BATCH_QUEUE)
+		return fd_queue_add(fd, b);
+
+	/* Staging is under the lock too, not to race with other writers */
+	spin_lock_irqsave(&fd->lock, flags);
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		dcr[ch] = -1;
+		if (!(b->mask & (1 << ch)))
+			continue;
+		__fd_queue_flush(fd, ch);
+		dcr[ch] = __fd_zio_output_stage(fd, ch, b->attrs[ch]);
+	}
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		if (dcr[ch] < 0)
+			continue;
+		__fd_zio_output_arm(fd, ch, dcr[ch]);
+		pulse |= dcr[ch] & FD_DCR_MODE;
+	}
+	spin_unlock_irqrestore(&fd->lock, flags);
+	if (pulse)
+		fd_queue_watch(fd);
+	return 0;
+}
+
+/*
+ * Whole configuration, written to the binary "config" file. Everything
+ * is checked first, then all the selected fields are applied holding
+ * config_lock, so writers and readers never see half a configuration.
+ * The TDC flags go first, outside the spinlock, as the termination is
+ * behind slow SPI transfers. Time is set last, as it depends on WR mode.
+ */
+int fd_zio_config_set(struct fd_dev *fd, struct fd_config *c)
+{
+	unsigned long flags;
+	int ch, err = 0;
+
+	if (c->version != FD_CONFIG_VERSION)
+		return -EINVAL;
+	if (c->valid & ~(FD_CONFIG_ALL | FD_CONFIG_TIME | FD_CONFIG_HOST_TIME))
+		return -EINVAL;
+	if ((c->valid & FD_CONFIG_TIME) && (c->valid & FD_CONFIG_HOST_TIME))
+		return -EINVAL;
+	if ((c->valid & FD_CONFIG_TDC_FLAGS)
+	    && (c->tdc_flags & ~(FD_TDCF_DISABLE_INPUT | FD_TDCF_DISABLE_TSTAMP
+				 | FD_TDCF_TERM_50)))
+		return -EINVAL;
+	if ((c->valid & FD_CONFIG_TIME) && c->coarse >= 125 * 1000 * 1000)
+		return -EINVAL;
+
+	mutex_lock(&fd->config_lock);
+	if (c->valid & FD_CONFIG_TDC_FLAGS)
+		__fd_zio_tdc_flags(fd, c->tdc_flags, 1);
+
+	spin_lock_irqsave(&fd->lock, flags);
+	if (c->valid & FD_CONFIG_TDC_OFFSET) {
+		fd->calib.tdc_zero_offset = c->tdc_offset;
+		fd->tdc_attrs[FD_CSET_INDEX(FD_ATTR_TDC_OFFSET)] = c->tdc_offset;
+	}
+	if (c->valid & FD_CONFIG_TDC_USER_OFF)
+		fd->tdc_user_offset = c->tdc_user_offset;
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		if (c->valid & FD_CONFIG_CH_OFFSET)
+			fd->calib.zero_offset[ch] = c->ch_offset[ch];
+		if (c->valid & FD_CONFIG_CH_USER_OFF)
+			fd->ch_user_offset[ch] = c->ch_user_offset[ch];
+	}
+	if (c->valid & FD_CONFIG_WR)
+		__fd_wr_mode(fd, c->wr & FD_CONFIG_WR_ENABLE);
+	spin_unlock_irqrestore(&fd->lock, flags);
+
+	if (c->valid & FD_CONFIG_TIME) {
+		struct fd_time t = {.utc = c->utc, .coarse = c->coarse};
+
+		err = fd_time_set(fd, &t, NULL);
+	}
+	if (c->valid & FD_CONFIG_HOST_TIME)
+		err = fd_time_set(fd, NULL, NULL);
+	mutex_unlock(&fd->config_lock);
+	return err;
+}
+
+/* Snapshot: all the fields that can be written back, and current time */
+void fd_zio_config_get(struct fd_dev *fd, struct fd_config *c)
+{
+	struct fd_time t;
+	unsigned long flags;
+	int ch;
+
+	memset(c, 0, sizeof(*c));
+	c->version = FD_CONFIG_VERSION;
+	c->valid = FD_CONFIG_ALL;
+
+	mutex_lock(&fd->config_lock);
+	spin_lock_irqsave(&fd->lock, flags);
+	c->tdc_flags = fd->tdc_flags;
+	c->tdc_offset = fd->calib.tdc_zero_offset;
+	c->tdc_user_offset = fd->tdc_user_offset;
+	for (ch = 0; ch < FD_CH_NUMBER; ch++) {
+		c->ch_offset[ch] = fd->calib.zero_offset[ch];
+		c->ch_user_offset[ch] = fd->ch_user_offset[ch];
+	}
+	if (test_bit(FD_FLAG_WR_MODE, &fd->flags)) {
+		c->wr = FD_CONFIG_WR_ENABLE;
+		if (fd_readl(fd, FD_REG_TCR) & FD_TCR_WR_LOCKED)
+			c->wr |= FD_CONFIG_WR_LOCKED;
+	}
+	spin_unlock_irqrestore(&fd->lock, flags);
+	mutex_unlock(&fd->config_lock);
+
+	fd_time_get(fd, &t, NULL);
+	c->utc = t.utc;
+	c->coarse = t.coarse;
+}
+
 /* This is called on user write */
 static int fd_zio_output(struct zio_cset *cset)
 {
@@ -574,6 +782,17 @@ static int fd_zio_output(struct zio_cset *cset)
 	return 0; /* already done */
 }
 
+/* Start time-stamping, if not already done (the rules need it too) */
+void fd_input_enable(struct fd_dev *fd)
+{
+	if (!test_bit(FD_FLAG_DO_INPUT, &fd->flags)) {
+		fd_writel(fd, FD_TSBCR_PURGE | FD_TSBCR_RST_SEQ, FD_REG_TSBCR);
+		fd_writel(fd, FD_TSBCR_CHAN_MASK_W(1) | FD_TSBCR_ENABLE,
+			  FD_REG_TSBCR);
+		set_bit(FD_FLAG_DO_INPUT, &fd->flags);
+	}
+}
+
 /*
  * The input method may return immediately, because input is
  * asynchronous. The data_done callback is invoked when the block is
@@ -585,12 +804,7 @@ static int fd_zio_input(struct zio_cset *cset)
 	fd = cset->zdev->priv_d;
 
 	/* Configure the device for input */
-	if (!test_bit(FD_FLAG_DO_INPUT, &fd->flags)) {
-		fd_writel(fd, FD_TSBCR_PURGE | FD_TSBCR_RST_SEQ, FD_REG_TSBCR);
-		fd_writel(fd, FD_TSBCR_CHAN_MASK_W(1) | FD_TSBCR_ENABLE,
-			  FD_REG_TSBCR);
-		set_bit(FD_FLAG_DO_INPUT, &fd->flags);
-	}
+	fd_input_enable(fd);
 	/* Ready for input. If there's already something, return it now */
 	if (fd_read_sw_fifo(fd, cset->chan) == 0) {
 		return 0; /* don't call data_done, let the caller do it */
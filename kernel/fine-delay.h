@@ -3,7 +3,7 @@
 
 #define FDELAY_GATEWARE_NAME "fmc/fine-delay.bin"
 
-#define FDELAY_VERSION		2 /* version of the layout of registers */
+#define FDELAY_VERSION		3 /* layout of attributes and of fd_time */
 /*
  * ZIO concatenates device, cset and channel extended attributes in the 32
  * values that are reported in the control block. So we are limited to
@@ -53,6 +53,12 @@ enum fd_zattr_in_idx {
 	FD_ATTR_TDC_FLAGS, /* enable, termination, see below */
 	FD_ATTR_TDC_OFFSET,
 	FD_ATTR_TDC_USER_OFF,
+	FD_ATTR_TDC_DROPPED, /* stamps lost to software fifo overflows */
+	FD_ATTR_TDC_DROPPED_0, /* the same, per stamp channel: 0 is input */
+	FD_ATTR_TDC_DROPPED_1,
+	FD_ATTR_TDC_DROPPED_2,
+	FD_ATTR_TDC_DROPPED_3,
+	FD_ATTR_TDC_DROPPED_4,
 	FD_ATTR_TDC__LAST,
 };
 /* Names have been chosen so that 0 is the default at load time */
@@ -97,22 +103,148 @@ enum fd_output_mode {
 #define FD_CSET_INDEX(i) ((i) - FD_ATTR_DEV__LAST)
 
 /*
- * Internal time: the first three fields should be converted to zio time.
- * This is exported to user space if raw_tdc is selected.
+ * Time, as used everywhere: the first three fields should be converted
+ * to zio time. This is the record of raw_tdc data blocks and of the
+ * "triggers" file, and the library uses it too, so raw data can be
+ * used in place. The layout is fixed (24 bytes, no
+ * holes) whatever the compiler and architecture; changing it requires
+ * a new FDELAY_VERSION.
  */
 struct fd_time {
 	uint64_t utc;
 	uint32_t coarse;
 	uint32_t frac;
-	uint32_t channel;
 	uint32_t seq_id;
+	uint32_t channel;
+} __attribute__((packed, aligned(8)));
+
+/*
+ * The time page is a read-only page, exported as binary "time-page" in
+ * sysfs, that the driver keeps updated with a recent correlation between
+ * board time and host time (CLOCK_MONOTONIC). User space can mmap it and
+ * extrapolate board time without a system call. It is a seqlock: readers
+ * must retry if "seq" is odd or if it changed while reading.
+ *
+ * Extrapolation: board = board_ns + dt + (dt * rate) >> 32, where dt is
+ * host time minus host_ns. The error is bounded by
+ * uncert_ns + (|dt| * rate_uncert) >> 32. The inverse conversion maps
+ * board stamps to host time; real_offset_ns turns it into wall-clock time.
+ * Any change to the layout requires a new FD_TIME_PAGE_VERSION.
+ */
+#define FD_TIME_PAGE_VERSION	2 /* 1 had "reserved" after flags */
+
+struct fd_time_page {
+	uint32_t version;
+	uint32_t seq;		/* odd while the driver is updating */
+	uint64_t board_ns;	/* board time: utc * 10^9 + coarse * 8 */
+	uint64_t host_ns;	/* CLOCK_MONOTONIC when board_ns was captured */
+	int64_t rate;		/* board/host frequency ratio - 1: 32.32 */
+	uint32_t rate_uncert;	/* uncertainty of the rate: 0.32 */
+	uint32_t uncert_ns;	/* half-width of the capture window */
+	uint32_t flags;
+	uint32_t xstamp_n;	/* the sample is the best of these captures */
+	int64_t real_offset_ns;	/* CLOCK_REALTIME - CLOCK_MONOTONIC */
 };
+#define FD_TIME_PAGE_VALID	1	/* a sample is there */
+#define FD_TIME_PAGE_RATE	2	/* rate is measured, not assumed */
 
+/*
+ * Batched output configuration, written as a whole to the binary
+ * "outputs" file in sysfs. All channels selected by the mask are
+ * programmed first, and then armed back-to-back with interrupts
+ * disabled. The attribute arrays use the cset indexes, like ext_val
+ * in the control block (i.e., the device attributes are unused here).
+ */
+#define FD_OUT_BATCH_CH		4
+
+struct fd_out_batch {
+	uint32_t mask;		/* bit 0 is channel 1 */
+	uint32_t flags;		/* FD_OUT_BATCH_* below */
+	uint32_t attrs[FD_OUT_BATCH_CH][FD_ATTR_OUT__LAST];
+};
+#define FD_OUT_BATCH_QUEUE	1	/* append to the queues (pulse mode) */
+
+/*
+ * Reactive rules, written as a table to the binary "rules" file: on
+ * input edges, the driver programs an output pulse train at input time
+ * plus delay, with no trip to user space. Rules are evaluated when the
+ * input fifo is drained (interrupt or timer), so the delay must cover
+ * that latency; lat_max_ns and "late" tell how it goes. Offsets are
+ * sampled when the table is written. Reading returns the statistics.
+ */
+#define FD_RULES_N		8
+
+struct fd_rule {
+	uint32_t flags;		/* FD_RULE_* below */
+	uint32_t channel;	/* output channel, 0..3 */
+	uint32_t divider;	/* act on one edge every "divider" (0 == 1) */
+	int32_t rep;		/* pulses in the train, -1 for continuous */
+	uint64_t delay_ps;	/* from the input edge to the first pulse */
+	uint64_t width_ps;
+	uint64_t period_ps;
+	uint64_t gate_start_ns;	/* board time; a gate_end of 0 means "never" */
+	uint64_t gate_end_ns;
+	/* Statistics, filled by the driver and reset by each write */
+	uint32_t edges;		/* input edges within the gate */
+	uint32_t fired;		/* outputs programmed */
+	uint32_t late;		/* programmed after the start time */
+	uint32_t lat_last_ns;	/* from input edge to output programming */
+	uint32_t lat_max_ns;
+	uint32_t reserved;
+};
+#define FD_RULE_ENABLE		1
+
+/*
+ * The binary "triggers" file returns one fd_time per output channel:
+ * the start time of the last pulse program that triggered, with seq_id
+ * counting the triggers. It can be polled (POLLPRI): the driver notifies
+ * sysfs whenever an output triggers. Read it again from offset 0 to
+ * re-arm the notification.
+ */
+
+/*
+ * The binary "config" file holds the whole control-plane configuration
+ * (what is otherwise spread over many ZIO attributes). Writing applies
+ * the fields selected by "valid" in one go; reading returns a snapshot,
+ * with all the fields but time marked as valid, so it can be written back
+ * later to restore the board. Time is reported, but is only set on
+ * explicit request. The version changes whenever the layout changes.
+ */
+#define FD_CONFIG_VERSION	1
+
+struct fd_config {
+	uint32_t version;	/* FD_CONFIG_VERSION */
+	uint32_t valid;		/* FD_CONFIG_* below */
+	uint32_t tdc_flags;	/* FD_TDCF_* */
+	int32_t tdc_offset;	/* calibration: ZIO "offset" */
+	int32_t tdc_user_offset;
+	int32_t ch_offset[4];		/* calibration: "delay-offset" */
+	int32_t ch_user_offset[4];
+	uint32_t wr;		/* FD_CONFIG_WR_* below */
+	uint64_t utc;		/* time to set, or time of the snapshot */
+	uint32_t coarse;
+	uint32_t reserved[9];
+};
+#define FD_CONFIG_TDC_FLAGS	0x01
+#define FD_CONFIG_TDC_OFFSET	0x02
+#define FD_CONFIG_TDC_USER_OFF	0x04
+#define FD_CONFIG_CH_OFFSET	0x08
+#define FD_CONFIG_CH_USER_OFF	0x10
+#define FD_CONFIG_WR		0x20
+#define FD_CONFIG_TIME		0x40	/* set utc and coarse */
+#define FD_CONFIG_HOST_TIME	0x80	/* set host time */
+#define FD_CONFIG_ALL		0x3f	/* what a snapshot returns */
+
+#define FD_CONFIG_WR_ENABLE	1
+#define FD_CONFIG_WR_LOCKED	2	/* read-only */
 
 
 #ifdef __KERNEL__ /* All the rest is only of kernel users */
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 #include <linux/fmc.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,25)
@@ -168,22 +300,67 @@ struct fd_calibration { /* All of these are big endian */
 #define FD_CAL_STEPS	1024	/* This is a parameter: must be power of 2 */
 #define FD_SW_FIFO_LEN	1024	/* Again, aa parameter: must be a power of 2 */
 
+/* Shadowed channel registers: FRR (0x04) to RCR (0x34), by offset / 4 */
+#define FD_CH_SHADOW_N	14
+
 struct fd_ch {
 	/* Offset between FRR measured at known T at startup and poly-fitted */
 	uint32_t frr_offset;
 	/* Fine range register for each ch, current value (after T comp.) */
 	uint32_t frr_cur;
+	/* Last value written to the registers, valid if the bit is set */
+	uint32_t shadow[FD_CH_SHADOW_N];
+	unsigned long shadow_valid;
+};
+
+/* One board/host time correlation sample, as used by the time page */
+#define FD_TIME_HIST	16	/* must be a power of 2 */
+
+struct fd_time_sample {
+	uint64_t board_ns;
+	uint64_t host_ns;
+	uint32_t uncert_ns;
+	int64_t real_offset_ns;
+};
+
+/* Rules are converted to split times when written (see fd-rules.c) */
+struct fd_rule_hw {
+	struct fd_time start;		/* input to start: delay and offsets */
+	struct fd_time user;		/* same, as the user sees it */
+	struct fd_time width, delta;
+	uint64_t delay_ns;		/* to check lateness */
+	uint64_t train_ns;		/* first edge to end, ~0 if endless */
+	uint32_t rcr, dcr;
+	unsigned long div_count;
 };
 
 /* The software fifo is a circular buffer of fd_time structures */
 struct fd_sw_fifo {
 	unsigned long head, tail;
+	uint32_t dropped; /* in total: reported with every stamp */
+	uint32_t dropped_ch[FD_CH_NUMBER + 1]; /* per stamp channel */
 	struct fd_time *t;
 };
 
+/*
+ * Each output has a queue of pulse programs: when the current train is
+ * over, the next one is loaded and armed (see fd-queue.c)
+ */
+struct fd_out_queue {
+	unsigned long head, tail;
+	int armed;			/* a pulse program is armed */
+	int trig;			/* ... and it has triggered */
+	struct fd_time staged, start;	/* start time, as the user asked */
+	uint64_t staged_begin, begin;	/* start of the train, board ns */
+	uint64_t staged_end, end;	/* end of the train, board ns */
+	uint32_t missed;		/* programs late for their start */
+	uint32_t (*a)[FD_ATTR_OUT__LAST];
+};
+
 /* This is the device we use all around */
 struct fd_dev {
 	spinlock_t lock;
+	struct mutex config_lock;	/* whole "config", and TDC flags */
 	unsigned long flags;
 	int fd_regs_base;		/* sdb_find_device(cern, f19ede1a) */
 	int fd_owregs_base;		/* regs_base + 0x500 */
@@ -206,6 +383,26 @@ struct fd_dev {
 	uint16_t mcp_iodir, mcp_olat;
 	struct fd_sw_fifo sw_fifo;
 
+	/* The time page and the samples it is built from (see time.c) */
+	struct fd_time_page *time_page;
+	struct timer_list time_timer;
+	struct fd_time_sample time_hist[FD_TIME_HIST];
+	unsigned long time_hist_n;
+	unsigned long time_gen;		/* incremented when time is set */
+
+	/* Output queues, polled by a high-resolution timer when armed */
+	struct fd_out_queue queue[FD_CH_NUMBER];
+	struct hrtimer out_timer;
+	struct fd_time trig[FD_CH_NUMBER];	/* the "triggers" file */
+	struct work_struct trig_work;
+
+	unsigned long mmio_saved;	/* writes skipped thanks to shadows */
+
+	/* Reactive rules, evaluated as input stamps are collected */
+	struct fd_rule rules[FD_RULES_N];
+	struct fd_rule_hw rules_hw[FD_RULES_N];
+	int rules_active;
+
 	/* The following fields used to live in fd_calib */
 	int32_t tdc_user_offset;
 	int32_t ch_user_offset[4];
@@ -218,18 +415,10 @@ enum fd_flags {
 	FD_FLAG_DO_INPUT,
 	FD_FLAG_INPUT_READY,
 	FD_FLAG_WR_MODE,
+	FD_FLAG_NOTIFY,			/* sysfs files are there */
+	FD_FLAG_QUEUE_WATCH,		/* rules armed outputs: see fd_tlet */
 };
 
-/* Split a pico value into coarse and frac */
-static inline void fd_split_pico(uint64_t pico,
-				 uint32_t *coarse, uint32_t *frac)
-{
-	/* This works for less than 1s delays */
-	BUG_ON(pico > 1000ULL * NSEC_PER_SEC);
-	*coarse = div_u64_rem(pico, 8000, frac);
-	*frac = (*frac << 12) / 8000;
-}
-
 static inline uint32_t fd_readl(struct fd_dev *fd, unsigned long reg)
 {
 	return fmc_readl(fd->fmc, fd->fd_regs_base + reg);
@@ -259,6 +448,44 @@ static inline void fd_ch_writel(struct fd_dev *fd, int ch,
 	fd_writel(fd, v, 0x100 + ch * 0x100 + reg);
 }
 
+/*
+ * Output programming goes through the shadow, so unchanged registers
+ * are not written again (on VME every access is a slow transaction).
+ * Other writers of shadowed registers must use the write-through version.
+ * Once the outputs are registered, both must be called with the lock
+ * held, as the shadow and mmio_saved are shared by all output paths.
+ */
+static inline void fd_ch_writel_shadow(struct fd_dev *fd, int ch,
+				       uint32_t v, unsigned long reg)
+{
+	struct fd_ch *c = fd->ch + ch;
+
+	fd_ch_writel(fd, ch, v, reg);
+	c->shadow[reg / 4] = v;
+	c->shadow_valid |= 1 << (reg / 4);
+}
+
+static inline void fd_ch_writel_cached(struct fd_dev *fd, int ch,
+				       uint32_t v, unsigned long reg)
+{
+	struct fd_ch *c = fd->ch + ch;
+
+	if ((c->shadow_valid & (1 << (reg / 4))) && c->shadow[reg / 4] == v) {
+		fd->mmio_saved++;
+		return;
+	}
+	fd_ch_writel_shadow(fd, ch, v, reg);
+}
+
+/* After a reset the registers are back to their defaults */
+static inline void fd_ch_shadow_invalidate(struct fd_dev *fd)
+{
+	int ch;
+
+	for (ch = 0; ch < FD_CH_NUMBER; ch++)
+		fd->ch[ch].shadow_valid = 0;
+}
+
 #define FD_MAGIC_FPGA	0xf19ede1a	/* FD_REG_IDR content */
 
 /* Values for the configuration of the acam PLL. Can be changed */
@@ -354,6 +581,15 @@ extern int fd_time_set(struct fd_dev *fd, struct fd_time *t,
 		       struct timespec *ts);
 extern int fd_time_get(struct fd_dev *fd, struct fd_time *t,
 		       struct timespec *ts);
+extern void __fd_time_capture(struct fd_dev *fd, struct fd_time_sample *s);
+extern int fd_time_xstamp(struct fd_dev *fd, int n,
+			  struct fd_time_sample *best);
+extern void __fd_time_page_reset(struct fd_dev *fd);
+extern int __fd_time_board_now(struct fd_dev *fd, uint64_t *board_ns);
+
+/* Functions exported by fd-sysfs.c */
+extern int fd_sysfs_init(struct fd_dev *fd);
+extern void fd_sysfs_exit(struct fd_dev *fd);
 
 /* Functions exported by fd-zio.c */
 extern int fd_zio_register(void);
@@ -361,6 +597,24 @@ extern void fd_zio_unregister(void);
 extern int fd_zio_init(struct fd_dev *fd);
 extern void fd_zio_exit(struct fd_dev *fd);
 extern void fd_apply_offset(uint32_t *a, int32_t off_pico);
+extern void fd_input_enable(struct fd_dev *fd);
+extern int fd_zio_output_batch(struct fd_dev *fd, struct fd_out_batch *b);
+extern int fd_zio_config_set(struct fd_dev *fd, struct fd_config *c);
+extern void fd_zio_config_get(struct fd_dev *fd, struct fd_config *c);
+extern int __fd_zio_output_stage(struct fd_dev *fd, int ch, uint32_t *attrs);
+extern void __fd_zio_output_arm(struct fd_dev *fd, int ch, int dcr);
+
+/* Functions exported by fd-queue.c */
+extern int fd_queue_init(struct fd_dev *fd);
+extern void fd_queue_exit(struct fd_dev *fd);
+extern int fd_queue_add(struct fd_dev *fd, struct fd_out_batch *b);
+extern void __fd_queue_flush(struct fd_dev *fd, int ch);
+extern void fd_queue_watch(struct fd_dev *fd);
+
+/* Functions exported by fd-rules.c */
+extern int fd_rules_set(struct fd_dev *fd, struct fd_rule *rules);
+extern void fd_rules_get(struct fd_dev *fd, struct fd_rule *rules);
+extern int __fd_rules_run(struct fd_dev *fd, struct fd_time *t);
 
 /* Functions exported by fd-irq.c */
 struct zio_channel;
@@ -11,20 +11,90 @@
  * option, any later version.
  */
 
+#include <linux/kernel.h>
 #include <linux/io.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/moduleparam.h>
+#include <linux/gfp.h>
 #include <linux/spinlock.h>
 #include "fine-delay.h"
 #include "hw/fd_main_regs.h"
 
-/* If fd_time is not null, use it. if ts is not null, use it, else current */
-int fd_time_set(struct fd_dev *fd, struct fd_time *t, struct timespec *ts)
+/* Period of the time-page update. 0 disables it (the page stays invalid) */
+static int fd_time_page_ms = 1000;
+module_param_named(time_page_ms, fd_time_page_ms, int, 0444);
+
+/* Number of cross-timestamps for each sample; the best one is kept */
+static int fd_xstamp_n = 8;
+module_param_named(xstamp_n, fd_xstamp_n, int, 0444);
+
+/* Until we measure the rate, assume 100ppm of uncertainty (0.32 format) */
+#define FD_TIME_RATE_UNKNOWN	429497
+
+/*
+ * No oscillator is off by 1000ppm (0.32 format): more than that between
+ * two samples is a step in board time (e.g. White Rabbit locking), not
+ * a rate, and the history is restarted
+ */
+#define FD_TIME_RATE_MAX	4294967
+
+/*
+ * Capture board time, bracketed by two reads of host time. The capture
+ * happens when the posted write reaches the card, which is before the
+ * following read completes. Must be called with the lock held.
+ */
+void __fd_time_capture(struct fd_dev *fd, struct fd_time_sample *s)
 {
-	uint32_t tcr, gcr;
+	uint32_t tcr, h, l, c;
+	int64_t t1, t2;
+
+	tcr = fd_readl(fd, FD_REG_TCR);
+	t1 = ktime_to_ns(ktime_get());
+	fd_writel(fd, tcr | FD_TCR_CAP_TIME, FD_REG_TCR);
+	h = fd_readl(fd, FD_REG_TM_SECH);
+	t2 = ktime_to_ns(ktime_get());
+	l = fd_readl(fd, FD_REG_TM_SECL);
+	c = fd_readl(fd, FD_REG_TM_CYCLES);
+
+	s->board_ns = (((uint64_t)h << 32) | l) * NSEC_PER_SEC + c * 8;
+	s->host_ns = t1 + (t2 - t1) / 2;
+	s->uncert_ns = (t2 - t1) / 2 + 8; /* one cycle of the board counter */
+}
+
+/*
+ * Cross-timestamp: repeat the capture n times, each with interrupts
+ * disabled, and keep the sample with the narrowest window (i.e. the one
+ * that suffered the least from bus latency and contention).
+ */
+int fd_time_xstamp(struct fd_dev *fd, int n, struct fd_time_sample *best)
+{
+	struct fd_time_sample s;
 	unsigned long flags;
-	struct timespec localts;
+	int i;
 
-	spin_lock_irqsave(&fd->lock, flags);
+	if (n < 1)
+		return -EINVAL;
+	best->uncert_ns = ~0;
+	for (i = 0; i < n; i++) {
+		spin_lock_irqsave(&fd->lock, flags);
+		__fd_time_capture(fd, &s);
+		spin_unlock_irqrestore(&fd->lock, flags);
+		if (s.uncert_ns < best->uncert_ns)
+			*best = s;
+	}
+	best->real_offset_ns = ktime_to_ns(ktime_get_real())
+		- ktime_to_ns(ktime_get());
+	return 0;
+}
+
+/* Write the time registers and restart correlation. Called with the lock */
+static void __fd_time_write(struct fd_dev *fd, struct fd_time *t,
+			    struct timespec *ts)
+{
+	uint32_t tcr, gcr;
 
 	gcr = fd_readl(fd, FD_REG_GCR);
 	fd_writel(fd, 0, FD_REG_GCR); /* zero the GCR while setting time */
@@ -33,11 +103,6 @@ int fd_time_set(struct fd_dev *fd, struct fd_time *t, struct timespec *ts)
 		fd_writel(fd, t->utc & 0xffffffff, FD_REG_TM_SECL);
 		fd_writel(fd, t->coarse, FD_REG_TM_CYCLES);
 	} else {
-		if (!ts) {
-			/* no caller-provided time: use Linux timer */
-			ts = &localts;
-			getnstimeofday(ts);
-		}
 		fd_writel(fd, GET_HI32(ts->tv_sec), FD_REG_TM_SECH);
 		fd_writel(fd, (int32_t)ts->tv_sec, FD_REG_TM_SECL);
 		fd_writel(fd, ts->tv_nsec >> 3, FD_REG_TM_CYCLES);
@@ -47,7 +112,45 @@ int fd_time_set(struct fd_dev *fd, struct fd_time *t, struct timespec *ts)
 	fd_writel(fd, tcr | FD_TCR_SET_TIME, FD_REG_TCR);
 	fd_writel(fd, gcr, FD_REG_GCR); /* Restore GCR */
 
-	spin_unlock_irqrestore(&fd->lock, flags);
+	/* Board time jumped: past correlation samples are now meaningless */
+	__fd_time_page_reset(fd);
+}
+
+/* If fd_time is not null, use it. if ts is not null, use it, else current */
+int fd_time_set(struct fd_dev *fd, struct fd_time *t, struct timespec *ts)
+{
+	unsigned long flags;
+	struct timespec localts;
+	struct fd_time_sample s;
+	int64_t corr = 0, err = 0;
+	int i;
+
+	if (t || ts) {
+		spin_lock_irqsave(&fd->lock, flags);
+		__fd_time_write(fd, t, ts);
+		spin_unlock_irqrestore(&fd->lock, flags);
+		return 0;
+	}
+
+	/*
+	 * No caller-provided time: use Linux time. The write latency is
+	 * unknown, so measure the residual offset by cross-timestamping,
+	 * and set again, compensated by what we measured so far.
+	 */
+	for (i = 0; i < 2; i++) {
+		getnstimeofday(&localts);
+		localts = ns_to_timespec(timespec_to_ns(&localts) - corr);
+		spin_lock_irqsave(&fd->lock, flags);
+		__fd_time_write(fd, NULL, &localts);
+		spin_unlock_irqrestore(&fd->lock, flags);
+
+		fd_time_xstamp(fd, fd_xstamp_n, &s);
+		err = s.board_ns - s.host_ns - s.real_offset_ns;
+		corr += err;
+	}
+	if (fd->verbose)
+		dev_info(&fd->fmc->dev, "%s: board - host = %lli ns (+- %u)\n",
+			 __func__, err, s.uncert_ns);
 	return 0;
 }
 
@@ -76,16 +179,127 @@ int fd_time_get(struct fd_dev *fd, struct fd_time *t, struct timespec *ts)
 	return 0;
 }
 
+/* Called with the lock held, when board time jumps or changes source */
+void __fd_time_page_reset(struct fd_dev *fd)
+{
+	struct fd_time_page *p = fd->time_page;
+
+	fd->time_hist_n = 0;
+	fd->time_gen++;
+	if (!p)
+		return;
+	p->seq++;
+	smp_wmb();
+	p->flags = 0;
+	smp_wmb();
+	p->seq++;
+	if (fd_time_page_ms)
+		mod_timer(&fd->time_timer, jiffies + 1);
+}
+
+/*
+ * Estimate current board time from the last sample, without touching
+ * the hardware. Called with the lock held; returns -1 if no sample.
+ */
+int __fd_time_board_now(struct fd_dev *fd, uint64_t *board_ns)
+{
+	struct fd_time_page *p = fd->time_page;
+	int64_t dt;
+
+	if (!p || !(p->flags & FD_TIME_PAGE_VALID))
+		return -1;
+	dt = ktime_to_ns(ktime_get()) - p->host_ns;
+	/* Split the 32.32 product, or it overflows after a few seconds */
+	*board_ns = p->board_ns + dt + (dt >> 32) * p->rate
+		+ (((dt & 0xffffffffLL) * p->rate) >> 32);
+	return 0;
+}
+
+/*
+ * Timer function: take a new sample and refresh the page. The rate is
+ * measured against the oldest sample in the history, so the estimate
+ * improves over the first FD_TIME_HIST periods and then keeps tracking
+ * drift with a fixed time constant.
+ */
+static void fd_time_page_update(unsigned long arg)
+{
+	struct fd_dev *fd = (void *)arg;
+	struct fd_time_page *p = fd->time_page;
+	struct fd_time_sample *s, *old, new;
+	unsigned long flags, n, gen;
+	uint32_t rate_uncert = FD_TIME_RATE_UNKNOWN;
+	uint32_t pflags = FD_TIME_PAGE_VALID;
+	int64_t db, dh, dd, rate = 0;
+
+	gen = fd->time_gen;
+	fd_time_xstamp(fd, fd_xstamp_n, &new);
+
+	spin_lock_irqsave(&fd->lock, flags);
+	if (gen != fd->time_gen) {
+		/* Time was set meanwhile: this sample is stale, retry */
+		spin_unlock_irqrestore(&fd->lock, flags);
+		mod_timer(&fd->time_timer, jiffies + 1);
+		return;
+	}
+	n = fd->time_hist_n++;
+	s = fd->time_hist + n % FD_TIME_HIST;
+	*s = new;
+
+	old = fd->time_hist + (n < FD_TIME_HIST ? 0 : (n + 1) % FD_TIME_HIST);
+	dh = s->host_ns - old->host_ns;
+	db = s->board_ns - old->board_ns;
+	dd = db - dh;
+	if (n && (dd > div64_s64(dh, 1000) + s->uncert_ns + old->uncert_ns
+		  || -dd > div64_s64(dh, 1000) + s->uncert_ns + old->uncert_ns
+		  || dh <= 0)) {
+		/* Board time stepped: start again from this sample */
+		__fd_time_page_reset(fd);
+		spin_unlock_irqrestore(&fd->lock, flags);
+		return;
+	}
+	if (n) {
+		rate = div64_s64(dd * (1LL << 32), dh);
+		rate = clamp_t(int64_t, rate, -FD_TIME_RATE_MAX,
+			       FD_TIME_RATE_MAX);
+		rate_uncert = div64_u64((uint64_t)(s->uncert_ns
+						   + old->uncert_ns) << 32, dh);
+		pflags |= FD_TIME_PAGE_RATE;
+	}
+
+	p->seq++;
+	smp_wmb();
+	p->board_ns = s->board_ns;
+	p->host_ns = s->host_ns;
+	p->real_offset_ns = s->real_offset_ns;
+	p->rate = rate;
+	p->rate_uncert = rate_uncert;
+	p->uncert_ns = s->uncert_ns;
+	p->xstamp_n = fd_xstamp_n;
+	p->flags = pflags;
+	smp_wmb();
+	p->seq++;
+	spin_unlock_irqrestore(&fd->lock, flags);
+
+	mod_timer(&fd->time_timer, jiffies + msecs_to_jiffies(fd_time_page_ms));
+}
+
 int fd_time_init(struct fd_dev *fd)
 {
 	struct timespec ts = {0,0};
 
-	/* Set the time to zero, so internal stuff resyncs */
+	fd->time_page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!fd->time_page)
+		return -ENOMEM;
+	fd->time_page->version = FD_TIME_PAGE_VERSION;
+	setup_timer(&fd->time_timer, fd_time_page_update, (unsigned long)fd);
+
+	/* Set the time to zero, so internal stuff resyncs (and page starts) */
 	return fd_time_set(fd, NULL, &ts);
 }
 
 void fd_time_exit(struct fd_dev *fd)
 {
-	/* nothing to do */
+	del_timer_sync(&fd->time_timer);
+	free_page((unsigned long)fd->time_page);
 }
 
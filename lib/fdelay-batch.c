@@ -0,0 +1,224 @@
+/*
+ * Batch time conversions, for analysis code that handles many stamps
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "fdelay-lib.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#  define FDELAY_AVX2
+#  include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define FDELAY_NEON
+#  include <arm_neon.h>
+#endif
+
+/* SIMD is used if the CPU has it, unless FDELAY_LIB_NOSIMD is set */
+static int __fdelay_simd;
+static pthread_once_t __fdelay_simd_once = PTHREAD_ONCE_INIT;
+
+static void __fdelay_simd_check(void)
+{
+	__fdelay_simd = !getenv("FDELAY_LIB_NOSIMD");
+#ifdef FDELAY_AVX2
+	__fdelay_simd = __fdelay_simd && __builtin_cpu_supports("avx2");
+#endif
+}
+
+static int fdelay_use_simd(void)
+{
+	pthread_once(&__fdelay_simd_once, __fdelay_simd_check);
+	return __fdelay_simd;
+}
+
+#ifdef FDELAY_AVX2
+/* Four values per iteration; returns how many were converted */
+__attribute__((target("avx2")))
+static int __fdelay_cf_to_ps_simd(uint32_t *coarse, uint32_t *frac,
+				  uint64_t *ps, int n)
+{
+	const __m256i k8000 = _mm256_set1_epi64x(8000);
+	const __m256i k125 = _mm256_set1_epi64x(125);
+	__m256i c, f;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		c = _mm256_cvtepu32_epi64(_mm_loadu_si128((void *)(coarse + i)));
+		f = _mm256_cvtepu32_epi64(_mm_loadu_si128((void *)(frac + i)));
+		c = _mm256_mul_epu32(c, k8000);
+		f = _mm256_srli_epi64(_mm256_mul_epu32(f, k125), 6);
+		_mm256_storeu_si256((void *)(ps + i), _mm256_add_epi64(c, f));
+	}
+	return i;
+}
+
+/*
+ * Values below 2^52 are converted to double by or-ing the exponent of
+ * 2^52 and subtracting it. The quotient by 8000 may be off by one after
+ * the multiplication by the reciprocal, so it is fixed with integers.
+ * x / 125 is (x * 274877907) >> 35, exact for x < 2^19.
+ */
+__attribute__((target("avx2")))
+static int __fdelay_ps_to_cf_simd(uint64_t *ps, uint32_t *coarse,
+				  uint32_t *frac, int n)
+{
+	const __m256i magic_i = _mm256_set1_epi64x(0x4330000000000000LL);
+	const __m256d magic_d = _mm256_set1_pd(4503599627370496.0);
+	const __m256d rec = _mm256_set1_pd(1.0 / 8000);
+	const __m256i k8000 = _mm256_set1_epi64x(8000);
+	const __m256i k7999 = _mm256_set1_epi64x(7999);
+	const __m256i kdiv = _mm256_set1_epi64x(274877907);
+	const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256i p, q, r, m;
+	__m256d d;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		p = _mm256_loadu_si256((void *)(ps + i));
+		d = _mm256_sub_pd(_mm256_castsi256_pd(
+					  _mm256_or_si256(p, magic_i)), magic_d);
+		d = _mm256_floor_pd(_mm256_mul_pd(d, rec));
+		q = _mm256_sub_epi64(_mm256_castpd_si256(
+					     _mm256_add_pd(d, magic_d)), magic_i);
+		r = _mm256_sub_epi64(p, _mm256_mul_epu32(q, k8000));
+
+		m = _mm256_cmpgt_epi64(_mm256_setzero_si256(), r);
+		q = _mm256_add_epi64(q, m); /* m is -1 where r < 0 */
+		r = _mm256_add_epi64(r, _mm256_and_si256(m, k8000));
+		m = _mm256_cmpgt_epi64(r, k7999);
+		q = _mm256_sub_epi64(q, m);
+		r = _mm256_sub_epi64(r, _mm256_and_si256(m, k8000));
+
+		r = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_slli_epi64(r, 6),
+						       kdiv), 35);
+		q = _mm256_permutevar8x32_epi32(q, pack);
+		r = _mm256_permutevar8x32_epi32(r, pack);
+		_mm_storeu_si128((void *)(coarse + i), _mm256_castsi256_si128(q));
+		_mm_storeu_si128((void *)(frac + i), _mm256_castsi256_si128(r));
+	}
+	return i;
+}
+
+#elif defined(FDELAY_NEON)
+static int __fdelay_cf_to_ps_simd(uint32_t *coarse, uint32_t *frac,
+				  uint64_t *ps, int n)
+{
+	uint64x2_t c, f;
+	int i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		c = vmull_n_u32(vld1_u32(coarse + i), 8000);
+		f = vshrq_n_u64(vmull_n_u32(vld1_u32(frac + i), 125), 6);
+		vst1q_u64(ps + i, vaddq_u64(c, f));
+	}
+	return i;
+}
+
+/* The scalar loop is as good, as there's no 64-bit multiply-high */
+static int __fdelay_ps_to_cf_simd(uint64_t *ps, uint32_t *coarse,
+				  uint32_t *frac, int n)
+{
+	return 0;
+}
+
+#else
+static int __fdelay_cf_to_ps_simd(uint32_t *coarse, uint32_t *frac,
+				  uint64_t *ps, int n)
+{
+	return 0;
+}
+
+static int __fdelay_ps_to_cf_simd(uint64_t *ps, uint32_t *coarse,
+				  uint32_t *frac, int n)
+{
+	return 0;
+}
+#endif
+
+/* Picoseconds within the second, from and to coarse/frac arrays */
+void fdelay_cf_to_ps_n(uint32_t *coarse, uint32_t *frac, uint64_t *ps, int n)
+{
+	int i = 0;
+
+	if (fdelay_use_simd())
+		i = __fdelay_cf_to_ps_simd(coarse, frac, ps, n);
+	for (; i < n; i++)
+		ps[i] = fd_time_cf_to_ps(coarse[i], frac[i]);
+}
+
+void fdelay_ps_to_cf_n(uint64_t *ps, uint32_t *coarse, uint32_t *frac, int n)
+{
+	int i = 0;
+
+	if (fdelay_use_simd())
+		i = __fdelay_ps_to_cf_simd(ps, coarse, frac, n);
+	for (; i < n; i++)
+		fd_time_ps_to_cf(ps[i], coarse + i, frac + i);
+}
+
+/*
+ * Whole times, like fdelay_time_to_pico() and fdelay_pico_to_time().
+ * 64 bits of picoseconds overflow after 213 days: these are for
+ * durations, or times relative to a recent origin.
+ */
+void fdelay_time_to_pico_n(struct fd_time *t, uint64_t *pico, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		pico[i] = fd_time_to_ps(t + i);
+}
+
+void fdelay_pico_to_time_n(uint64_t *pico, struct fd_time *t, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		fd_time_from_ps(t + i, pico[i]);
+}
+
+/*
+ * Seconds as double. A double has 53 bits, so seconds are counted from
+ * base_utc: at 10^4 seconds from it, resolution is still about 2ps.
+ */
+void fdelay_time_to_double_n(struct fd_time *t, uint64_t base_utc,
+			     double *s, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		s[i] = (double)(int64_t)(t[i].utc - base_utc)
+			+ fd_time_cf_to_ps(t[i].coarse, t[i].frac) * 1e-12;
+}
+
+void fdelay_double_to_time_n(double *s, uint64_t base_utc,
+			     struct fd_time *t, int n)
+{
+	double sec;
+	int64_t ps;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sec = floor(s[i]);
+		ps = llrint((s[i] - sec) * 1e12);
+		if (ps >= (int64_t)FD_TIME_PS_PER_SEC) { /* rounding */
+			ps -= FD_TIME_PS_PER_SEC;
+			sec += 1;
+		}
+		t[i].utc = base_utc + (int64_t)sec;
+		fd_time_ps_to_cf(ps, &t[i].coarse, &t[i].frac);
+	}
+}
@@ -0,0 +1,287 @@
+/*
+ * Measure and check the time conversions and arithmetic (no board needed)
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "fdelay-lib.h"
+
+#define N	(1024 * 1024)
+#define LOOPS	20
+
+static struct fd_time t[N], t2[N];
+static uint64_t pico[N], ps[N];
+static uint32_t coarse[N], frac[N];
+static double sec[N];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char *name, double t0)
+{
+	double ns = (now() - t0) * 1e9 / ((double)N * LOOPS);
+
+	printf("   %-24s %6.2f ns/stamp  %7.1f M/s\n", name, ns, 1e3 / ns);
+}
+
+/* Back and forth, a value may lose one frac unit (1.95ps) */
+static int check(struct fd_time *t2, char *what)
+{
+	uint64_t a, b;
+	int i, err = 0;
+
+	for (i = 0; i < N; i++) {
+		fdelay_time_to_pico(t + i, &a);
+		fdelay_time_to_pico(t2 + i, &b);
+		if (a > b + 2 || b > a + 2)
+			err++;
+	}
+	if (err)
+		printf("   %s: %i mismatches\n", what, err);
+	return err;
+}
+
+/*
+ * Time arithmetic (fd-time.h) is checked against 128-bit integers,
+ * counting in frac units (1/4096 of 8ns), where nothing is truncated.
+ */
+#ifdef __SIZEOF_INT128__
+typedef __int128 ref_t;
+#define REF_PER_SEC	((ref_t)FD_TIME_COARSE_N * FD_TIME_FRAC_N)
+
+static ref_t ref(struct fd_time *t)
+{
+	return ((ref_t)t->utc * FD_TIME_COARSE_N + t->coarse)
+		* FD_TIME_FRAC_N + t->frac;
+}
+
+static int ref_ok(struct fd_time *t, ref_t r)
+{
+	return t->frac < FD_TIME_FRAC_N && t->coarse < FD_TIME_COARSE_N
+		&& ref(t) == r;
+}
+
+/* Picoseconds as frac units, truncated like fd_time_from_ps() does */
+static ref_t ref_ps(uint64_t ps)
+{
+	uint64_t tick = ps % FD_TIME_PS_PER_COARSE;
+
+	return (ref_t)(ps / FD_TIME_PS_PER_COARSE) * FD_TIME_FRAC_N
+		+ tick * FD_TIME_FRAC_N / FD_TIME_PS_PER_COARSE;
+}
+
+static uint64_t rand64(void)
+{
+	return (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand();
+}
+
+/* Random normalized time; mostly near the carry boundaries */
+static void rand_time(struct fd_time *t)
+{
+	t->utc = rand() & 1 ? rand() : rand64() >> (rand() & 63);
+	t->coarse = rand() % FD_TIME_COARSE_N;
+	t->frac = rand() % FD_TIME_FRAC_N;
+	if (rand() & 1)
+		t->coarse = rand() & 1 ? rand() % 4 : FD_TIME_COARSE_N - 1 - rand() % 4;
+	if (rand() & 1)
+		t->frac = rand() & 1 ? rand() % 4 : FD_TIME_FRAC_N - 1 - rand() % 4;
+}
+
+/* Picoseconds around carries, or anywhere in the 64 bits */
+static uint64_t rand_ps(void)
+{
+	static const uint64_t unit[] = {1, FD_TIME_PS_PER_COARSE,
+					FD_TIME_PS_PER_SEC};
+
+	switch (rand() % 3) {
+	case 0:
+		return rand64() >> (rand() & 63);
+	case 1:
+		return unit[rand() % 3] * (rand() % 1000) + rand() % 5 - 2;
+	default:
+		return -(uint64_t)(rand() % 5);
+	}
+}
+
+static int check_time_math(void)
+{
+	struct fd_time a, b, c;
+	uint32_t co, fr;
+	uint64_t ps, back;
+	int64_t sps;
+	int i, err = 0;
+
+	/* Every picosecond of a tick, and every frac value */
+	for (i = 0; i < FD_TIME_PS_PER_COARSE; i++) {
+		fd_time_ps_to_cf(FD_TIME_PS_PER_SEC - 1 - i, &co, &fr);
+		a.utc = 0; a.coarse = co; a.frac = fr;
+		err += !ref_ok(&a, ref_ps(FD_TIME_PS_PER_SEC - 1 - i));
+	}
+	for (i = 0; i < FD_TIME_FRAC_N; i++)
+		err += fd_time_cf_to_ps(7, i) != 7 * FD_TIME_PS_PER_COARSE
+			+ (uint64_t)i * FD_TIME_PS_PER_COARSE / FD_TIME_FRAC_N;
+
+	for (i = 0; i < N; i++) {
+		ps = rand_ps();
+		fd_time_from_ps(&a, ps);
+		err += !ref_ok(&a, ref_ps(ps));
+		back = fd_time_to_ps(&a); /* only valid below 2^64 ps */
+		if (a.utc < 18000000)
+			err += back > ps || ps - back > 2;
+
+		rand_time(&a);
+		rand_time(&b);
+		b.utc >>= 1; a.utc >>= 1; /* no overflow in the sum */
+		c = a;
+		fd_time_add(&c, &b);
+		err += !ref_ok(&c, ref(&a) + ref(&b));
+		fd_time_sub(&c, &b);
+		err += !ref_ok(&c, ref(&a));
+
+		sps = rand_ps();
+		if (sps == INT64_MIN)
+			sps++;
+		if (a.utc < 107 * 86400 || a.utc > (~0ULL >> 1))
+			a.utc = 107 * 86400 + (a.utc & 0xffff);
+		c = a;
+		fd_time_add_ps(&c, sps);
+		err += !ref_ok(&c, ref(&a) + (sps < 0 ? -ref_ps(-sps)
+					       : ref_ps(sps)));
+		fd_time_add_ps(&c, -sps);
+		err += !ref_ok(&c, ref(&a));
+
+		b = a;
+		b.utc += rand() % (100 * 86400) - 50 * 86400;
+		b.coarse = rand() % FD_TIME_COARSE_N;
+		sps = fd_time_diff_ps(&a, &b);
+		err += sps != (int64_t)(a.utc - b.utc) * (int64_t)FD_TIME_PS_PER_SEC
+			+ (int64_t)(fd_time_cf_to_ps(a.coarse, a.frac)
+				    - fd_time_cf_to_ps(b.coarse, b.frac));
+		err += fd_time_cmp(&a, &b) != (ref(&a) > ref(&b))
+			- (ref(&a) < ref(&b));
+	}
+	fd_time_from_ps(&a, ~0ULL);
+	err += !ref_ok(&a, ref_ps(~0ULL));
+	a.utc = 1ULL << 40; a.coarse = a.frac = 0;
+	c = a;
+	fd_time_add_ps(&c, INT64_MIN);
+	err += !ref_ok(&c, ref(&a) - ref_ps(1ULL << 63));
+
+	if (err)
+		printf("   fd-time.h: %i mismatches\n", err);
+	return err;
+}
+#else
+static int check_time_math(void)
+{
+	printf("   fd-time.h: no 128-bit integers, not checked\n");
+	return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	double t0;
+	int i, j, err = 0;
+
+	srand(1);
+	for (i = 0; i < N; i++) {
+		t[i].utc = 1000 + i / 1000; /* 64-bit picos last 213 days */
+		t[i].coarse = rand() % (125 * 1000 * 1000);
+		t[i].frac = rand() % 4096;
+		coarse[i] = t[i].coarse;
+		frac[i] = t[i].frac;
+	}
+	printf("%s: %i stamps, %i loops, SIMD %s\n", argv[0], N, LOOPS,
+	       getenv("FDELAY_LIB_NOSIMD") ? "disabled" : "allowed");
+
+	/* One at a time, as a reference */
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		for (i = 0; i < N; i++)
+			fdelay_time_to_pico(t + i, pico + i);
+	report("fdelay_time_to_pico", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		for (i = 0; i < N; i++)
+			fdelay_pico_to_time(pico + i, t2 + i);
+	report("fdelay_pico_to_time", t0);
+
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		fdelay_time_to_pico_n(t, pico, N);
+	report("fdelay_time_to_pico_n", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		fdelay_pico_to_time_n(pico, t2, N);
+	report("fdelay_pico_to_time_n", t0);
+	err += check(t2, "pico");
+
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		fdelay_cf_to_ps_n(coarse, frac, ps, N);
+	report("fdelay_cf_to_ps_n", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		fdelay_ps_to_cf_n(ps, coarse, frac, N);
+	report("fdelay_ps_to_cf_n", t0);
+	for (i = 0; i < N; i++)
+		if (ps[i] != pico[i] % (1000ULL * 1000 * 1000 * 1000)
+		    || coarse[i] != t2[i].coarse || frac[i] != t2[i].frac)
+			err++; /* Same code as above, with or without SIMD */
+
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		fdelay_time_to_double_n(t, t[0].utc, sec, N);
+	report("fdelay_time_to_double_n", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		fdelay_double_to_time_n(sec, t[0].utc, t2, N);
+	report("fdelay_double_to_time_n", t0);
+	err += check(t2, "double");
+
+	/* The time arithmetic used by the driver and the library */
+	for (i = 0; i < N; i++)
+		pico[i] = (rand() % 2000) * 1000ULL * 1000 * 1000 + rand();
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		for (i = 0; i < N; i++)
+			fd_time_from_ps(t2 + i, pico[i]);
+	report("fd_time_from_ps", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		for (i = 0; i < N; i++)
+			fd_time_add(t2 + i, t + i);
+	report("fd_time_add", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		for (i = 0; i < N; i++)
+			fd_time_add_ps(t2 + i, j & 1 ? pico[i] : -pico[i]);
+	report("fd_time_add_ps", t0);
+	t0 = now();
+	for (j = 0; j < LOOPS; j++)
+		for (i = 0; i < N; i++)
+			ps[i] = fd_time_diff_ps(t2 + i, t + i);
+	report("fd_time_diff_ps", t0);
+	err += check_time_math();
+
+	if (err)
+		printf("%s: %i errors\n", argv[0], err);
+	return err != 0;
+}
@@ -10,8 +10,9 @@
 int main(int argc, char **argv)
 {
 	struct fdelay_board *b;
-	int i, get = 0, host = 0, wr_on = 0, wr_off = 0;
-	struct fdelay_time t;
+	int i, get = 0, fast = 0, host = 0, wr_on = 0, wr_off = 0;
+	uint32_t err_ns;
+	struct fd_time t;
 	int dev = 0;
 
 	/* Parse, and kill "-i <devindex>" */
@@ -23,7 +24,8 @@ int main(int argc, char **argv)
 
 	if (argc != 2) {
 		fprintf(stderr,
-			"%s: Use \"%s [-i <devindex> \"get\"|\"host\"|\"local\"|\"wr\"|"
+			"%s: Use \"%s [-i <devindex> \"get\"|\"fast\"|\"host\"|\"local\"|"
+			"\"wr\"|"
 			"<float-value>\"\n", argv[0], argv[0]);
 		exit(1);
 	}
@@ -31,6 +33,8 @@ int main(int argc, char **argv)
 	/* Crappy parser */
 	if (!strcmp(argv[1], "get"))
 		get = 1;
+	else if (!strcmp(argv[1], "fast"))
+		fast = 1;
 	else if (!strcmp(argv[1], "host"))
 		host = 1;
 	else if (!strcmp(argv[1], "wr"))
@@ -87,6 +91,19 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (fast) {
+		if (fdelay_get_time_fast(b, &t, &err_ns) < 0) {
+			fprintf(stderr, "%s: fdelay_get_time_fast(): %s\n",
+				argv[0], strerror(errno));
+			exit(1);
+		}
+		printf("%lli.%09li +- %u ns\n", (long long)t.utc,
+		       (long)t.coarse * 8, err_ns);
+		fdelay_close(b);
+		fdelay_exit();
+		return 0;
+	}
+
 	if (host) {
 		if (fdelay_set_host_time(b) < 0) {
 			fprintf(stderr, "%s: fdelay_set_host_time(): %s\n",
@@ -0,0 +1,234 @@
+/*
+ * Coincidences among the sources of a merged (time-ordered) stream
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fdelay-lib.h"
+
+/*
+ * Stamps wait in a ring, in time order. [head, end) is the window
+ * opened by the head stamp: the following ones within window_ps. For
+ * the window we keep a count of stamps for each source and a mask of
+ * sources, updated as the two pointers move; nothing is rescanned.
+ * When a stamp beyond the window arrives, the window is closed: if it
+ * has enough sources it is a group and all its stamps are consumed,
+ * otherwise only the head is dropped and the next window is opened.
+ */
+struct fdelay_coinc {
+	int nfold;
+	int64_t window_ps;
+	unsigned mask;
+	unsigned head, end, tail;	/* free running */
+	struct fdelay_merge_item *ring;
+	uint32_t cnt[FDELAY_COINC_SOURCES];
+	uint64_t wmask;			/* sources in [head, end) */
+	struct fdelay_coinc_stats st;
+	struct fd_time first;		/* first stamp ever, for the rates */
+	uint64_t pairs[FDELAY_COINC_SOURCES][FDELAY_COINC_SOURCES];
+};
+
+struct fdelay_coinc *fdelay_coinc_create(int nfold, int depth,
+					 int64_t window_ps)
+{
+	struct fdelay_coinc *c;
+	unsigned size = 1;
+
+	if (nfold < 2 || nfold > FDELAY_COINC_SOURCES || depth <= 0
+	    || window_ps < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (size < depth)
+		size <<= 1;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->ring = calloc(size, sizeof(*c->ring));
+	if (!c->ring) {
+		free(c);
+		errno = ENOMEM;
+		return NULL;
+	}
+	c->nfold = nfold;
+	c->window_ps = window_ps;
+	c->mask = size - 1;
+	return c;
+}
+
+void fdelay_coinc_destroy(struct fdelay_coinc *c)
+{
+	if (!c)
+		return;
+	free(c->ring);
+	free(c);
+}
+
+/* Input comes from fdelay_merge_pop; late stamps are only counted */
+int fdelay_coinc_push(struct fdelay_coinc *c, struct fdelay_merge_item *in,
+		      int n)
+{
+	int i;
+
+	for (i = 0; i < n && c->tail - c->head <= c->mask; i++) {
+		if (in[i].stream < 0 || in[i].stream >= FDELAY_COINC_SOURCES) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (in[i].flags & FDELAY_MERGE_LATE) {
+			c->st.late++;
+			continue;
+		}
+		if (!c->st.stamps++)
+			c->first = in[i].t;
+		c->st.elapsed_ps = fd_time_diff_ps(&in[i].t, &c->first);
+		c->st.singles[in[i].stream]++;
+		c->ring[c->tail++ & c->mask] = in[i];
+	}
+	if (n && !i) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return i;
+}
+
+static inline struct fdelay_merge_item *__fdelay_coinc_at(
+	struct fdelay_coinc *c, unsigned i)
+{
+	return c->ring + (i & c->mask);
+}
+
+static inline void __fdelay_coinc_drop(struct fdelay_coinc *c)
+{
+	int s = __fdelay_coinc_at(c, c->head++)->stream;
+
+	if (!--c->cnt[s])
+		c->wmask &= ~(1ULL << s);
+}
+
+/* Move "end" as far as the window of the head stamp goes */
+static void __fdelay_coinc_extend(struct fdelay_coinc *c)
+{
+	struct fdelay_merge_item *h = __fdelay_coinc_at(c, c->head), *e;
+
+	if (c->end == c->head) { /* the previous window is all gone */
+		memset(c->cnt, 0, sizeof(c->cnt));
+		c->wmask = 0;
+	}
+	for (; c->end != c->tail; c->end++) {
+		e = __fdelay_coinc_at(c, c->end);
+		if (fd_time_diff_ps(&e->t, &h->t) > c->window_ps)
+			break;
+		c->cnt[e->stream]++;
+		c->wmask |= 1ULL << e->stream;
+	}
+}
+
+static void __fdelay_coinc_pairs(struct fdelay_coinc *c, uint64_t m)
+{
+	uint64_t m2;
+	int a, b;
+
+	for (; m; m &= m - 1) {
+		a = __builtin_ctzll(m);
+		for (m2 = m & (m - 1); m2; m2 &= m2 - 1) {
+			b = __builtin_ctzll(m2);
+			c->pairs[a][b]++;
+		}
+	}
+}
+
+/*
+ * Return closed groups; their stamps are stored in "items", from
+ * index g->first. FDELAY_COINC_DRAIN closes the last window too.
+ */
+int fdelay_coinc_pop(struct fdelay_coinc *c, struct fdelay_coinc_group *g,
+		     int ng, struct fdelay_merge_item *items, int ni,
+		     int flags)
+{
+	struct fdelay_merge_item *h;
+	int i = 0, k, nused = 0;
+
+	while (i < ng && c->head != c->tail) {
+		__fdelay_coinc_extend(c);
+		if (c->end == c->tail && !(flags & FDELAY_COINC_DRAIN))
+			break; /* the window may still grow */
+		if (__builtin_popcountll(c->wmask) < c->nfold) {
+			/* Not a group, but its pairs count all the same */
+			__fdelay_coinc_pairs(c, c->wmask);
+			__fdelay_coinc_drop(c);
+			continue;
+		}
+		k = c->end - c->head;
+		if (nused + k > ni) {
+			if (!i) {
+				errno = ENOSPC;
+				return -1;
+			}
+			break;
+		}
+		h = __fdelay_coinc_at(c, c->head);
+		g[i].t = h->t;
+		g[i].sources = c->wmask;
+		g[i].first = nused;
+		g[i].n = k;
+		g[i].span_ps = fd_time_diff_ps(&__fdelay_coinc_at(c, c->end - 1)->t,
+					       &h->t);
+		for (; c->head != c->end; c->head++)
+			items[nused++] = *__fdelay_coinc_at(c, c->head);
+		__fdelay_coinc_pairs(c, c->wmask);
+		c->st.groups++;
+		i++;
+	}
+	return i;
+}
+
+void fdelay_coinc_get_stats(struct fdelay_coinc *c,
+			    struct fdelay_coinc_stats *st)
+{
+	*st = c->st;
+}
+
+/* Singles rate of a source, in Hz, over the time seen so far */
+double fdelay_coinc_rate(struct fdelay_coinc *c, int source)
+{
+	if (source < 0 || source >= FDELAY_COINC_SOURCES
+	    || c->st.elapsed_ps <= 0)
+		return 0.0;
+	return c->st.singles[source] * 1e12 / c->st.elapsed_ps;
+}
+
+/*
+ * Closed windows including both sources, groups or not, so the count
+ * doesn't depend on nfold and compares with fdelay_coinc_accidental
+ */
+uint64_t fdelay_coinc_pair_count(struct fdelay_coinc *c, int a, int b)
+{
+	if (a < 0 || b < 0 || a >= FDELAY_COINC_SOURCES
+	    || b >= FDELAY_COINC_SOURCES || a == b)
+		return 0;
+	return a < b ? c->pairs[a][b] : c->pairs[b][a];
+}
+
+/*
+ * Expected rate of accidental pairs, for uncorrelated sources: either
+ * may open the window and the other one fall in it, so 2 * w * Ra * Rb.
+ * This is the rate of pair_count, whatever nfold, as long as w * R is
+ * small; n-fold groups by chance are much rarer than that.
+ */
+double fdelay_coinc_accidental(struct fdelay_coinc *c, int a, int b)
+{
+	return 2.0 * c->window_ps * 1e-12 * fdelay_coinc_rate(c, a)
+		* fdelay_coinc_rate(c, b);
+}
@@ -0,0 +1,105 @@
+/*
+ * Whole-board configuration, as a single binary blob
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+/* The blob is always transferred as a whole, like the rules table */
+static int __fdelay_config_io(struct __fdelay_board *b, struct fd_config *c,
+			      int write)
+{
+	char fname[128];
+	int fd, ret, len = sizeof(*c);
+
+	sprintf(fname, "%s/config", b->sysbase);
+	fd = open(fname, write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (write)
+		ret = pwrite(fd, c, len, 0);
+	else
+		ret = pread(fd, c, len, 0);
+	close(fd);
+	if (ret < 0)
+		return -1;
+	if (ret != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int fdelay_set_config(struct fdelay_board *userb, struct fd_config *c)
+{
+	__define_board(b, userb);
+
+	c->version = FD_CONFIG_VERSION;
+	return __fdelay_config_io(b, c, 1);
+}
+
+int fdelay_get_config(struct fdelay_board *userb, struct fd_config *c)
+{
+	__define_board(b, userb);
+
+	if (__fdelay_config_io(b, c, 0) < 0)
+		return -1;
+	if (c->version != FD_CONFIG_VERSION) {
+		errno = EPROTO; /* library and driver don't match */
+		return -1;
+	}
+	return 0;
+}
+
+/* Save and restore, as a file: only the valid fields are restored */
+int fdelay_save_config(struct fdelay_board *b, char *fname)
+{
+	struct fd_config c;
+	FILE *f;
+	int ret;
+
+	if (fdelay_get_config(b, &c) < 0)
+		return -1;
+	f = fopen(fname, "w");
+	if (!f)
+		return -1;
+	ret = fwrite(&c, sizeof(c), 1, f);
+	if (fclose(f) < 0 || ret != 1)
+		return -1;
+	return 0;
+}
+
+int fdelay_restore_config(struct fdelay_board *b, char *fname)
+{
+	struct fd_config c;
+	FILE *f;
+	int ret;
+
+	f = fopen(fname, "r");
+	if (!f)
+		return -1;
+	ret = fread(&c, sizeof(c), 1, f);
+	fclose(f);
+	if (ret != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (c.version != FD_CONFIG_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+	return fdelay_set_config(b, &c);
+}
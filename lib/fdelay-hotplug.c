@@ -0,0 +1,148 @@
+/*
+ * Boards that come and go: kernel uevents update the board table
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+/*
+ * The table is built by fdelay_init, with one scan of sysfs. Then we
+ * listen to the kernel (not to udev, so nothing else is needed) and
+ * only look at zio devices being added or removed. If the socket
+ * overflows, events are lost: then we scan again, once.
+ */
+struct fdelay_hotplug {
+	int fd;
+	fdelay_hotplug_cb cb;
+	void *arg;
+};
+
+#define HOTPLUG_RCVBUF (1024 * 1024) /* a crate powering up at once */
+
+struct fdelay_hotplug *fdelay_hotplug_create(fdelay_hotplug_cb cb, void *arg)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* the kernel's own */
+	};
+	struct fdelay_hotplug *h;
+	int size = HOTPLUG_RCVBUF;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+	h->cb = cb;
+	h->arg = arg;
+	h->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		       NETLINK_KOBJECT_UEVENT);
+	if (h->fd < 0)
+		goto err_free;
+	setsockopt(h->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(h->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		goto err_close;
+
+	/* Boards may have come or gone before we listened */
+	if (__fdelay_scan(cb, arg) < 0 && errno != EIO)
+		goto err_close;
+	return h;
+
+err_close:
+	close(h->fd);
+err_free:
+	free(h);
+	return NULL;
+}
+
+void fdelay_hotplug_destroy(struct fdelay_hotplug *h)
+{
+	if (!h)
+		return;
+	close(h->fd);
+	free(h);
+}
+
+/* To poll or select: it is readable when uevents are pending */
+int fdelay_hotplug_fileno(struct fdelay_hotplug *h)
+{
+	return h->fd;
+}
+
+/* Messages are "action@devpath" followed by "KEY=value" strings */
+static void __fdelay_uevent(struct fdelay_hotplug *h, char *buf, int len)
+{
+	char *p, *action = NULL, *subsystem = NULL, *devpath = NULL, *name;
+	int i, present;
+
+	for (p = buf + strlen(buf) + 1; p < buf + len; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+	}
+	if (!action || !devpath || !subsystem || strcmp(subsystem, "zio"))
+		return;
+	name = strrchr(devpath, '/');
+	name = name ? name + 1 : devpath;
+
+	if (!strcmp(action, "add")) {
+		i = __fdelay_board_found(name);
+		present = 1;
+	} else if (!strcmp(action, "remove")) {
+		i = __fdelay_board_lost(name);
+		present = 0;
+	} else {
+		return;
+	}
+	if (i >= 0 && h->cb)
+		h->cb(i, __fdelay_board_dev_id(i), present, h->arg);
+}
+
+/*
+ * Handle what is pending, calling back for each board that came or
+ * went; it never blocks. Returns 0 or -1 with errno.
+ */
+int fdelay_hotplug_process(struct fdelay_hotplug *h)
+{
+	char buf[4096];
+	struct sockaddr_nl sa;
+	socklen_t salen;
+	int n;
+
+	while (1) {
+		salen = sizeof(sa);
+		n = recvfrom(h->fd, buf, sizeof(buf) - 1, 0,
+			     (struct sockaddr *)&sa, &salen);
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n < 0 && errno == ENOBUFS) {
+			/* Overrun: we don't know what we missed */
+			if (__fdelay_scan(h->cb, h->arg) < 0 && errno != EIO)
+				return -1;
+			continue;
+		}
+		if (n < 0)
+			return -1;
+		if (sa.nl_pid != 0) /* only trust the kernel */
+			continue;
+		buf[n] = '\0';
+		__fdelay_uevent(h, buf, n);
+	}
+}
@@ -13,14 +13,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <glob.h>
+#include <dirent.h>
 #include <string.h>
 #include <errno.h>
-#include <assert.h>
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
@@ -29,71 +29,434 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
-static struct __fdelay_board *fd_boards;
-static int fd_nboards;
+/*
+ * Boards are allocated one by one, so a board that comes and goes
+ * (see fdelay-hotplug.c) keeps its address and index. The table
+ * only grows: a board that is gone is marked so, until it is back.
+ */
+static struct __fdelay_board **fd_boards;
+static int fd_nboards, fd_maxboards;
+static pthread_mutex_t fd_boards_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Init the library: return the number of boards found */
-int fdelay_init(void)
+/* "fd-0200" or "zio-fd-0200" (old and new ZIO), but not "fd-input" */
+static int __fdelay_parse_name(const char *name, int *dev_id)
+{
+	int n = 0;
+
+	if (!strncmp(name, "zio-", 4))
+		name += 4;
+	if (sscanf(name, "fd-%x%n", dev_id, &n) != 1 || name[n])
+		return -1;
+	return 0;
+}
+
+/* The device files may be in /dev/zio or in /dev, with the same name */
+static char *__fdelay_devbase(const char *name)
+{
+	static char *dirs[] = {"/dev/zio", "/dev"};
+	char path[128];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		sprintf(path, "%s/%s-0-0-ctrl", dirs[i], name);
+		if (!access(path, F_OK))
+			break;
+	}
+	if (i == ARRAY_SIZE(dirs)) /* not created yet: guess */
+		i = access(dirs[0], F_OK) ? 1 : 0;
+	sprintf(path, "%s/%s", dirs[i], name);
+	return strdup(path);
+}
+
+static int __fdelay_check_version(struct __fdelay_board *b, const char *fn)
 {
-	glob_t glob_dev, glob_sys;
-	struct __fdelay_board *b;
-	int i, j;
 	uint32_t v;
 
-	/* Look for boards in /dev: old and new pathnames: only one matches */
-	glob("/dev/fd-*-0-0-ctrl", 0, NULL, &glob_dev);
-	glob("/dev/zio/fd-*-0-0-ctrl", GLOB_APPEND, NULL, &glob_dev);
-	glob("/dev/zio-fd-*-0-0-ctrl", GLOB_APPEND, NULL, &glob_dev);
-	glob("/dev/zio/zio-fd-*-0-0-ctrl", GLOB_APPEND, NULL, &glob_dev);
-
-	/* And look in /sys as well */
-        glob("/sys/bus/zio/devices/fd-*", 0, NULL, &glob_sys);
-        glob("/sys/bus/zio/devices/zio-fd-*", GLOB_APPEND , NULL, &glob_sys);
-	assert(glob_dev.gl_pathc == glob_sys.gl_pathc);
-
-	/* Allocate as needed */
-	fd_nboards = glob_dev.gl_pathc;
-	if (!fd_nboards) {
-		fd_boards = NULL;
-		return 0;
+	if (fdelay_sysfs_get(b, "version", &v) < 0)
+		return -1;
+	if (v != FDELAY_VERSION) {
+		fprintf(stderr, "%s: version mismatch, lib(%i) != drv(%i)\n",
+			fn, FDELAY_VERSION, v);
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* The ZIO backend: attributes are files in sysfs */
+static int __fdelay_zio_attr_get(struct __fdelay_board *b, char *name,
+				 uint32_t *resp)
+{
+	char pathname[128];
+
+	sprintf(pathname, "%s/%s", b->sysbase, name);
+	return __fdelay_sysfs_get(pathname, resp);
+}
+
+static int __fdelay_zio_attr_set(struct __fdelay_board *b, char *name,
+				 uint32_t *value)
+{
+	char pathname[128];
+
+	sprintf(pathname, "%s/%s", b->sysbase, name);
+	return __fdelay_sysfs_set(pathname, value);
+}
+
+struct __fdelay_ops __fdelay_zio_ops = {
+	.name =		"zio",
+	.read =		__fdelay_zio_read,
+	.fileno_tdc =	__fdelay_zio_fileno_tdc,
+	.attr_get =	__fdelay_zio_attr_get,
+	.attr_set =	__fdelay_zio_attr_set,
+};
+
+/*
+ * Files of a board that went away and came back. Other threads may
+ * still hold the old descriptors or the old time page, so they are
+ * only released with the board itself, in fdelay_exit
+ */
+struct __fdelay_stale {
+	struct __fdelay_stale *next;
+	int fd[8]; /* fdc[5], fdd, fdo, fdt */
+	struct fd_time_page *time_page;
+};
+
+static void __fdelay_board_retire(struct __fdelay_board *b)
+{
+	struct __fdelay_stale *s;
+	int j, n = 0;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return; /* keep using the old files: they will fail */
+	/* Swap in -1 so __fdelay_open_once reopens them */
+	for (j = 0; j < ARRAY_SIZE(b->fdc); j++)
+		s->fd[n++] = __sync_lock_test_and_set(b->fdc + j, -1);
+	s->fd[n++] = __sync_lock_test_and_set(&b->fdd, -1);
+	s->fd[n++] = __sync_lock_test_and_set(&b->fdo, -1);
+	s->fd[n++] = __sync_lock_test_and_set(&b->fdt, -1);
+	s->time_page = __sync_lock_test_and_set(&b->time_page, NULL);
+	s->next = b->stale;
+	b->stale = s;
+}
+
+static void __fdelay_board_free(struct __fdelay_board *b)
+{
+	struct __fdelay_stale *s;
+	int j;
+
+	while ((s = b->stale)) {
+		for (j = 0; j < ARRAY_SIZE(s->fd); j++)
+			if (s->fd[j] >= 0)
+				close(s->fd[j]);
+		if (s->time_page)
+			munmap(s->time_page, sizeof(*s->time_page));
+		b->stale = s->next;
+		free(s);
+	}
+	if (b->ops->release)
+		b->ops->release(b);
+	pthread_mutex_destroy(&b->in_lock);
+	pthread_mutex_destroy(&b->time_lock);
+	free(b->sysbase);
+	free(b->devbase);
+	free(b);
+}
+
+/*
+ * Boards of other backends have no files: their names are in a
+ * directory that is not there, so what is ZIO-only fails with ENOENT
+ */
+static struct __fdelay_board *__fdelay_board_alloc(const char *name,
+						   int dev_id,
+						   struct __fdelay_ops *ops)
+{
+	struct __fdelay_board *b;
+	int j;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+	b->ops = ops;
+	b->dev_id = dev_id;
+	if (ops == &__fdelay_zio_ops) {
+		b->sysbase = malloc(strlen(FDELAY_SYS_DIR) + strlen(name) + 2);
+		b->devbase = __fdelay_devbase(name);
+		if (b->sysbase)
+			sprintf(b->sysbase, "%s/%s", FDELAY_SYS_DIR, name);
+	} else {
+		b->sysbase = malloc(strlen(FDELAY_VIRT_DIR) + strlen(name) + 2);
+		if (b->sysbase)
+			sprintf(b->sysbase, "%s/%s", FDELAY_VIRT_DIR, name);
+		b->devbase = b->sysbase ? strdup(b->sysbase) : NULL;
+	}
+	if (!b->sysbase || !b->devbase) {
+		free(b->sysbase);
+		free(b->devbase);
+		free(b);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (j = 0; j < ARRAY_SIZE(b->fdc); j++) {
+		b->fdc[j] = -1;
+	}
+	b->fdd = -1;
+	b->fdo = -1;
+	b->fdt = -1;
+	pthread_mutex_init(&b->in_lock, NULL);
+	pthread_mutex_init(&b->time_lock, NULL);
+	if (fdelay_is_verbose()) {
+		fprintf(stderr, "%s: %04x %s %s\n", __func__,
+			b->dev_id, b->sysbase, b->devbase);
+	}
+	return b;
+}
+
+/* Called with the lock held: returns the index */
+static int __fdelay_board_append(struct __fdelay_board *b)
+{
+	struct __fdelay_board **t;
+	int n;
+
+	if (fd_nboards == fd_maxboards) {
+		n = fd_maxboards ? fd_maxboards * 2 : 16;
+		t = realloc(fd_boards, n * sizeof(*t));
+		if (!t)
+			return -1;
+		fd_boards = t;
+		fd_maxboards = n;
+	}
+	fd_boards[fd_nboards] = b;
+	return fd_nboards++;
+}
+
+/*
+ * A board appeared (name is its directory in sysfs): return its index
+ * if it is new or back, or -1 if we already know it (or on error).
+ */
+/* Called with the lock held: index of the zio board, gone or not, or -1 */
+static int __fdelay_board_find_locked(int dev_id)
+{
+	int i;
+
+	for (i = 0; i < fd_nboards; i++)
+		if (fd_boards[i]->dev_id == dev_id
+		    && fd_boards[i]->ops == &__fdelay_zio_ops)
+			return i;
+	return -1;
+}
+
+int __fdelay_board_found(const char *name)
+{
+	struct __fdelay_board *b;
+	int i, dev_id;
+
+	if (__fdelay_parse_name(name, &dev_id) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&fd_boards_lock);
+	i = __fdelay_board_find_locked(dev_id);
+	if (i >= 0 && fd_boards[i]->gone) {
+		/* Back again: files of the old instance are stale */
+		b = fd_boards[i];
+		pthread_mutex_lock(&b->in_lock);
+		__fdelay_board_retire(b);
+		memset(b->seq, 0, sizeof(b->seq));
+		b->in_pending = 0;
+		pthread_mutex_unlock(&b->in_lock);
+		b->gone = 0;
+		pthread_mutex_unlock(&fd_boards_lock);
+		return i;
 	}
-	fd_boards = calloc(glob_dev.gl_pathc, sizeof(fd_boards[0]));
-	if (!fd_boards) {
-		globfree(&glob_dev);
-		globfree(&glob_sys);
+	pthread_mutex_unlock(&fd_boards_lock);
+	if (i >= 0) {
+		errno = EEXIST;
 		return -1;
 	}
 
-	for (i = 0, b = fd_boards; i < fd_nboards; i++, b++) {
-		b->sysbase = strdup(glob_sys.gl_pathv[i]);
-		b->devbase = strdup(glob_dev.gl_pathv[i]);
-		/* trim the "-0-0-ctrl" at the end */
-		b->devbase[strlen(b->devbase) - strlen("-0-0-ctrl")] = '\0';
-		/* extract dev_id */
-		sscanf(b->sysbase, "%*[^f]fd-%x", &b->dev_id);
-		for (j = 0; j < ARRAY_SIZE(b->fdc); j++) {
-			b->fdc[j] = -1;
-		}
-		if (fdelay_is_verbose()) {
-			fprintf(stderr, "%s: %04x %s %s\n", __func__,
-				b->dev_id, b->sysbase, b->devbase);
-		}
+	b = __fdelay_board_alloc(name, dev_id, &__fdelay_zio_ops);
+	if (!b)
+		return -1;
+	if (__fdelay_check_version(b, __func__) < 0) {
+		__fdelay_board_free(b);
+		return -1;
+	}
+	/* A scan and a hotplug event may have found it meanwhile */
+	pthread_mutex_lock(&fd_boards_lock);
+	if (__fdelay_board_find_locked(dev_id) >= 0) {
+		errno = EEXIST;
+		i = -1;
+	} else {
+		i = __fdelay_board_append(b);
 	}
-	globfree(&glob_dev);
-	globfree(&glob_sys);
+	pthread_mutex_unlock(&fd_boards_lock);
+	if (i < 0)
+		__fdelay_board_free(b);
+	return i;
+}
 
-	/* Now, if at least one board is there, check the version */
-	if (fd_nboards == 0)
-		return 0;
+static int __fdelay_board_lost_id(int dev_id)
+{
+	int i;
 
-	if (fdelay_sysfs_get(fd_boards, "version", &v) < 0)
+	pthread_mutex_lock(&fd_boards_lock);
+	for (i = 0; i < fd_nboards; i++)
+		if (fd_boards[i]->dev_id == dev_id && !fd_boards[i]->gone
+		    && fd_boards[i]->ops == &__fdelay_zio_ops)
+			break;
+	if (i < fd_nboards)
+		fd_boards[i]->gone = 1;
+	pthread_mutex_unlock(&fd_boards_lock);
+	return i < fd_nboards ? i : -1;
+}
+
+/* A board disappeared: it is kept, marked as gone. Returns the index */
+int __fdelay_board_lost(const char *name)
+{
+	int dev_id;
+
+	if (__fdelay_parse_name(name, &dev_id) < 0)
 		return -1;
-	if (v != FDELAY_VERSION) {
-		fprintf(stderr, "%s: version mismatch, lib(%i) != drv(%i)\n",
-			__func__, FDELAY_VERSION, v);
+	return __fdelay_board_lost_id(dev_id);
+}
+
+/* A board of another backend, which owns "priv": returns the index */
+int __fdelay_board_add(char *name, int dev_id, struct __fdelay_ops *ops,
+		       void *priv)
+{
+	struct __fdelay_board *b;
+	int i;
+
+	b = __fdelay_board_alloc(name, dev_id, ops);
+	if (!b) {
+		struct __fdelay_board tmp = {.ops = ops, .priv = priv};
+
+		if (ops->release)
+			ops->release(&tmp);
+		return -1;
+	}
+	b->priv = priv;
+	pthread_mutex_lock(&fd_boards_lock);
+	i = __fdelay_board_append(b);
+	pthread_mutex_unlock(&fd_boards_lock);
+	if (i < 0)
+		__fdelay_board_free(b);
+	return i;
+}
+
+int __fdelay_board_dev_id(int index)
+{
+	int dev_id;
+
+	pthread_mutex_lock(&fd_boards_lock);
+	dev_id = index < fd_nboards ? fd_boards[index]->dev_id : -1;
+	pthread_mutex_unlock(&fd_boards_lock);
+	return dev_id;
+}
+
+static int __fdelay_cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Scan sysfs once (no globbing), and report what changed since the
+ * last scan: boards that are new or back, in name order, then boards
+ * that are gone. Returns -1 with EIO if a board was refused because
+ * of its version; the others are there anyways.
+ */
+int __fdelay_scan(fdelay_hotplug_cb cb, void *arg)
+{
+	struct __fdelay_board *b;
+	struct dirent *de;
+	char **names = NULL, **p;
+	int i, j, n = 0, dev_id, refused = 0;
+	int *ids = NULL;
+	DIR *d;
+
+	d = opendir(FDELAY_SYS_DIR);
+	if (!d)
+		return errno == ENOENT ? 0 : -1; /* no zio: no boards */
+	while ((de = readdir(d))) {
+		if (__fdelay_parse_name(de->d_name, &dev_id) < 0)
+			continue;
+		p = realloc(names, (n + 1) * sizeof(*names));
+		if (!p)
+			break;
+		names = p;
+		names[n] = strdup(de->d_name);
+		if (names[n])
+			n++;
+	}
+	closedir(d);
+	if (n) {
+		qsort(names, n, sizeof(*names), __fdelay_cmp_names);
+		ids = calloc(n, sizeof(*ids));
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ids)
+			__fdelay_parse_name(names[i], ids + i);
+		j = __fdelay_board_found(names[i]);
+		if (j >= 0 && cb)
+			cb(j, __fdelay_board_dev_id(j), 1, arg);
+		if (j < 0 && errno == EIO)
+			refused++;
+		free(names[i]);
+	}
+	free(names);
+
+	/*
+	 * Whatever we know and is not there any more is gone. Boards are
+	 * never removed, but fd_boards may be reallocated: look it up
+	 * under the lock, and call back without it
+	 */
+	for (j = 0; ids || !n; j++) {
+		pthread_mutex_lock(&fd_boards_lock);
+		b = j < fd_nboards ? fd_boards[j] : NULL;
+		pthread_mutex_unlock(&fd_boards_lock);
+		if (!b)
+			break;
+		if (b->ops != &__fdelay_zio_ops)
+			continue;
+		dev_id = b->dev_id;
+		for (i = 0; i < n; i++)
+			if (ids[i] == dev_id)
+				break;
+		if (i == n && __fdelay_board_lost_id(dev_id) == j && cb)
+			cb(j, dev_id, 0, arg);
+	}
+	free(ids);
+	if (refused) {
 		errno = EIO;
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Init the library: return the number of boards found. The backend is
+ * ZIO, unless FDELAY_LIB_BACKEND is "sim[:<args>]" or "replay:<args>"
+ */
+int fdelay_init(void)
+{
+	char *s = getenv("FDELAY_LIB_BACKEND");
+	int ret;
+
+	if (!s || !strcmp(s, "zio"))
+		ret = __fdelay_scan(NULL, NULL);
+	else if (!strcmp(s, "sim") || !strncmp(s, "sim:", 4))
+		ret = __fdelay_sim_init(s[3] ? s + 4 : s + 3);
+	else if (!strncmp(s, "replay:", 7))
+		ret = __fdelay_replay_init(s + 7);
+	else {
+		fprintf(stderr, "%s: unknown backend \"%s\"\n", __func__, s);
+		errno = EINVAL;
+		ret = -1;
+	}
+	if (ret < 0)
+		return -1;
 	return fd_nboards;
 }
 
@@ -103,7 +466,8 @@ void fdelay_exit(void)
 	struct __fdelay_board *b;
 	int i, j, err;
 
-	for (i = 0, err = 0, b = fd_boards; i < fd_nboards; i++, b++) {
+	for (i = 0, err = 0; i < fd_nboards; i++) {
+		b = fd_boards[i];
 		for (j = 0; j < ARRAY_SIZE(b->fdc); j++) {
 			if (b->fdc[j] >= 0) {
 				close(b->fdc[j]);
@@ -111,14 +475,28 @@ void fdelay_exit(void)
 				err++;
 			}
 		}
+		if (b->fdd >= 0) {
+			close(b->fdd);
+			err++;
+		}
+		if (b->fdo >= 0) {
+			close(b->fdo);
+			err++;
+		}
+		if (b->fdt >= 0) {
+			close(b->fdt);
+			err++;
+		}
 		if (err)
 			fprintf(stderr, "%s: device %s was still open\n",
 				__func__, b->devbase);
-		free(b->sysbase);
-		free(b->devbase);
+		if (b->time_page)
+			munmap(b->time_page, sizeof(*b->time_page));
+		__fdelay_board_free(b);
 	}
-	if(fd_nboards)
-		free(fd_boards);
+	free(fd_boards);
+	fd_boards = NULL;
+	fd_nboards = fd_maxboards = 0;
 }
 
 /* Open one specific device. -1 arguments mean "not installed" */
@@ -133,33 +511,44 @@ struct fdelay_board *fdelay_open(int offset, int dev_id)
 		NULL
 	};
 
+	pthread_mutex_lock(&fd_boards_lock);
 	if (offset >= fd_nboards) {
 		errno = ENODEV;
-		return NULL;
+		goto out;
 	}
 	if (offset >= 0) {
-		b = fd_boards + offset;
+		b = fd_boards[offset];
 		if (dev_id >= 0 && dev_id != b->dev_id) {
 			errno = EINVAL;
-			return NULL;
+			b = NULL;
+			goto out;
 		}
 		goto found;
 	}
 	if (dev_id < 0) {
 		errno = EINVAL;
-		return NULL;
+		goto out;
 	}
-	for (i = 0, b = fd_boards; i < fd_nboards; i++, b++)
+	for (i = 0; i < fd_nboards; i++) {
+		b = fd_boards[i];
 		if (b->dev_id == dev_id)
 			goto found;
+	}
+	b = NULL;
 	errno = ENODEV;
-	return NULL;
+	goto out;
 
 found:
 	/*
 	 * We used to force post-samples to 1 here, but now
 	 * sample-size is zero and post-samples is not used
 	 */
+	if (b->gone) {
+		errno = ENODEV;
+		b = NULL;
+	}
+out:
+	pthread_mutex_unlock(&fd_boards_lock);
 	return (void *)b;
 }
 
@@ -195,6 +584,18 @@ int fdelay_close(struct fdelay_board *userb)
 			close(b->fdc[j]);
 		b->fdc[j] = -1;
 	}
+	if (b->fdd >= 0)
+		close(b->fdd);
+	b->fdd = -1;
+	if (b->fdo >= 0)
+		close(b->fdo);
+	b->fdo = -1;
+	if (b->fdt >= 0)
+		close(b->fdt);
+	b->fdt = -1;
+	if (b->time_page)
+		munmap(b->time_page, sizeof(*b->time_page));
+	b->time_page = NULL;
 	return 0;
 
 }
@@ -20,17 +20,92 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include <stdint.h>
+#include <time.h>
 #include "fine-delay.h"
+#include "fd-time.h"
 
 /* Opaque data type used as token */
 struct fdelay_board;
 
-struct fdelay_time {
-	uint64_t utc;
-	uint32_t coarse;
-	uint32_t frac;
-	uint32_t seq_id;
-	uint32_t channel;
+/* Input blocks are read in an arena, and used in place */
+struct fdelay_arena {
+	struct fd_time *t;	/* the records: n of them are valid */
+	int n;
+	int size;		/* capacity, in records */
+	int nblocks;		/* blocks read by the last fill */
+};
+
+#define fdelay_arena_for_each(_t, _a) \
+	for ((_t) = (_a)->t; (_t) < (_a)->t + (_a)->n; (_t)++)
+
+/* Stamps of several boards, merged in time order (opaque, too) */
+struct fdelay_merge;
+
+struct fdelay_merge_item {
+	struct fd_time t;
+	int stream;		/* the board, as numbered by the caller */
+	int flags;
+};
+
+#define FDELAY_MERGE_LATE	0x01	/* item flag: out of order */
+#define FDELAY_MERGE_DRAIN	0x01	/* pop flag: don't wait any more */
+
+/* Coincidences among the sources (boards) of a merged stream */
+struct fdelay_coinc;
+
+#define FDELAY_COINC_SOURCES	64	/* bits in "sources" */
+#define FDELAY_COINC_DRAIN	0x01	/* pop flag: close the last window */
+
+struct fdelay_coinc_group {
+	struct fd_time t;	/* the first stamp */
+	uint64_t sources;	/* bit mask */
+	int first, n;		/* the stamps, in the caller's item array */
+	int64_t span_ps;	/* last stamp minus first */
+};
+
+struct fdelay_coinc_stats {
+	uint64_t stamps, late, groups;
+	int64_t elapsed_ps;	/* from the first stamp to the last one */
+	uint64_t singles[FDELAY_COINC_SOURCES];
+};
+
+/*
+ * Input of many boards, through epoll. The callback is called when a
+ * board has data: it returns 0 if it read all of it (fdelay_read got
+ * less than asked), 1 if it stopped early, or -1 on error.
+ */
+struct fdelay_poll;
+typedef int (*fdelay_poll_cb)(struct fdelay_board *b, void *arg);
+
+/*
+ * Boards that come and go, from kernel uevents. The callback gets the
+ * index (for fdelay_open) and whether the board is there or is gone.
+ */
+struct fdelay_hotplug;
+typedef void (*fdelay_hotplug_cb)(int index, int dev_id, int present,
+				  void *arg);
+
+/* One board's stamps, broadcast in shared memory: publisher and readers */
+struct fdelay_shm;
+struct fdelay_shm_reader;
+
+#define FDELAY_SHM_OLDEST	0x01	/* open flag: not only new stamps */
+
+/*
+ * Sequence accounting, per channel of a board (0 is the input). The
+ * hardware counts in 16 bits; the library extends the count to 64 bits
+ * and returns its low half in seq_id (the low 16 bits are unchanged).
+ */
+#define FDELAY_SEQ_WINDOW	64	/* late stamps told from duplicates */
+
+struct fdelay_seq_stats {
+	uint64_t next;		/* the sequence number expected next */
+	uint64_t received;	/* including duplicates */
+	uint64_t lost;		/* gaps in the sequence, still open */
+	uint64_t duplicate;
+	uint64_t late;		/* out of order: each one closed a gap */
+	uint64_t driver_dropped; /* by the driver, this channel */
+	uint64_t overflow;	/* blocks too big for the arena (input only) */
 };
 
 /* The structure used for pulse generation */
@@ -40,20 +115,48 @@ struct fdelay_pulse {
 	/* -1 == infinite */
 	int rep;
 
-	struct fdelay_time start;
-	struct fdelay_time end;
-	struct fdelay_time loop;
+	struct fd_time start;
+	struct fd_time end;
+	struct fd_time loop;
 };
 
 /* An alternative structure, internally converted to the previous one */
 struct fdelay_pulse_ps {
 	int mode;
 	int rep;
-	struct fdelay_time start;
+	struct fd_time start;
 	uint64_t length;
 	uint64_t period;
 };
 
+/* Output configuration for one of several boards, armed together */
+struct fdelay_multi_pulses {
+	struct fdelay_board *b;
+	unsigned mask;
+	struct fdelay_pulse pulses[4];
+};
+
+/* A pattern is a list of pulses, relative to its origin */
+struct fdelay_pattern_item {
+	uint64_t start_ps;
+	uint64_t width_ps;
+};
+
+/* Patterns are compiled to trains, each loaded to hardware at once */
+struct fdelay_train {
+	uint64_t start_ps;
+	uint64_t width_ps;
+	uint64_t period_ps;
+	int rep;
+};
+
+/*
+ * The driver loads a train after the end of the previous one, polling
+ * every queue_poll_us and then writing the registers: a train can't
+ * start sooner than this after the previous one
+ */
+#define FDELAY_TRAIN_GAP_PS	(100ULL * 1000 * 1000) /* 100us */
+
 /*
  * Please see the manual for the meaning of arguments and return values
  */
@@ -65,29 +168,132 @@ extern struct fdelay_board *fdelay_open(int offset, int dev_id);
 extern struct fdelay_board *fdelay_open_by_lun(int lun);
 extern int fdelay_close(struct fdelay_board *);
 
-extern int fdelay_set_time(struct fdelay_board *b, struct fdelay_time *t);
-extern int fdelay_get_time(struct fdelay_board *b, struct fdelay_time *t);
+extern struct fdelay_hotplug *fdelay_hotplug_create(fdelay_hotplug_cb cb,
+						    void *arg);
+extern void fdelay_hotplug_destroy(struct fdelay_hotplug *h);
+extern int fdelay_hotplug_fileno(struct fdelay_hotplug *h);
+extern int fdelay_hotplug_process(struct fdelay_hotplug *h);
+
+extern int fdelay_set_time(struct fdelay_board *b, struct fd_time *t);
+extern int fdelay_get_time(struct fdelay_board *b, struct fd_time *t);
 extern int fdelay_set_host_time(struct fdelay_board *b);
+extern int fdelay_get_time_fast(struct fdelay_board *b, struct fd_time *t,
+				uint32_t *err_ns);
+extern int fdelay_time_to_host(struct fdelay_board *b, clockid_t clock,
+			       struct fd_time *t, int64_t *host_ns, int n);
 
 extern int fdelay_set_config_tdc(struct fdelay_board *b, int flags);
 extern int fdelay_get_config_tdc(struct fdelay_board *b);
 
-extern int fdelay_fread(struct fdelay_board *b, struct fdelay_time *t, int n);
+extern int fdelay_fread(struct fdelay_board *b, struct fd_time *t, int n);
 extern int fdelay_fileno_tdc(struct fdelay_board *b);
-extern int fdelay_read(struct fdelay_board *b, struct fdelay_time *t, int n,
+extern int fdelay_read(struct fdelay_board *b, struct fd_time *t, int n,
 		       int flags);
 /* raw_tdc=1 version of fdelay_read() */
-extern int fdelay_read_raw(struct fdelay_board *userb, struct fdelay_time *t, int n,
+extern int fdelay_read_raw(struct fdelay_board *userb, struct fd_time *t, int n,
 				unsigned char *databuffer, int *nsamples, int flags);
-		       
-extern void fdelay_pico_to_time(uint64_t *pico, struct fdelay_time *time);
-extern void fdelay_time_to_pico(struct fdelay_time *time, uint64_t *pico);
+extern struct fdelay_arena *fdelay_arena_alloc(int size);
+extern void fdelay_arena_free(struct fdelay_arena *a);
+extern int fdelay_read_blocks(struct fdelay_board *b, struct fdelay_arena *a,
+			      int flags);
+extern int fdelay_decode_soa(struct fd_time *t, int n, uint64_t *utc,
+			     uint64_t *ps, uint32_t *seq);
+extern int fdelay_get_seq_stats(struct fdelay_board *b, int channel,
+				struct fdelay_seq_stats *st);
+extern uint64_t fdelay_seq64(struct fdelay_board *b, struct fd_time *t);
+
+extern struct fdelay_merge *fdelay_merge_create(int nstreams, int depth,
+						int64_t window_ps);
+extern void fdelay_merge_destroy(struct fdelay_merge *m);
+extern int fdelay_merge_push(struct fdelay_merge *m, int stream,
+			     struct fd_time *t, int n);
+extern int fdelay_merge_pop(struct fdelay_merge *m,
+			    struct fdelay_merge_item *out, int n,
+			    struct fd_time *now, int flags);
+extern int fdelay_merge_pending(struct fdelay_merge *m);
+
+extern struct fdelay_coinc *fdelay_coinc_create(int nfold, int depth,
+						int64_t window_ps);
+extern void fdelay_coinc_destroy(struct fdelay_coinc *c);
+extern int fdelay_coinc_push(struct fdelay_coinc *c,
+			     struct fdelay_merge_item *in, int n);
+extern int fdelay_coinc_pop(struct fdelay_coinc *c,
+			    struct fdelay_coinc_group *g, int ng,
+			    struct fdelay_merge_item *items, int ni, int flags);
+extern void fdelay_coinc_get_stats(struct fdelay_coinc *c,
+				   struct fdelay_coinc_stats *st);
+extern double fdelay_coinc_rate(struct fdelay_coinc *c, int source);
+extern uint64_t fdelay_coinc_pair_count(struct fdelay_coinc *c, int a, int b);
+extern double fdelay_coinc_accidental(struct fdelay_coinc *c, int a, int b);
+
+extern struct fdelay_poll *fdelay_poll_create(void);
+extern void fdelay_poll_destroy(struct fdelay_poll *p);
+extern int fdelay_poll_fileno(struct fdelay_poll *p);
+extern int fdelay_poll_add(struct fdelay_poll *p, struct fdelay_board *b,
+			   fdelay_poll_cb cb, void *arg);
+extern int fdelay_poll_del(struct fdelay_poll *p, struct fdelay_board *b);
+extern int fdelay_poll_wait(struct fdelay_poll *p, int timeout_ms);
+
+extern struct fdelay_shm *fdelay_shm_create(const char *name, int size);
+extern void fdelay_shm_destroy(struct fdelay_shm *s);
+extern int fdelay_shm_write(struct fdelay_shm *s, struct fd_time *t, int n);
+extern int fdelay_shm_pump(struct fdelay_shm *s, struct fdelay_board *b,
+			   int flags);
+extern struct fdelay_shm_reader *fdelay_shm_open(const char *name, int flags);
+extern void fdelay_shm_close(struct fdelay_shm_reader *r);
+extern int fdelay_shm_read(struct fdelay_shm_reader *r, struct fd_time *t,
+			   int n, int flags);
+extern uint64_t fdelay_shm_lost(struct fdelay_shm_reader *r);
+
+extern void fdelay_pico_to_time(uint64_t *pico, struct fd_time *time);
+extern void fdelay_time_to_pico(struct fd_time *time, uint64_t *pico);
+
+/* Batch conversions, for arrays of stamps (SIMD where available) */
+extern void fdelay_time_to_pico_n(struct fd_time *t, uint64_t *pico, int n);
+extern void fdelay_pico_to_time_n(uint64_t *pico, struct fd_time *t, int n);
+extern void fdelay_cf_to_ps_n(uint32_t *coarse, uint32_t *frac, uint64_t *ps,
+			      int n);
+extern void fdelay_ps_to_cf_n(uint64_t *ps, uint32_t *coarse, uint32_t *frac,
+			      int n);
+extern void fdelay_time_to_double_n(struct fd_time *t, uint64_t base_utc,
+				    double *s, int n);
+extern void fdelay_double_to_time_n(double *s, uint64_t base_utc,
+				    struct fd_time *t, int n);
 
 extern int fdelay_config_pulse(struct fdelay_board *b,
 			       int channel, struct fdelay_pulse *pulse);
 extern int fdelay_config_pulse_ps(struct fdelay_board *b,
 				  int channel, struct fdelay_pulse_ps *ps);
+extern int fdelay_config_pulses(struct fdelay_board *b,
+				unsigned mask, struct fdelay_pulse *pulses);
+extern int fdelay_queue_pulse(struct fdelay_board *b,
+			      int channel, struct fdelay_pulse *pulse);
 extern int fdelay_has_triggered(struct fdelay_board *b, int channel);
+extern int fdelay_fileno_triggers(struct fdelay_board *b);
+extern int fdelay_read_triggers(struct fdelay_board *b, struct fd_time *t);
+extern int fdelay_set_rules(struct fdelay_board *b, struct fd_rule *rules);
+extern int fdelay_get_rules(struct fdelay_board *b, struct fd_rule *rules);
+
+extern int fdelay_config_pulses_multi(struct fdelay_multi_pulses *mp, int n);
+extern int fdelay_set_time_multi(struct fdelay_board **boards, int n,
+				 struct fd_time *t);
+extern int fdelay_check_skew(struct fdelay_board **boards, int n,
+			     int64_t *skew_ns, uint32_t *err_ns);
+
+extern int fdelay_pattern_compile(struct fdelay_pattern_item *items, int n,
+				  int repeat, uint64_t period_ps,
+				  struct fdelay_train *trains, int max);
+extern int fdelay_pattern_load(struct fdelay_board *b, int channel,
+			       struct fd_time *origin,
+			       struct fdelay_train *trains, int n);
+extern int fdelay_pattern_run(struct fdelay_board *b, int channel,
+			      struct fd_time *origin,
+			      struct fdelay_train *trains, int n);
+
+extern int fdelay_set_config(struct fdelay_board *b, struct fd_config *c);
+extern int fdelay_get_config(struct fdelay_board *b, struct fd_config *c);
+extern int fdelay_save_config(struct fdelay_board *b, char *fname);
+extern int fdelay_restore_config(struct fdelay_board *b, char *fname);
 
 extern int fdelay_wr_mode(struct fdelay_board *b, int on);
 extern int fdelay_check_wr_mode(struct fdelay_board *b);
@@ -97,18 +303,90 @@ extern float fdelay_read_temperature(struct fdelay_board *b);
 #ifdef FDELAY_INTERNAL /* Libray users should ignore what follows */
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
-/* Internal structure */
+struct __fdelay_board;
+
+/*
+ * A backend: the ZIO driver, or boards made up in memory (simulated
+ * or replayed, see fdelay-sim.c). Attributes are named as in sysfs;
+ * anything else (outputs, triggers, the time page) is ZIO only.
+ */
+struct __fdelay_ops {
+	char *name;
+	int (*read)(struct __fdelay_board *b, struct fd_time *t, int n,
+		    int flags);
+	int (*fileno_tdc)(struct __fdelay_board *b);
+	int (*attr_get)(struct __fdelay_board *b, char *name, uint32_t *v);
+	int (*attr_set)(struct __fdelay_board *b, char *name, uint32_t *v);
+	void (*release)(struct __fdelay_board *b);
+};
+
+extern struct __fdelay_ops __fdelay_zio_ops;
+
+/* Sequence state of one channel, under in_lock (see fdelay-seq.c) */
+struct __fdelay_seq {
+	int started;
+	uint32_t dropped;	/* the driver's counter, at the last gap check */
+	uint64_t seen;		/* bit i: "next - 1 - i" was received */
+	struct fdelay_seq_stats st;
+};
+
+/*
+ * Internal structure. Files are opened at first use, by any thread
+ * (see __fdelay_open_once). Each channel has its own descriptor, so
+ * channels never contend; only state made of several parts has a lock.
+ */
 struct __fdelay_board {
+	struct __fdelay_ops *ops;
+	void *priv; /* for the backend */
 	int dev_id;
+	int gone; /* removed from the system: see fdelay-hotplug.c */
 	char *devbase;
 	char *sysbase;
 	int fdc[5]; /* The 5 control channels */
 	int fdd; /* data channel in tdc_raw=1 mode */
+	int fdo; /* the binary "outputs" file, for batched configuration */
+	int fdt; /* the binary "triggers" file, for output notification */
+	struct fd_time_page *time_page; /* mapped at first use */
+	pthread_mutex_t in_lock; /* a raw block is a control plus data */
+	uint32_t in_pending; /* block whose control was read: its samples */
+	uint32_t in_pending_dropped[5]; /* ... and the "dropped" of its control */
+	struct __fdelay_seq seq[5]; /* input and outputs, as in t->channel */
+	pthread_mutex_t time_lock; /* time is three sysfs attributes */
+	struct __fdelay_stale *stale; /* files of a previous instance */
 };
 
+/*
+ * Return *fdp, opening the file if it is not open yet. Threads may
+ * race to open it: the loser closes its own descriptor and uses
+ * the winner's, so no lock is needed and each file is opened once.
+ */
+static inline int __fdelay_open_once(int *fdp, int flags, const char *fmt, ...)
+{
+	char fname[128];
+	va_list args;
+	int fd;
+
+	fd = *(volatile int *)fdp;
+	if (fd >= 0)
+		return fd;
+	va_start(args, fmt);
+	vsnprintf(fname, sizeof(fname), fmt, args);
+	va_end(args);
+	fd = open(fname, flags);
+	if (fd < 0)
+		return -1;
+	if (!__sync_bool_compare_and_swap(fdp, -1, fd)) {
+		close(fd);
+		fd = *(volatile int *)fdp;
+	}
+	return fd;
+}
+
 static inline int fdelay_is_verbose(void)
 {
 	return getenv("FDELAY_LIB_VERBOSE") != 0;
@@ -153,29 +431,73 @@ static inline int __fdelay_sysfs_set(char *path, uint32_t *value)
 	return -1;
 }
 
-/* And these two for the board structure */
+/* And these two for the board structure, whatever the backend */
 static inline int fdelay_sysfs_get(struct __fdelay_board *b, char *name,
 			       uint32_t *resp)
 {
-	char pathname[128];
-
-	sprintf(pathname, "%s/%s", b->sysbase, name);
-	return __fdelay_sysfs_get(pathname, resp);
+	return b->ops->attr_get(b, name, resp);
 }
 
 static inline int fdelay_sysfs_set(struct __fdelay_board *b, char *name,
 			       uint32_t *value)
 {
-	char pathname[128];
-
-	sprintf(pathname, "%s/%s", b->sysbase, name);
-	return __fdelay_sysfs_set(pathname, value);
+	return b->ops->attr_set(b, name, value);
 }
 
 static inline int __fdelay_command(struct __fdelay_board *b, uint32_t cmd)
 {
 	return fdelay_sysfs_set(b, "command", &cmd);
 }
+
+/* The board table, in fdelay-init.c, and its updates */
+#define FDELAY_SYS_DIR "/sys/bus/zio/devices"
+#define FDELAY_VIRT_DIR "/dev/fdelay-virtual" /* not there, on purpose */
+
+extern int __fdelay_scan(fdelay_hotplug_cb cb, void *arg);
+extern int __fdelay_board_found(const char *name);
+extern int __fdelay_board_lost(const char *name);
+extern int __fdelay_board_dev_id(int index);
+extern int __fdelay_board_add(char *name, int dev_id,
+			      struct __fdelay_ops *ops, void *priv);
+
+/* The ZIO backend, and the others: name and arguments are from the user */
+extern int __fdelay_zio_read(struct __fdelay_board *b, struct fd_time *t,
+			     int n, int flags);
+extern int __fdelay_zio_fileno_tdc(struct __fdelay_board *b);
+extern int __fdelay_sim_init(char *args);
+extern int __fdelay_replay_init(char *args);
+
+/*
+ * Boards made up in memory (fdelay-sim.c): a source makes the stamps,
+ * in time order, and they are delivered when they are due, at "speed"
+ * times real time (0: as fast as they are read).
+ */
+struct __fdelay_virt_source {
+	int (*peek)(void *src, struct fd_time *t); /* -1 at the end */
+	void (*pop)(void *src);
+	void (*release)(void *src);
+};
+
+extern int __fdelay_virt_add(char *name, int dev_id, double speed,
+			     struct fd_time *base,
+			     struct __fdelay_virt_source *ops, void *src);
+extern char *__fdelay_virt_arg(char *args, char *key, char *buf, int len);
+extern double __fdelay_virt_num(char *args, char *key, double def);
+
+/*
+ * Extend the sequence of stamps just read; "dropped" is from the control:
+ * the driver's counts per channel, or NULL if there are none
+ */
+extern void __fdelay_seq_extend(struct __fdelay_board *b,
+				struct fd_time *t, int n,
+				const uint32_t *dropped);
+
+/* Batched output configuration, split in two steps for multi-board use */
+extern int __fdelay_stage_batch(struct __fdelay_board *b, unsigned mask,
+				uint32_t flags, struct fdelay_pulse *pulses,
+				struct fd_out_batch *batch);
+extern int __fdelay_commit_batch(struct __fdelay_board *b,
+				 struct fd_out_batch *batch);
 #endif /* FDELAY_INTERNAL */
 
 #ifdef __cplusplus
@@ -3,16 +3,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 
 #define FDELAY_INTERNAL /* hack... */
 #include "fdelay-lib.h"
 
+static void show(int index, int dev_id, int present, void *arg)
+{
+	struct __fdelay_board *b;
+
+	b = (typeof(b))fdelay_open(index, -1);
+	if (!present || !b) {
+		printf("  dev_id %04x is gone\n", dev_id);
+		return;
+	}
+	printf("  dev_id %04x, %s, %s\n", b->dev_id, b->devbase, b->sysbase);
+}
+
 int main(int argc, char **argv)
 {
 	int i, j;
-	struct __fdelay_board *b;
-	struct fdelay_board *ub;
+	struct fdelay_hotplug *h;
+	struct pollfd pfd;
 
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-w"))) {
+		fprintf(stderr, "%s: Use \"%s [-w]\" (-w: watch)\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
 	i = fdelay_init();
 	if (i < 0) {
 		fprintf(stderr, "%s: fdelay_init(): %s\n", argv[0],
@@ -21,13 +39,28 @@ int main(int argc, char **argv)
 	}
 	printf("%s: found %i boards\n", argv[0], i);
 
-	for (j = 0; j < i; j++) {
-		ub = fdelay_open(j, -1);
-		b = (typeof(b))ub;
-		printf("  dev_id %04x, %s, %s\n", b->dev_id, b->devbase,
-		       b->sysbase);
+	for (j = 0; j < i; j++)
+		show(j, -1, 1, NULL);
+
+	if (argc == 2) { /* keep reporting boards as they come and go */
+		h = fdelay_hotplug_create(show, NULL);
+		if (!h) {
+			fprintf(stderr, "%s: hotplug: %s\n", argv[0],
+				strerror(errno));
+			exit(1);
+		}
+		pfd.fd = fdelay_hotplug_fileno(h);
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, -1) >= 0) {
+			if (fdelay_hotplug_process(h) < 0) {
+				fprintf(stderr, "%s: hotplug: %s\n", argv[0],
+					strerror(errno));
+				break;
+			}
+			fflush(stdout);
+		}
+		fdelay_hotplug_destroy(h);
 	}
 	fdelay_exit();
 	return 0;
 }
-
@@ -0,0 +1,243 @@
+/*
+ * Merge stamps from several boards into a single time-ordered stream
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fdelay-lib.h"
+
+/*
+ * Every stream (board) has a ring of pending stamps, in arrival order,
+ * which is time order for a single board. A binary heap keeps the
+ * streams that have something pending, by time of their oldest stamp.
+ * The heap head is emitted once it is older than the watermark: either
+ * all streams have gone past it, or it is more than "window" older
+ * than the newest time we know of. So an idle board delays output by
+ * the window at most.
+ */
+struct __fdelay_merge_queue {
+	struct fd_time *t;
+	unsigned head, tail;		/* free running */
+	struct fd_time last;		/* newest pushed, if "seen" */
+	int seen;
+};
+
+struct fdelay_merge {
+	int nstreams;
+	unsigned mask;			/* queue size is a power of two */
+	int64_t window_ps;
+	struct fd_time latest;		/* newest stamp of any stream */
+	struct fd_time out;		/* newest stamp emitted */
+	int emitted;
+	int nheap;
+	int *heap;
+	struct __fdelay_merge_queue *q;
+};
+
+static inline struct fd_time *__fdelay_merge_head(struct fdelay_merge *m,
+						  int s)
+{
+	return m->q[s].t + (m->q[s].head & m->mask);
+}
+
+/* Ties are broken by stream number, so output is reproducible */
+static inline int __fdelay_merge_less(struct fdelay_merge *m, int a, int b)
+{
+	int c = fd_time_cmp(__fdelay_merge_head(m, a),
+			    __fdelay_merge_head(m, b));
+
+	return c ? c < 0 : a < b;
+}
+
+static void __fdelay_merge_up(struct fdelay_merge *m, int i)
+{
+	int s = m->heap[i];
+
+	while (i && __fdelay_merge_less(m, s, m->heap[(i - 1) / 2])) {
+		m->heap[i] = m->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	m->heap[i] = s;
+}
+
+static void __fdelay_merge_down(struct fdelay_merge *m, int i)
+{
+	int s = m->heap[i], c;
+
+	while ((c = 2 * i + 1) < m->nheap) {
+		if (c + 1 < m->nheap
+		    && __fdelay_merge_less(m, m->heap[c + 1], m->heap[c]))
+			c++;
+		if (!__fdelay_merge_less(m, m->heap[c], s))
+			break;
+		m->heap[i] = m->heap[c];
+		i = c;
+	}
+	m->heap[i] = s;
+}
+
+/* "depth" is the number of pending stamps for each stream */
+struct fdelay_merge *fdelay_merge_create(int nstreams, int depth,
+					 int64_t window_ps)
+{
+	struct fdelay_merge *m;
+	unsigned size = 1;
+	int i;
+
+	if (nstreams <= 0 || depth <= 0 || window_ps < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (size < depth)
+		size <<= 1;
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	m->nstreams = nstreams;
+	m->mask = size - 1;
+	m->window_ps = window_ps;
+	m->heap = calloc(nstreams, sizeof(*m->heap));
+	m->q = calloc(nstreams, sizeof(*m->q));
+	if (!m->heap || !m->q)
+		goto err;
+	m->q[0].t = calloc((size_t)nstreams * size, sizeof(*m->q[0].t));
+	if (!m->q[0].t)
+		goto err;
+	for (i = 1; i < nstreams; i++)
+		m->q[i].t = m->q[0].t + (size_t)i * size;
+	return m;
+err:
+	fdelay_merge_destroy(m);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void fdelay_merge_destroy(struct fdelay_merge *m)
+{
+	if (!m)
+		return;
+	if (m->q)
+		free(m->q[0].t);
+	free(m->q);
+	free(m->heap);
+	free(m);
+}
+
+/* Returns how many were queued: less than n if the stream is full */
+int fdelay_merge_push(struct fdelay_merge *m, int stream,
+		      struct fd_time *t, int n)
+{
+	struct __fdelay_merge_queue *q;
+	int i;
+
+	if (stream < 0 || stream >= m->nstreams || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	q = m->q + stream;
+	for (i = 0; i < n && q->tail - q->head <= m->mask; i++) {
+		q->t[q->tail++ & m->mask] = t[i];
+		if (q->tail - q->head == 1) {
+			m->heap[m->nheap++] = stream;
+			__fdelay_merge_up(m, m->nheap - 1);
+		}
+		q->last = t[i];
+		q->seen = 1;
+		if (fd_time_cmp(t + i, &m->latest) > 0)
+			m->latest = t[i];
+	}
+	if (n && !i) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return i;
+}
+
+/* "t" minus the window, but not before time zero */
+static void __fdelay_merge_back(struct fdelay_merge *m, struct fd_time *t,
+				struct fd_time *wm)
+{
+	struct fd_time z = {};
+
+	*wm = *t;
+	fd_time_add_ps(wm, -m->window_ps);
+	if (fd_time_cmp(wm, t) > 0)
+		*wm = z; /* wrapped */
+}
+
+/*
+ * Emit up to n stamps, in time order, that can't be preceded by any
+ * other. "now" (may be NULL) is board time, to flush when all boards
+ * are idle; FDELAY_MERGE_DRAIN emits everything. A stamp older than
+ * one already emitted (it came later than the window) is emitted
+ * as soon as possible, marked FDELAY_MERGE_LATE.
+ */
+int fdelay_merge_pop(struct fdelay_merge *m, struct fdelay_merge_item *out,
+		     int n, struct fd_time *now, int flags)
+{
+	struct fd_time wm = {}, tmp, *t;
+	int i, s;
+
+	if (n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(flags & FDELAY_MERGE_DRAIN)) {
+		for (s = 0; s < m->nstreams && m->q[s].seen; s++)
+			if (!s || fd_time_cmp(&m->q[s].last, &wm) < 0)
+				wm = m->q[s].last;
+		if (s < m->nstreams) /* some stream is still silent */
+			memset(&wm, 0, sizeof(wm));
+		__fdelay_merge_back(m, &m->latest, &tmp);
+		if (fd_time_cmp(&tmp, &wm) > 0)
+			wm = tmp;
+		if (now) {
+			__fdelay_merge_back(m, now, &tmp);
+			if (fd_time_cmp(&tmp, &wm) > 0)
+				wm = tmp;
+		}
+	}
+
+	for (i = 0; i < n && m->nheap; i++) {
+		s = m->heap[0];
+		t = __fdelay_merge_head(m, s);
+		if (!(flags & FDELAY_MERGE_DRAIN) && fd_time_cmp(t, &wm) > 0)
+			break;
+		out[i].t = *t;
+		out[i].stream = s;
+		out[i].flags = 0;
+		if (m->emitted && fd_time_cmp(t, &m->out) < 0) {
+			out[i].flags = FDELAY_MERGE_LATE;
+		} else {
+			m->out = *t;
+			m->emitted = 1;
+		}
+		m->q[s].head++;
+		if (m->q[s].head == m->q[s].tail)
+			m->heap[0] = m->heap[--m->nheap];
+		if (m->nheap)
+			__fdelay_merge_down(m, 0);
+	}
+	return i;
+}
+
+/* Stamps still waiting in the merge stage */
+int fdelay_merge_pending(struct fdelay_merge *m)
+{
+	int s, n = 0;
+
+	for (s = 0; s < m->nstreams; s++)
+		n += m->q[s].tail - m->q[s].head;
+	return n;
+}
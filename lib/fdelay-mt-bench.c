@@ -0,0 +1,273 @@
+/*
+ * Stress the library from several threads at the same time
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#define FDELAY_INTERNAL /* to race on __fdelay_open_once */
+#include "fdelay-lib.h"
+
+#define ROUNDS	2000
+#define N	(64 * 1024)
+#define MAX_THREADS 64
+
+static int nthreads = 8, seconds = 2;
+static pthread_barrier_t barrier;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Open descriptors, to check that racing threads leak nothing */
+static int count_fds(void)
+{
+	DIR *d = opendir("/proc/self/fd");
+	int n = 0;
+
+	if (!d)
+		return -1;
+	while (readdir(d))
+		n++;
+	closedir(d);
+	return n;
+}
+
+/* All threads open the same file at the same time: one must win */
+static int shared_fd;
+static int got_fd[MAX_THREADS];
+
+static void *open_thread(void *arg)
+{
+	long i = (long)arg;
+	int r;
+
+	for (r = 0; r < ROUNDS; r++) {
+		pthread_barrier_wait(&barrier);
+		got_fd[i] = __fdelay_open_once(&shared_fd, O_RDONLY, "%s",
+					       "/dev/null");
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+static int check_open_once(void)
+{
+	pthread_t th[MAX_THREADS];
+	int i, r, fds, err = 0;
+	double t0;
+
+	fds = count_fds();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(th + i, NULL, open_thread, (void *)(long)i);
+	t0 = now();
+	for (r = 0; r < ROUNDS; r++) {
+		shared_fd = -1;
+		pthread_barrier_wait(&barrier); /* go */
+		pthread_barrier_wait(&barrier); /* done */
+		for (i = 0; i < nthreads; i++)
+			if (got_fd[i] < 0 || got_fd[i] != shared_fd)
+				err++;
+		close(shared_fd);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(th[i], NULL);
+	printf("   %-24s %6.2f us/round, %i threads\n", "__fdelay_open_once",
+	       (now() - t0) * 1e6 / ROUNDS, nthreads);
+	if (count_fds() != fds) {
+		printf("   open: %i descriptors leaked\n", count_fds() - fds);
+		err++;
+	}
+	if (err)
+		printf("   open: %i errors\n", err);
+	return err;
+}
+
+/* Batch conversions from all threads: the SIMD check is done once */
+static void *batch_thread(void *arg)
+{
+	static __thread struct fd_time t[N], t2[N];
+	static __thread uint64_t pico[N];
+	long err = 0;
+	int i;
+
+	for (i = 0; i < N; i++) {
+		t[i].utc = 1000 + i;
+		t[i].coarse = (i * 7919) % FD_TIME_COARSE_N;
+		t[i].frac = i % FD_TIME_FRAC_N;
+	}
+	pthread_barrier_wait(&barrier);
+	while (!stop) {
+		fdelay_time_to_pico_n(t, pico, N);
+		fdelay_pico_to_time_n(pico, t2, N);
+		/* Back and forth, a value may lose one frac unit (1.95ps) */
+		for (i = 0; i < N; i += 997)
+			if (pico[i] != fd_time_to_ps(t + i)
+			    || pico[i] - fd_time_to_ps(t2 + i) > 2)
+				err++;
+		__sync_fetch_and_add((long *)arg, 1);
+	}
+	return (void *)err;
+}
+
+static int check_batch(void)
+{
+	pthread_t th[MAX_THREADS];
+	long loops = 0, err = 0;
+	void *ret;
+	double t0;
+	int i;
+
+	stop = 0;
+	pthread_barrier_destroy(&barrier);
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(th + i, NULL, batch_thread, &loops);
+	pthread_barrier_wait(&barrier);
+	t0 = now();
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(th[i], &ret);
+		err += (long)ret;
+	}
+	printf("   %-24s %6.1f M/s, %i threads\n", "batch conversions",
+	       loops * 2.0 * N / (now() - t0) / 1e6, nthreads);
+	if (err)
+		printf("   batch: %li mismatches\n", err);
+	return err;
+}
+
+/*
+ * With boards: every thread uses a different part of the same board
+ * (input, time, trigger file), and all of them open files lazily
+ */
+struct board_load {
+	struct fdelay_board *b;
+	int role;
+	long ops, stamps, err;
+};
+
+static void *board_thread(void *arg)
+{
+	struct board_load *l = arg;
+	struct fd_time t[64];
+	int n;
+
+	pthread_barrier_wait(&barrier);
+	while (!stop) {
+		switch (l->role % 3) {
+		case 0:
+			n = fdelay_read(l->b, t, 64, O_NONBLOCK);
+			if (n > 0)
+				l->stamps += n;
+			else if (errno != EAGAIN)
+				l->err++;
+			break;
+		case 1:
+			if (fdelay_get_time_fast(l->b, t, NULL) < 0
+			    && fdelay_get_time(l->b, t) < 0)
+				l->err++;
+			break;
+		case 2: /* simulated boards have no triggers file */
+			if (fdelay_fileno_tdc(l->b) < 0
+			    || (fdelay_fileno_triggers(l->b) < 0
+				&& errno != ENOENT))
+				l->err++;
+			break;
+		}
+		l->ops++;
+	}
+	return NULL;
+}
+
+static int check_boards(int nboards)
+{
+	static char *roles[] = {"fdelay_read", "fdelay_get_time", "fileno"};
+	static struct board_load l[MAX_THREADS];
+	pthread_t th[MAX_THREADS];
+	int i, fds, err = 0;
+	double t0;
+
+	fds = count_fds();
+	stop = 0;
+	pthread_barrier_destroy(&barrier);
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		memset(l + i, 0, sizeof(l[i]));
+		l[i].b = fdelay_open(i % nboards, -1);
+		l[i].role = i / nboards;
+		pthread_create(th + i, NULL, board_thread, l + i);
+	}
+	pthread_barrier_wait(&barrier);
+	t0 = now();
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(th[i], NULL);
+		printf("   board %i %-16s %8.0f calls/s, %li stamps\n",
+		       i % nboards, roles[l[i].role % 3],
+		       l[i].ops / (now() - t0), l[i].stamps);
+		err += l[i].err;
+	}
+	if (err)
+		printf("   boards: %i errors\n", err);
+	for (i = 0; i < nboards; i++)
+		fdelay_close(fdelay_open(i, -1));
+	if (count_fds() != fds) {
+		printf("   boards: %i descriptors leaked\n",
+		       count_fds() - fds);
+		err++;
+	}
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int nboards, err = 0;
+
+	if (argc > 1)
+		nthreads = atoi(argv[1]);
+	if (argc > 2)
+		seconds = atoi(argv[2]);
+	if (nthreads < 1 || nthreads > MAX_THREADS || seconds < 1) {
+		fprintf(stderr, "%s: Use \"%s [<threads> [<seconds>]]\"\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+	printf("%s: %i threads, %i seconds per test\n", argv[0], nthreads,
+	       seconds);
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	err += check_open_once();
+	err += check_batch();
+
+	nboards = fdelay_init();
+	if (nboards > 0)
+		err += check_boards(nboards);
+	else
+		printf("   no boards: board tests skipped\n");
+	if (nboards >= 0)
+		fdelay_exit();
+
+	printf("%s: %s\n", argv[0], err ? "FAILED" : "ok");
+	return err ? 1 : 0;
+}
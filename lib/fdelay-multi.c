@@ -0,0 +1,213 @@
+/*
+ * Multi-board operations: stage everything, then commit in parallel
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+/*
+ * Each board is committed by its own thread with a single write, which
+ * was prepared (file opened, data formatted) before the threads started.
+ * All threads are released together, so the commit window is about the
+ * thread wake-up jitter, whatever the number of boards.
+ */
+struct __fdelay_go {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int go; /* 1: commit, -1: abort */
+};
+
+struct __fdelay_stage {
+	struct __fdelay_board *b;
+	struct __fdelay_go *go;
+	pthread_t thread;
+	int fd, own_fd;
+	const void *data;
+	int len;
+	int err;
+	char text[16];
+	struct fd_out_batch batch;
+};
+
+static void *__fdelay_commit_thread(void *arg)
+{
+	struct __fdelay_stage *s = arg;
+	int ret, go;
+
+	pthread_mutex_lock(&s->go->lock);
+	while (!s->go->go)
+		pthread_cond_wait(&s->go->cond, &s->go->lock);
+	go = s->go->go;
+	pthread_mutex_unlock(&s->go->lock);
+	if (go < 0)
+		return NULL;
+
+	ret = pwrite(s->fd, s->data, s->len, 0);
+	if (ret < 0)
+		s->err = errno;
+	else if (ret != s->len)
+		s->err = EIO;
+	return NULL;
+}
+
+/* Run the commit threads, then close and report the first error */
+static int __fdelay_commit(struct __fdelay_stage *s, int n)
+{
+	struct __fdelay_go go = {
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+	};
+	int i, started, err = 0;
+
+	for (started = 0; started < n; started++) {
+		s[started].go = &go;
+		if (pthread_create(&s[started].thread, NULL,
+				   __fdelay_commit_thread, s + started))
+			break;
+	}
+	/* If we can't start them all, nobody writes */
+	if (started < n)
+		err = EAGAIN;
+	pthread_mutex_lock(&go.lock);
+	go.go = err ? -1 : 1;
+	pthread_cond_broadcast(&go.cond);
+	pthread_mutex_unlock(&go.lock);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(s[i].thread, NULL);
+		if (!err)
+			err = s[i].err;
+	}
+	for (i = 0; i < n; i++)
+		if (s[i].own_fd)
+			close(s[i].fd);
+	free(s);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* Configure outputs of several boards: all are armed at the same time */
+int fdelay_config_pulses_multi(struct fdelay_multi_pulses *mp, int n)
+{
+	struct __fdelay_stage *s;
+	int i;
+
+	s = calloc(n, sizeof(*s));
+	if (!s)
+		return -1;
+	for (i = 0; i < n; i++) {
+		s[i].b = (void *)mp[i].b;
+		if (__fdelay_stage_batch(s[i].b, mp[i].mask, 0, mp[i].pulses,
+					 &s[i].batch) < 0)
+			goto out;
+		s[i].fd = s[i].b->fdo;
+		s[i].data = &s[i].batch;
+		s[i].len = sizeof(s[i].batch);
+	}
+	return __fdelay_commit(s, n);
+out:
+	free(s);
+	return -1;
+}
+
+/*
+ * Set time on several boards. If t is NULL, each board copies host time
+ * when its command is written, otherwise they all get the same value.
+ */
+int fdelay_set_time_multi(struct fdelay_board **boards, int n,
+			  struct fd_time *t)
+{
+	struct __fdelay_stage *s;
+	uint32_t v;
+	char fname[128];
+	int i, j;
+
+	s = calloc(n, sizeof(*s));
+	if (!s)
+		return -1;
+	for (i = 0; i < n; i++) {
+		s[i].b = (void *)boards[i];
+		if (t) {
+			/* Writing utc-h sets time, so pre-load the others */
+			v = t->coarse;
+			if (fdelay_sysfs_set(s[i].b, "coarse", &v) < 0)
+				goto out;
+			v = t->utc;
+			if (fdelay_sysfs_set(s[i].b, "utc-l", &v) < 0)
+				goto out;
+			sprintf(fname, "%s/utc-h", s[i].b->sysbase);
+			s[i].len = sprintf(s[i].text, "%i\n",
+					   (uint32_t)(t->utc >> 32));
+		} else {
+			sprintf(fname, "%s/command", s[i].b->sysbase);
+			s[i].len = sprintf(s[i].text, "%i\n", FD_CMD_HOST_TIME);
+		}
+		s[i].fd = open(fname, O_WRONLY);
+		if (s[i].fd < 0)
+			goto out;
+		s[i].own_fd = 1;
+		s[i].data = s[i].text;
+	}
+	return __fdelay_commit(s, n);
+out:
+	for (j = 0; j < i; j++)
+		close(s[j].fd);
+	free(s);
+	return -1;
+}
+
+/*
+ * Verify the boards agree: convert the same board time to host time
+ * through the time page of each board, and return the spread. Right
+ * after setting time the pages are being refreshed: wait a little.
+ */
+int fdelay_check_skew(struct fdelay_board **boards, int n,
+		      int64_t *skew_ns, uint32_t *err_ns)
+{
+	struct fd_time t, tmp;
+	int64_t h, hmin = 0, hmax = 0;
+	uint32_t e, emax = 0;
+	int i, retries = 100;
+
+	for (i = 0; i < n; ) {
+		if (i == 0 && fdelay_get_time_fast(boards[0], &t, &e) < 0)
+			goto again;
+		if (fdelay_time_to_host(boards[i], CLOCK_MONOTONIC, &t, &h, 1) < 0)
+			goto again;
+		if (i && fdelay_get_time_fast(boards[i], &tmp, &e) < 0)
+			goto again;
+		if (i == 0 || h < hmin)
+			hmin = h;
+		if (i == 0 || h > hmax)
+			hmax = h;
+		if (e > emax)
+			emax = e;
+		i++;
+		continue;
+	again:
+		if (errno != EAGAIN || !retries--)
+			return -1;
+		usleep(10 * 1000);
+	}
+	*skew_ns = hmax - hmin;
+	if (err_ns)
+		*err_ns = emax;
+	return 0;
+}
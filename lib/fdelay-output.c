@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -24,59 +25,33 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
-void fdelay_pico_to_time(uint64_t *pico, struct fdelay_time *time)
+void fdelay_pico_to_time(uint64_t *pico, struct fd_time *time)
 {
-	uint64_t p = *pico;
-
-	time->utc = p / (1000ULL * 1000ULL * 1000ULL * 1000ULL);
-	p %= (1000ULL * 1000ULL * 1000ULL * 1000ULL);
-	time->coarse = p / 8000;
-	p %= 8000;
-	time->frac = p * 4096 / 8000;
+	fd_time_from_ps(time, *pico);
 }
 
-void fdelay_time_to_pico(struct fdelay_time *time, uint64_t *pico)
+void fdelay_time_to_pico(struct fd_time *time, uint64_t *pico)
 {
-	uint64_t p;
-
-	p = time->frac * 8000 / 4096;
-	p += time->coarse * 8000;
-	p += time->utc * (1000ULL * 1000ULL * 1000ULL * 1000ULL);
-	*pico = p;
+	*pico = fd_time_to_ps(time);
 }
 
 static  int __fdelay_get_ch_fd(struct __fdelay_board *b,
 			       int channel, int *fdc)
 {
 	int ch14 = channel + 1;
-	char fname[128];
 
 	if (channel < 0 || channel > 3) {
 		errno = EINVAL;
 		return -1;
 	}
-	if (b->fdc[ch14] <= 0) {
-		sprintf(fname, "%s-%i-0-ctrl", b->devbase, ch14);
-		b->fdc[ch14] = open(fname, O_WRONLY | O_NONBLOCK);
-		if (b->fdc[ch14] < 0)
-			return -1;
-	}
-	*fdc = b->fdc[ch14];
-	return 0;
+	*fdc = __fdelay_open_once(&b->fdc[ch14], O_WRONLY | O_NONBLOCK,
+				  "%s-%i-0-ctrl", b->devbase, ch14);
+	return *fdc < 0 ? -1 : 0;
 }
 
-int fdelay_config_pulse(struct fdelay_board *userb,
-			       int channel, struct fdelay_pulse *pulse)
+/* Fill the output attributes, indexed like ext_val in the control */
+static void __fdelay_pulse_to_attrs(struct fdelay_pulse *pulse, uint32_t *a)
 {
-	__define_board(b, userb);
-	struct zio_control ctrl = {0,};
-	uint32_t *a;
-	int fdc;
-
-	if (__fdelay_get_ch_fd(b, channel, &fdc) < 0)
-		return -1; /* errno already set */
-
-	a = ctrl.attr_channel.ext_val;
 	a[FD_ATTR_OUT_MODE] = pulse->mode;
 	a[FD_ATTR_OUT_REP] = pulse->rep;
 
@@ -93,6 +68,19 @@ int fdelay_config_pulse(struct fdelay_board *userb,
 	a[FD_ATTR_OUT_DELTA_L] = pulse->loop.utc; /* only 0..f */
 	a[FD_ATTR_OUT_DELTA_COARSE] = pulse->loop.coarse; /* only 0..f */
 	a[FD_ATTR_OUT_DELTA_FINE] = pulse->loop.frac; /* only 0..f */
+}
+
+int fdelay_config_pulse(struct fdelay_board *userb,
+			       int channel, struct fdelay_pulse *pulse)
+{
+	__define_board(b, userb);
+	struct zio_control ctrl = {0,};
+	int fdc;
+
+	if (__fdelay_get_ch_fd(b, channel, &fdc) < 0)
+		return -1; /* errno already set */
+
+	__fdelay_pulse_to_attrs(pulse, ctrl.attr_channel.ext_val);
 
 	/* we need to fill the nsample field of the control */
 	ctrl.attr_trigger.std_val[1] = 1;
@@ -104,24 +92,83 @@ int fdelay_config_pulse(struct fdelay_board *userb,
 	return 0;
 }
 
-static void fdelay_add_ps(struct fdelay_time *p, uint64_t ps)
+/* Prepare a batch for the "outputs" file, opening it if needed */
+int __fdelay_stage_batch(struct __fdelay_board *b, unsigned mask,
+			 uint32_t flags, struct fdelay_pulse *pulses,
+			 struct fd_out_batch *batch)
 {
-	uint32_t coarse, frac;
+	int ch;
+
+	if (!mask || mask & ~((1 << FD_OUT_BATCH_CH) - 1)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__fdelay_open_once(&b->fdo, O_WRONLY, "%s/outputs",
+			       b->sysbase) < 0)
+		return -1;
+	memset(batch, 0, sizeof(*batch));
+	batch->mask = mask;
+	batch->flags = flags;
+	for (ch = 0; ch < FD_OUT_BATCH_CH; ch++)
+		if (mask & (1 << ch))
+			__fdelay_pulse_to_attrs(pulses + ch, batch->attrs[ch]);
+	return 0;
+}
 
-	/* FIXME: this silently fails with ps > 10^12 = 1s */
-	coarse = ps / 8000;
-	frac = ((ps % 8000) << 12) / 8000;
+/* Write it: one system call for all channels */
+int __fdelay_commit_batch(struct __fdelay_board *b, struct fd_out_batch *batch)
+{
+	int ret;
 
-	p->frac += frac;
-	if (p->frac >= 4096) {
-		p->frac -= 4096;
-		coarse++;
+	ret = pwrite(b->fdo, batch, sizeof(*batch), 0);
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(*batch)) {
+		errno = EIO;
+		return -1;
 	}
-	p->coarse += coarse;
-	if (p->coarse > 125*1000*1000) {
-		p->coarse -= 125*1000*1000;
-		p->utc++;
+	return 0;
+}
+
+static int __fdelay_write_batch(struct __fdelay_board *b, unsigned mask,
+				uint32_t flags, struct fdelay_pulse *pulses)
+{
+	struct fd_out_batch batch;
+
+	if (__fdelay_stage_batch(b, mask, flags, pulses, &batch) < 0)
+		return -1;
+	return __fdelay_commit_batch(b, &batch);
+}
+
+/*
+ * Configure several outputs at once: pulses[] is indexed by channel, and
+ * only the channels in mask are used. The driver programs them all and
+ * then arms them back-to-back, so they start within a short window.
+ */
+int fdelay_config_pulses(struct fdelay_board *userb,
+			 unsigned mask, struct fdelay_pulse *pulses)
+{
+	__define_board(b, userb);
+
+	return __fdelay_write_batch(b, mask, 0, pulses);
+}
+
+/*
+ * Append a pulse program to the queue of the channel: the driver arms
+ * it as soon as the previous one has triggered. EAGAIN means "full".
+ */
+int fdelay_queue_pulse(struct fdelay_board *userb,
+		       int channel, struct fdelay_pulse *pulse)
+{
+	__define_board(b, userb);
+	struct fdelay_pulse p[FD_OUT_BATCH_CH];
+
+	if (channel < 0 || channel >= FD_OUT_BATCH_CH) {
+		errno = EINVAL;
+		return -1;
 	}
+	p[channel] = *pulse;
+	return __fdelay_write_batch(b, 1 << channel, FD_OUT_BATCH_QUEUE, p);
 }
 
 /* The "pulse_ps" function relies on the previous one */
@@ -129,12 +176,14 @@ int fdelay_config_pulse_ps(struct fdelay_board *userb,
 			   int channel, struct fdelay_pulse_ps *ps)
 {
 	struct fdelay_pulse p;
+	struct fd_time d;
 
 	p.mode = ps->mode;
 	p.rep = ps->rep;
 	p.start = ps->start;
 	p.end = ps->start;
-	fdelay_add_ps(&p.end, ps->length);
+	fd_time_from_ps(&d, ps->length);
+	fd_time_add(&p.end, &d);
 	fdelay_pico_to_time(&ps->period, &p.loop);
 	return fdelay_config_pulse(userb, channel, &p);
 }
@@ -151,4 +200,73 @@ int fdelay_has_triggered(struct fdelay_board *userb, int channel)
 	return (mode & 0x80) != 0;
 }
 
+/*
+ * The "triggers" file reports the last trigger of each output, and can
+ * be polled (POLLPRI) to be woken when a pulse program fires. Several
+ * boards can be waited for in a single poll() call.
+ */
+int fdelay_fileno_triggers(struct fdelay_board *userb)
+{
+	__define_board(b, userb);
+
+	return __fdelay_open_once(&b->fdt, O_RDONLY, "%s/triggers",
+				  b->sysbase);
+}
+
+/* Read all four channels: seq_id counts the triggers of each channel */
+int fdelay_read_triggers(struct fdelay_board *userb, struct fd_time *t)
+{
+	int i, fd, len = FD_OUT_BATCH_CH * sizeof(*t);
+
+	fd = fdelay_fileno_triggers(userb);
+	if (fd < 0)
+		return -1;
+	/* Reading from offset 0 re-arms the poll notification */
+	i = pread(fd, t, len, 0);
+	if (i < 0)
+		return -1;
+	if (i != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Reactive rules: the table is always transferred as a whole */
+static int __fdelay_rules_io(struct __fdelay_board *b, struct fd_rule *r,
+			     int write)
+{
+	char fname[128];
+	int fd, ret, len = FD_RULES_N * sizeof(*r);
 
+	sprintf(fname, "%s/rules", b->sysbase);
+	fd = open(fname, write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (write)
+		ret = pwrite(fd, r, len, 0);
+	else
+		ret = pread(fd, r, len, 0);
+	close(fd);
+	if (ret < 0)
+		return -1;
+	if (ret != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int fdelay_set_rules(struct fdelay_board *userb, struct fd_rule *rules)
+{
+	__define_board(b, userb);
+
+	return __fdelay_rules_io(b, rules, 1);
+}
+
+int fdelay_get_rules(struct fdelay_board *userb, struct fd_rule *rules)
+{
+	__define_board(b, userb);
+
+	return __fdelay_rules_io(b, rules, 0);
+}
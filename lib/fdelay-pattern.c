@@ -0,0 +1,159 @@
+/*
+ * Pulse patterns: compile a list of pulses into hardware trains
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+#define TRAIN_MAX_REP	65536 /* FD_RCR_REP_CNT is 16 bits, plus one */
+#define TRAIN_MAX_DELTA	(16 * FD_TIME_PS_PER_SEC) /* U_DELTA is 4 bits */
+
+/* Can pulse "s, w" extend the train? "prev" is the previous pulse start */
+static int __fdelay_train_extends(struct fdelay_train *t, uint64_t prev,
+				  uint64_t s, uint64_t w)
+{
+	uint64_t d = s - prev;
+
+	if (w != t->width_ps || t->rep >= TRAIN_MAX_REP)
+		return 0;
+	if (t->rep > 1)
+		return d == t->period_ps;
+	return d > w && d < TRAIN_MAX_DELTA;
+}
+
+/*
+ * Compile a pattern (pulses relative to its origin, sorted and not
+ * overlapping), repeated "repeat" times every "period_ps", into the
+ * smallest list of trains we can find by folding runs of equal width
+ * and equal spacing. A pulse that can't be folded starts a new train,
+ * so it must follow the previous pulse by FDELAY_TRAIN_GAP_PS at least.
+ * Returns the number of trains, or -1 with errno.
+ */
+int fdelay_pattern_compile(struct fdelay_pattern_item *items, int n,
+			   int repeat, uint64_t period_ps,
+			   struct fdelay_train *trains, int max)
+{
+	struct fdelay_train *t = NULL;
+	uint64_t s, w, prev = 0, end = 0;
+	int i, k, ntrains = 0;
+
+	if (n <= 0 || repeat <= 0 || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (repeat > 1 && items[n - 1].start_ps + items[n - 1].width_ps
+	    > period_ps) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (k = 0; k < repeat; k++) {
+		for (i = 0; i < n; i++) {
+			s = k * period_ps + items[i].start_ps;
+			w = items[i].width_ps;
+			if (!w || (t && s < end)) {
+				errno = EINVAL; /* empty, unsorted or overlapping */
+				return -1;
+			}
+			if (t && __fdelay_train_extends(t, prev, s, w)) {
+				if (t->rep == 1)
+					t->period_ps = s - prev;
+				t->rep++;
+				prev = s;
+				end = s + w;
+				continue;
+			}
+			if (t && s - end < FDELAY_TRAIN_GAP_PS) {
+				errno = EINVAL; /* too late to load it */
+				return -1;
+			}
+			if (ntrains == max) {
+				errno = ENOSPC;
+				return -1;
+			}
+			t = trains + ntrains++;
+			t->start_ps = s;
+			t->width_ps = w;
+			t->period_ps = 2 * w; /* irrelevant, but must be > w */
+			t->rep = 1;
+			prev = s;
+			end = s + w;
+		}
+	}
+	return ntrains;
+}
+
+/*
+ * Queue the trains, from the first one, as long as the driver accepts
+ * them. The driver loads each train after the last pulse of the previous
+ * one, so folded trains run whole. Returns the number of trains queued
+ * (possibly less than n if the queue is full) or -1 on error.
+ */
+int fdelay_pattern_load(struct fdelay_board *b, int channel,
+			struct fd_time *origin,
+			struct fdelay_train *trains, int n)
+{
+	struct fdelay_pulse p;
+	struct fd_time d;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		p.mode = FD_OUT_MODE_PULSE;
+		p.rep = trains[i].rep;
+		p.start = *origin;
+		fd_time_from_ps(&d, trains[i].start_ps);
+		fd_time_add(&p.start, &d);
+		p.end = p.start;
+		fd_time_from_ps(&d, trains[i].width_ps);
+		fd_time_add(&p.end, &d);
+		fd_time_from_ps(&p.loop, trains[i].period_ps);
+		if (fdelay_queue_pulse(b, channel, &p) < 0) {
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+	}
+	return i;
+}
+
+/* Queue all the trains, sleeping on the "triggers" file when full */
+int fdelay_pattern_run(struct fdelay_board *b, int channel,
+		       struct fd_time *origin,
+		       struct fdelay_train *trains, int n)
+{
+	struct fd_time trig[4];
+	struct pollfd pfd;
+	int done = 0, i;
+
+	while (done < n) {
+		/* Read first, so a trigger after loading wakes us up */
+		if (fdelay_read_triggers(b, trig) < 0)
+			return -1;
+		i = fdelay_pattern_load(b, channel, origin, trains + done,
+					n - done);
+		if (i < 0)
+			return -1;
+		done += i;
+		if (done == n)
+			break;
+		pfd.fd = fdelay_fileno_triggers(b);
+		pfd.events = POLLPRI | POLLERR;
+		if (poll(&pfd, 1, -1) < 0)
+			return -1;
+	}
+	return 0;
+}
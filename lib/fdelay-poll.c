@@ -0,0 +1,188 @@
+/*
+ * Wait for input on many boards at once, using epoll
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "fdelay-lib.h"
+
+/*
+ * Boards are registered edge-triggered, so the kernel reports each
+ * board once when data arrives, and a wakeup only lists the boards
+ * that have data. A callback that returns with data still pending
+ * (it had a budget) keeps its board on our ready list and is called
+ * again at the next round, without waiting: boards are served in
+ * turn, and no edge is lost.
+ */
+struct __fdelay_poll_entry {
+	struct fdelay_board *b;
+	fdelay_poll_cb cb;
+	void *arg;
+	int fd;
+	int ready;
+	struct __fdelay_poll_entry *next;	/* all entries */
+	struct __fdelay_poll_entry *rnext;	/* ready list */
+};
+
+struct fdelay_poll {
+	int epfd;
+	struct __fdelay_poll_entry *list;
+	struct __fdelay_poll_entry *rhead, **rtail;
+};
+
+#define FDELAY_POLL_EVENTS	64	/* per epoll_wait; more come later */
+
+static void __fdelay_poll_ready(struct fdelay_poll *p,
+				struct __fdelay_poll_entry *e)
+{
+	if (e->ready)
+		return;
+	e->ready = 1;
+	e->rnext = NULL;
+	*p->rtail = e;
+	p->rtail = &e->rnext;
+}
+
+struct fdelay_poll *fdelay_poll_create(void)
+{
+	struct fdelay_poll *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (p->epfd < 0) {
+		free(p);
+		return NULL;
+	}
+	p->rtail = &p->rhead;
+	return p;
+}
+
+void fdelay_poll_destroy(struct fdelay_poll *p)
+{
+	struct __fdelay_poll_entry *e;
+
+	if (!p)
+		return;
+	while ((e = p->list)) {
+		p->list = e->next;
+		free(e);
+	}
+	close(p->epfd);
+	free(p);
+}
+
+/* The epoll file, to be nested in another event loop */
+int fdelay_poll_fileno(struct fdelay_poll *p)
+{
+	return p->epfd;
+}
+
+int fdelay_poll_add(struct fdelay_poll *p, struct fdelay_board *b,
+		    fdelay_poll_cb cb, void *arg)
+{
+	struct __fdelay_poll_entry *e;
+	struct epoll_event ev;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -1;
+	e->b = b;
+	e->cb = cb;
+	e->arg = arg;
+	e->fd = fdelay_fileno_tdc(b);
+	if (e->fd < 0) {
+		free(e);
+		return -1;
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = e;
+	if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0) {
+		free(e);
+		return -1;
+	}
+	e->next = p->list;
+	p->list = e;
+	/* Data may be there already, and there would be no edge for it */
+	__fdelay_poll_ready(p, e);
+	return 0;
+}
+
+int fdelay_poll_del(struct fdelay_poll *p, struct fdelay_board *b)
+{
+	struct __fdelay_poll_entry *e, **ep, **rp;
+
+	for (ep = &p->list; (e = *ep); ep = &e->next)
+		if (e->b == b)
+			break;
+	if (!e) {
+		errno = ENOENT;
+		return -1;
+	}
+	epoll_ctl(p->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+	*ep = e->next;
+	if (e->ready) {
+		for (rp = &p->rhead; *rp != e; rp = &(*rp)->rnext)
+			;
+		*rp = e->rnext;
+		if (p->rtail == &e->rnext)
+			p->rtail = rp;
+	}
+	free(e);
+	return 0;
+}
+
+/*
+ * Wait up to timeout_ms (-1: forever) and call the callback of every
+ * board with data, once. Returns the number of callbacks, 0 on
+ * timeout, -1 on error (a failing callback stops the round).
+ */
+int fdelay_poll_wait(struct fdelay_poll *p, int timeout_ms)
+{
+	struct epoll_event ev[FDELAY_POLL_EVENTS];
+	struct __fdelay_poll_entry *e, *round;
+	int i, n, ret, done = 0;
+
+	n = epoll_wait(p->epfd, ev, FDELAY_POLL_EVENTS,
+		       p->rhead ? 0 : timeout_ms);
+	if (n < 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		__fdelay_poll_ready(p, ev[i].data.ptr);
+
+	/* Serve those ready now; those still ready go to the next round */
+	round = p->rhead;
+	p->rhead = NULL;
+	p->rtail = &p->rhead;
+	while ((e = round)) {
+		round = e->rnext;
+		e->ready = 0;
+		ret = e->cb(e->b, e->arg);
+		if (ret > 0)
+			__fdelay_poll_ready(p, e);
+		if (ret < 0) {
+			__fdelay_poll_ready(p, e);
+			while ((e = round)) {
+				round = e->rnext;
+				e->ready = 0;
+				__fdelay_poll_ready(p, e);
+			}
+			return -1;
+		}
+		done++;
+	}
+	return done;
+}
@@ -0,0 +1,78 @@
+/* Simple demo that publishes the input stamps of a board to shared memory */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include "fdelay-lib.h"
+
+static volatile int stop;
+
+static void sighandler(int sig)
+{
+	stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct fdelay_board *b;
+	struct fdelay_shm *s;
+	struct sigaction sa;
+	char *name;
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "%s: Use \"%s <shm-name>\" (e.g. /fdelay-0)\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+	name = argv[1];
+
+	i = fdelay_init();
+	if (i < 0) {
+		fprintf(stderr, "%s: fdelay_init(): %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+	if (i == 0) {
+		fprintf(stderr, "%s: no boards found\n", argv[0]);
+		exit(1);
+	}
+	if (i != 1) {
+		fprintf(stderr, "%s: found %i boards, using first one\n",
+			argv[0], i);
+	}
+
+	b = fdelay_open(0, -1);
+	if (!b) {
+		fprintf(stderr, "%s: fdelay_open(): %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+
+	s = fdelay_shm_create(name, 64 * 1024);
+	if (!s) {
+		fprintf(stderr, "%s: fdelay_shm_create(%s): %s\n", argv[0],
+			name, strerror(errno));
+		exit(1);
+	}
+
+	/* No SA_RESTART: a signal interrupts the blocking read */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop) {
+		if (fdelay_shm_pump(s, b, 0) < 0 && errno != EINTR) {
+			fprintf(stderr, "%s: fdelay_shm_pump(): %s\n",
+				argv[0], strerror(errno));
+			break;
+		}
+	}
+
+	fdelay_shm_destroy(s);
+	fdelay_close(b);
+	fdelay_exit();
+	return 0;
+}
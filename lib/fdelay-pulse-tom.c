@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <poll.h>
 
 #include "fdelay-lib.h"
 
@@ -40,23 +41,7 @@ static void help(int argc, char *argv[])
 
 }
 
-static struct fdelay_time ts_add(struct fdelay_time a, struct fdelay_time b)
-{
-	a.frac += b.frac;
-	if (a.frac >= 4096) {
-		a.frac -= 4096;
-		a.coarse++;
-	}
-	a.coarse += b.coarse;
-	if (a.coarse >= 125000000) {
-		a.coarse -= 125000000;
-		a.utc++;
-	}
-	a.utc += b.utc;
-	return a;
-}
-
-static void parse_time(char *s, struct fdelay_time *t)
+static void parse_time(char *s, struct fd_time *t)
 {
 	int64_t time_ps = 0;
 	int64_t extra_seconds = 0;
@@ -135,7 +120,7 @@ static void parse_time(char *s, struct fdelay_time *t)
 //    printf("dbg: raw %lld, %lld, converted: %lld s %d ns %d ps\n", extra_seconds,time_ps, t->utc, t->coarse * 8, t->frac * 8000 / 4096);
 }
 
-void dump_ts(char *title, struct fdelay_time t)
+void dump_ts(char *title, struct fd_time t)
 {
 	printf("%s: secs %lld coarse %d frac %d\n", title, t.utc, t.coarse,
 	       t.frac);
@@ -143,7 +128,7 @@ void dump_ts(char *title, struct fdelay_time t)
 
 int main(int argc, char **argv)
 {
-	struct fdelay_time t_start, t_delta, t_width;
+	struct fd_time t_start, t_delta, t_width;
 	int mode = -1;
 	int channel = -1;
 	int count = 1;
@@ -222,6 +207,9 @@ int main(int argc, char **argv)
 
 	struct fdelay_board *b;
 	struct fdelay_pulse p;
+	struct fd_time trig[4];
+	struct pollfd pfd;
+	uint32_t seq;
 	/* init before going on parsing */
 	int i = fdelay_init();
 	if (i < 0) {
@@ -250,13 +238,15 @@ int main(int argc, char **argv)
 	}
 
 	if (mode == FD_OUT_MODE_PULSE && relative) {
-		fdelay_get_time(b, &p.start);
-		p.start = ts_add(p.start, t_start);
+		if (fdelay_get_time_fast(b, &p.start, NULL) < 0)
+			fdelay_get_time(b, &p.start);
+		fd_time_add(&p.start, &t_start);
 	} else {
 		p.start = t_start;
 	}
 
-	p.end = ts_add(p.start, t_width);
+	p.end = p.start;
+	fd_time_add(&p.end, &t_width);
 	p.loop = t_delta;
 	p.rep = count;
 	p.mode = mode;
@@ -267,12 +257,14 @@ int main(int argc, char **argv)
 		uint64_t delta = do_pps ? 1000000000000ULL : 100000ULL;
 		fdelay_pico_to_time(&width, &t_width);
 
-		fdelay_get_time(b, &p.start);
+		if (fdelay_get_time_fast(b, &p.start, NULL) < 0)
+			fdelay_get_time(b, &p.start);
 		p.start.utc += 2;
 		p.start.coarse = 0;
 		p.start.frac = 0;
 
-		p.end = ts_add(p.start, t_width);
+		p.end = p.start;
+		fd_time_add(&p.end, &t_width);
 
 		fdelay_pico_to_time(&delta, &p.loop);
 
@@ -280,6 +272,11 @@ int main(int argc, char **argv)
 		p.mode = FD_OUT_MODE_PULSE;
 	}
 
+	/* In pulse mode we can sleep on the "triggers" file */
+	if (wait_trigger && p.mode == FD_OUT_MODE_PULSE
+	    && fdelay_read_triggers(b, trig) == 0)
+		wait_trigger = 2;
+
 	/* And finally work */
 	if (fdelay_config_pulse(b, channel - 1, &p) < 0) {
 		fprintf(stderr, "%s: fdelay_config_pulse(): %s\n",
@@ -287,6 +284,20 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	while (wait_trigger == 2) {
+		seq = trig[channel - 1].seq_id;
+		pfd.fd = fdelay_fileno_triggers(b);
+		pfd.events = POLLPRI | POLLERR;
+		if (poll(&pfd, 1, -1) < 0
+		    || fdelay_read_triggers(b, trig) < 0) {
+			fprintf(stderr, "%s: waiting for trigger: %s\n",
+				argv[0], strerror(errno));
+			exit(1);
+		}
+		if (trig[channel - 1].seq_id != seq)
+			wait_trigger = 0;
+	}
+
 	while (wait_trigger) {
 		usleep(10 * 1000);
 		i = fdelay_has_triggered(b, channel - 1);
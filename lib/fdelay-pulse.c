@@ -19,7 +19,7 @@ static int exiterr(int argc, char **argv)
 	exit(1);
 }
 
-static int parse_time(struct fdelay_board *b, char *s, struct fdelay_time *t)
+static int parse_time(struct fdelay_board *b, char *s, struct fd_time *t)
 {
 	unsigned long u, m = 0, p = 0;
 	char smicro[32];
@@ -151,17 +151,7 @@ int main(int argc, char **argv)
 		exiterr(argc, argv);
 	}
 	/* end is specified as relative but used as absolute */
-	p.end.frac += p.start.frac;
-	if (p.end.frac > 4096) {
-		p.end.frac -= 4096;
-		p.end.coarse++;
-	}
-	p.end.coarse += p.start.coarse;
-	if (p.end.coarse > 125 * 1000 * 1000) {
-		p.end.coarse -= 125 * 1000 * 1000;
-		p.end.utc++;
-	}
-	p.end.utc += p.start.utc;
+	fd_time_add(&p.end, &p.start);
 
 	/* And finally work */
 	if (fdelay_config_pulse(b, channel, &p) < 0) {
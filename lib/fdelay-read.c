@@ -10,7 +10,7 @@ int main(int argc, char **argv)
 {
 	struct fdelay_board *b;
 	int i, j,npulses;
-	struct fdelay_time *t;
+	struct fd_time *t;
 
 	if (argc != 2) {
 		fprintf(stderr, "%s: Use \"%s <nsamples>\n", argv[0], argv[0]);
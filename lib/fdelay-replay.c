@@ -0,0 +1,160 @@
+/*
+ * Boards that replay a log file, as written by NewLogger/fdelay-gs
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+/*
+ * The log is made of 32-byte records: card_id (4 bytes), type (1 byte)
+ * and the stamp, packed; then padding. The card_id of each stamp
+ * becomes one board (its dev_id); all of them start at the time of
+ * the first stamp in the file, so they stay in step with each other.
+ */
+#define LOG_RECORD	32
+#define LOG_CARD	0
+#define LOG_TYPE	4
+#define LOG_STAMP	5
+#define LOG_TIMESTAMP	3	/* TYPE_TIMESTAMP in fdelay-gs.c */
+#define REPLAY_MAX	64	/* boards in a file */
+
+struct __fdelay_replay {
+	unsigned char *map;
+	size_t len;
+	size_t pos;			/* the next record to look at */
+	int32_t card;
+};
+
+static int __fdelay_replay_record(unsigned char *r, int32_t *card,
+				  struct fd_time *t)
+{
+	if (r[LOG_TYPE] != LOG_TIMESTAMP)
+		return -1;
+	memcpy(card, r + LOG_CARD, sizeof(*card));
+	memcpy(t, r + LOG_STAMP, sizeof(*t));
+	return 0;
+}
+
+static int __fdelay_replay_peek(void *src, struct fd_time *t)
+{
+	struct __fdelay_replay *r = src;
+	int32_t card;
+
+	for (; r->pos + LOG_RECORD <= r->len; r->pos += LOG_RECORD)
+		if (!__fdelay_replay_record(r->map + r->pos, &card, t)
+		    && card == r->card)
+			return 0;
+	return -1;
+}
+
+static void __fdelay_replay_pop(void *src)
+{
+	struct __fdelay_replay *r = src;
+
+	r->pos += LOG_RECORD;
+}
+
+static void __fdelay_replay_release(void *src)
+{
+	struct __fdelay_replay *r = src;
+
+	munmap(r->map, r->len);
+	free(r);
+}
+
+static struct __fdelay_virt_source __fdelay_replay_source = {
+	.peek =		__fdelay_replay_peek,
+	.pop =		__fdelay_replay_pop,
+	.release =	__fdelay_replay_release,
+};
+
+/* "file=<name>,speed=<factor>" (0 is as fast as possible), or the name */
+int __fdelay_replay_init(char *args)
+{
+	struct __fdelay_replay *r;
+	struct fd_time t, t0;
+	int32_t card, cards[REPLAY_MAX];
+	char fname[256], name[32];
+	unsigned char *map;
+	struct stat st;
+	double speed;
+	size_t pos;
+	int i, n = 0, fd;
+
+	if (!__fdelay_virt_arg(args, "file", fname, sizeof(fname)))
+		snprintf(fname, sizeof(fname), "%s", args);
+	speed = __fdelay_virt_num(args, "speed", 1);
+	if (speed < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Find the boards and the first stamp */
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < LOG_RECORD) {
+		close(fd);
+		errno = st.st_size < LOG_RECORD ? ENODATA : errno;
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	for (pos = 0; pos + LOG_RECORD <= st.st_size; pos += LOG_RECORD) {
+		if (__fdelay_replay_record(map + pos, &card, &t) < 0)
+			continue;
+		if (!n)
+			t0 = t;
+		for (i = 0; i < n; i++)
+			if (cards[i] == card)
+				break;
+		if (i == n && n < REPLAY_MAX)
+			cards[n++] = card;
+	}
+	munmap(map, st.st_size);
+	if (!n) {
+		close(fd);
+		errno = ENODATA;
+		return -1;
+	}
+
+	/* One board per card, each with its own cursor in the file */
+	for (i = 0; i < n; i++) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			break;
+		r->len = st.st_size;
+		r->card = cards[i];
+		r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, fd, 0);
+		if (r->map == MAP_FAILED) {
+			free(r);
+			break;
+		}
+		sprintf(name, "replay-%i", cards[i]);
+		if (__fdelay_virt_add(name, cards[i], speed, &t0,
+				      &__fdelay_replay_source, r) < 0)
+			break;
+	}
+	close(fd);
+	return i == n ? 0 : -1;
+}
@@ -0,0 +1,119 @@
+/*
+ * Sequence numbers: extended to 64 bits, and accounted for, per channel
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/*
+ * A stamp is either the one expected, or after a gap (the missing
+ * ones are lost, for now), or a bit behind. Up to FDELAY_SEQ_WINDOW
+ * behind, a bitmap tells a duplicate from a late stamp, which closes
+ * a gap; anything more behind than that is taken as a huge gap.
+ *
+ * A gap of more than 64k stamps looks like a short one. The driver
+ * counts what it drops from each channel when its fifo overflows, and
+ * reports the counts with every control: if it dropped more of this
+ * channel than the gap, the gap wrapped.
+ */
+static void __fdelay_seq_one(struct __fdelay_seq *s, struct fd_time *t,
+			     uint32_t dropped)
+{
+	uint64_t gap, back, bit, ext;
+	uint32_t drv;
+
+	if (!s->started) {
+		s->started = 1;
+		s->st.next = t->seq_id & (FD_TIME_SEQ_MOD - 1);
+		s->dropped = dropped;
+	}
+	s->st.received++;
+	gap = fd_time_seq_gap(s->st.next - 1, t->seq_id);
+
+	if (gap >= FD_TIME_SEQ_MOD - FDELAY_SEQ_WINDOW) {
+		back = FD_TIME_SEQ_MOD - gap;
+		ext = s->st.next - back;
+		bit = 1ULL << (back - 1);
+		if (s->seen & bit) {
+			s->st.duplicate++;
+		} else {
+			s->seen |= bit;
+			s->st.late++;
+			if (s->st.lost)
+				s->st.lost--;
+		}
+		t->seq_id = ext;
+		return;
+	}
+
+	drv = dropped - s->dropped;
+	s->dropped = dropped;
+	s->st.driver_dropped += drv;
+	while (gap + FD_TIME_SEQ_MOD <= drv)
+		gap += FD_TIME_SEQ_MOD;
+
+	ext = s->st.next + gap;
+	s->st.lost += gap;
+	s->seen = gap + 1 >= 64 ? 1 : s->seen << (gap + 1) | 1;
+	s->st.next = ext + 1;
+	t->seq_id = ext;
+}
+
+/* Called with in_lock held, in the order stamps come from the driver */
+void __fdelay_seq_extend(struct __fdelay_board *b, struct fd_time *t,
+			 int n, const uint32_t *dropped)
+{
+	int i;
+
+	for (i = 0; i < n; i++, t++)
+		if (t->channel < ARRAY_SIZE(b->seq))
+			__fdelay_seq_one(b->seq + t->channel, t,
+					 dropped ? dropped[t->channel] : 0);
+}
+
+int fdelay_get_seq_stats(struct fdelay_board *userb, int channel,
+			 struct fdelay_seq_stats *st)
+{
+	__define_board(b, userb);
+
+	if (channel < 0 || channel >= ARRAY_SIZE(b->seq)) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&b->in_lock);
+	*st = b->seq[channel].st;
+	pthread_mutex_unlock(&b->in_lock);
+	return 0;
+}
+
+/*
+ * The whole sequence number of a stamp returned by the library, from
+ * the 32 bits in seq_id: it must be less than 2^32 stamps old.
+ */
+uint64_t fdelay_seq64(struct fdelay_board *userb, struct fd_time *t)
+{
+	__define_board(b, userb);
+	uint64_t next;
+
+	if (t->channel >= ARRAY_SIZE(b->seq))
+		return t->seq_id;
+	pthread_mutex_lock(&b->in_lock);
+	next = b->seq[t->channel].st.next;
+	pthread_mutex_unlock(&b->in_lock);
+	return next - (uint32_t)(next - t->seq_id);
+}
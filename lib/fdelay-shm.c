@@ -0,0 +1,367 @@
+/*
+ * Broadcast the input stamps of a board to other processes, in shared memory
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "fdelay-lib.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/*
+ * Only one process can read a board: the publisher drains it and
+ * writes a ring in shared memory, which any number of readers map
+ * read-only. The publisher never waits for readers: a slow one is
+ * overrun, and notices it. Every stamp has a position in the stream
+ * (head counts them all); each slot holds its position plus one, and
+ * zero while it is being written, so a reader can tell if the slot
+ * changed under its feet (a seqlock per slot). Readers sleep on a
+ * futex, which the publisher wakes after every batch.
+ *
+ * The layout is made of fixed-size fields, and the 64-bit counters are
+ * loaded and stored atomically (they would tear on 32-bit machines), so
+ * 32-bit and 64-bit processes can share it.
+ */
+#define FDELAY_SHM_MAGIC	0x66647368	/* "fdsh" */
+#define FDELAY_SHM_VERSION	2	/* 1 had no pid */
+
+struct __fdelay_shm_slot {
+	uint64_t pos;		/* position + 1; 0 while being written */
+	struct fd_time t;
+};
+
+struct __fdelay_shm_head {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* slots, a power of two */
+	uint32_t wake;		/* futex: low bits of "head" */
+	uint64_t head;		/* stamps written so far */
+	uint32_t closed;	/* the publisher is gone */
+	uint32_t pid;		/* the publisher, to tell a stale ring */
+	uint32_t pad[8];	/* the header is 64 bytes */
+	struct __fdelay_shm_slot slot[];
+};
+
+/* The publisher */
+struct fdelay_shm {
+	char *name;
+	size_t len;
+	struct __fdelay_shm_head *h;
+};
+
+/* A reader */
+struct fdelay_shm_reader {
+	size_t len;
+	struct __fdelay_shm_head *h;
+	uint64_t pos;		/* next position to read */
+	uint64_t lost;
+};
+
+static inline size_t __fdelay_shm_len(unsigned size)
+{
+	return sizeof(struct __fdelay_shm_head)
+		+ size * sizeof(struct __fdelay_shm_slot);
+}
+
+static int __fdelay_futex(uint32_t *addr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/*
+ * A ring left by a publisher that crashed: its process is gone. If the
+ * header can't be trusted (another version, or a ring being created
+ * right now) the ring is not stale, and it's up to the user to remove it.
+ */
+static int __fdelay_shm_stale(const char *name)
+{
+	struct __fdelay_shm_head *h;
+	struct stat st;
+	int fd, ret = 0;
+	void *p;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return errno == ENOENT; /* gone meanwhile: try again */
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*h)) {
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	h = p;
+	if (h->magic == FDELAY_SHM_MAGIC && h->version == FDELAY_SHM_VERSION
+	    && h->pid && kill(h->pid, 0) < 0 && errno == ESRCH)
+		ret = 1;
+	munmap(p, sizeof(*h));
+	return ret;
+}
+
+/* "name" is a POSIX shm name, like "/fdelay-0400"; size is in stamps */
+struct fdelay_shm *fdelay_shm_create(const char *name, int size)
+{
+	struct fdelay_shm *s;
+	unsigned n = 1;
+	void *p;
+	int fd;
+
+	if (size <= 0 || size > (1 << 24)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (n < size)
+		n <<= 1;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->name = strdup(name);
+	s->len = __fdelay_shm_len(n);
+	if (!s->name)
+		goto err_free;
+
+	/* A stale ring (a publisher that crashed) is replaced, not reused */
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST && __fdelay_shm_stale(name)) {
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	if (fd < 0)
+		goto err_free; /* EEXIST: another publisher is alive */
+	if (ftruncate(fd, s->len) < 0) {
+		close(fd);
+		goto err_unlink;
+	}
+	p = mmap(NULL, s->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		goto err_unlink;
+	s->h = p;
+	s->h->size = n;
+	s->h->version = FDELAY_SHM_VERSION;
+	s->h->pid = getpid();
+	__sync_synchronize();
+	s->h->magic = FDELAY_SHM_MAGIC;
+	return s;
+
+err_unlink:
+	shm_unlink(name);
+err_free:
+	free(s->name);
+	free(s);
+	return NULL;
+}
+
+/* Readers still attached see EPIPE once they consumed what is there */
+void fdelay_shm_destroy(struct fdelay_shm *s)
+{
+	if (!s)
+		return;
+	s->h->closed = 1;
+	__sync_synchronize();
+	s->h->wake++;
+	__fdelay_futex(&s->h->wake, FUTEX_WAKE, INT_MAX);
+	munmap(s->h, s->len);
+	shm_unlink(s->name);
+	free(s->name);
+	free(s);
+}
+
+/* Publish n stamps: this never blocks, and always succeeds */
+int fdelay_shm_write(struct fdelay_shm *s, struct fd_time *t, int n)
+{
+	struct __fdelay_shm_head *h = s->h;
+	struct __fdelay_shm_slot *slot;
+	uint64_t pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+	int i;
+
+	if (n <= 0)
+		return 0;
+	for (i = 0; i < n; i++, pos++) {
+		slot = h->slot + (pos & (h->size - 1));
+		__atomic_store_n(&slot->pos, 0, __ATOMIC_RELAXED);
+		__sync_synchronize();
+		slot->t = t[i];
+		__atomic_store_n(&slot->pos, pos + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&h->head, pos, __ATOMIC_RELEASE);
+	h->wake = pos;
+	__fdelay_futex(&h->wake, FUTEX_WAKE, INT_MAX);
+	return n;
+}
+
+/*
+ * Drain the board into the ring: read until the board has no more
+ * (with flags = 0 the first read may sleep). Returns the stamps
+ * published, or -1 (EAGAIN if nothing was pending with O_NONBLOCK).
+ * With O_NONBLOCK it fits an fdelay_poll callback.
+ */
+int fdelay_shm_pump(struct fdelay_shm *s, struct fdelay_board *b, int flags)
+{
+	struct fd_time t[256];
+	int i, done = 0;
+
+	do {
+		i = fdelay_read(b, t, ARRAY_SIZE(t), flags);
+		if (i < 0) {
+			if (done && errno == EAGAIN)
+				break;
+			return -1;
+		}
+		done += fdelay_shm_write(s, t, i);
+		flags |= O_NONBLOCK; /* only the first one may sleep */
+	} while (i == ARRAY_SIZE(t));
+	return done;
+}
+
+/* FDELAY_SHM_OLDEST starts from the oldest stamp still in the ring */
+struct fdelay_shm_reader *fdelay_shm_open(const char *name, int flags)
+{
+	struct fdelay_shm_reader *r;
+	struct __fdelay_shm_head *h;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof(*h)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	h = p;
+	if (h->magic != FDELAY_SHM_MAGIC || h->version != FDELAY_SHM_VERSION
+	    || __fdelay_shm_len(h->size) != st.st_size) {
+		munmap(p, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	r->h = h;
+	r->len = st.st_size;
+	r->pos = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	if ((flags & FDELAY_SHM_OLDEST) && r->pos > h->size)
+		r->pos -= h->size;
+	else if (flags & FDELAY_SHM_OLDEST)
+		r->pos = 0;
+	return r;
+}
+
+void fdelay_shm_close(struct fdelay_shm_reader *r)
+{
+	if (!r)
+		return;
+	munmap(r->h, r->len);
+	free(r);
+}
+
+/* Copy what is there, skipping what was overwritten before we got it */
+static int __fdelay_shm_copy(struct fdelay_shm_reader *r,
+			     struct fd_time *t, int n)
+{
+	struct __fdelay_shm_head *h = r->h;
+	struct __fdelay_shm_slot *slot;
+	uint64_t head, pos;
+	int i = 0;
+
+	head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	while (i < n && r->pos != head) {
+		if (head - r->pos > h->size) { /* overrun */
+			r->lost += head - h->size - r->pos;
+			r->pos = head - h->size;
+		}
+		slot = h->slot + (r->pos & (h->size - 1));
+		pos = __atomic_load_n(&slot->pos, __ATOMIC_ACQUIRE);
+		t[i] = slot->t;
+		__sync_synchronize();
+		if (pos != r->pos + 1
+		    || pos != __atomic_load_n(&slot->pos, __ATOMIC_RELAXED)) {
+			/*
+			 * Rewritten meanwhile: we are too slow. Catch up
+			 * from the new head, or from the next call if the
+			 * publisher didn't publish it yet.
+			 */
+			head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+			if (head - r->pos <= h->size)
+				break;
+			continue;
+		}
+		r->pos++;
+		i++;
+	}
+	return i;
+}
+
+/*
+ * Like fdelay_read: up to n stamps, waiting for the first one unless
+ * O_NONBLOCK is passed (then EAGAIN). EPIPE if the publisher is gone.
+ */
+int fdelay_shm_read(struct fdelay_shm_reader *r, struct fd_time *t,
+		    int n, int flags)
+{
+	struct __fdelay_shm_head *h = r->h;
+	uint32_t wake;
+	int i;
+
+	if (n <= 0)
+		return 0;
+	while (1) {
+		wake = *(volatile uint32_t *)&h->wake;
+		__sync_synchronize();
+		i = __fdelay_shm_copy(r, t, n);
+		if (i)
+			return i;
+		if (*(volatile uint32_t *)&h->closed) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (flags & O_NONBLOCK) {
+			errno = EAGAIN;
+			return -1;
+		}
+		/* Old kernels refuse futexes in read-only maps: then poll */
+		if (__fdelay_futex(&h->wake, FUTEX_WAIT, wake) < 0
+		    && errno != EAGAIN && errno != EINTR)
+			usleep(1000);
+	}
+}
+
+/* Stamps overwritten before this reader could get them */
+uint64_t fdelay_shm_lost(struct fdelay_shm_reader *r)
+{
+	return r->lost;
+}
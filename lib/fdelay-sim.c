@@ -0,0 +1,444 @@
+/*
+ * Boards made up in memory: the simulator, and what replay.c needs too
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#define FDELAY_INTERNAL
+#include "fdelay-lib.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/*
+ * A virtual board delivers the stamps of its source when they are
+ * due, with the same calls as a ZIO board: read (blocking or not),
+ * a file descriptor to poll (a timerfd, readable while stamps are
+ * due) and attributes. Time is made of host time since we started,
+ * scaled by speed, plus what set_time moved it by; writing "utc-h"
+ * sets it and reading "utc-h" latches it, like the hardware does.
+ * Other attributes are just kept, so configuration can be exercised.
+ * Outputs, triggers and the time page are not there.
+ */
+struct __fdelay_virt_attr {
+	char name[32];
+	uint32_t v;
+};
+
+struct __fdelay_virt {
+	struct __fdelay_virt_source *ops;
+	void *src;
+	double speed;
+	struct fd_time base;		/* board time when we started */
+	struct fd_time offset;		/* moved by set_time, modulo 2^64 s */
+	struct timespec start;		/* host time when we started */
+	int tfd;
+	struct fd_time latch;		/* utc-h, utc-l, coarse */
+	int nattr;
+	struct __fdelay_virt_attr attr[32];
+};
+
+static int64_t __fdelay_virt_elapsed_ps(struct __fdelay_virt *v)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - v->start.tv_sec) * 1000LL * 1000 * 1000
+		+ now.tv_nsec - v->start.tv_nsec) * 1000LL;
+}
+
+/* When a stamp is due, in host picoseconds since we started */
+static int64_t __fdelay_virt_due_ps(struct __fdelay_virt *v,
+				    struct fd_time *t)
+{
+	if (!v->speed)
+		return 0;
+	return fd_time_diff_ps(t, &v->base) / v->speed;
+}
+
+static void __fdelay_virt_at(struct __fdelay_virt *v, int64_t ps,
+			     struct timespec *ts)
+{
+	ps /= 1000; /* ns */
+	ts->tv_sec = v->start.tv_sec + ps / (1000 * 1000 * 1000);
+	ts->tv_nsec = v->start.tv_nsec + ps % (1000 * 1000 * 1000);
+	if (ts->tv_nsec >= 1000 * 1000 * 1000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000 * 1000 * 1000;
+	}
+}
+
+/*
+ * Make the timerfd readable when the next stamp is due (at once, if it
+ * is due already or the source is over: the reader must see ENODATA)
+ */
+static void __fdelay_virt_arm(struct __fdelay_virt *v)
+{
+	struct itimerspec its = {{0, 0}, {0, 1}};
+	struct fd_time t;
+	uint64_t exp;
+	int flags = 0;
+
+	if (read(v->tfd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+		return;
+	if (v->ops->peek(v->src, &t) == 0 && __fdelay_virt_due_ps(v, &t) > 0) {
+		__fdelay_virt_at(v, __fdelay_virt_due_ps(v, &t), &its.it_value);
+		flags = TFD_TIMER_ABSTIME;
+	}
+	timerfd_settime(v->tfd, flags, &its, NULL);
+}
+
+static int __fdelay_virt_read(struct __fdelay_board *b, struct fd_time *t,
+			      int n, int flags)
+{
+	struct __fdelay_virt *v = b->priv;
+	struct timespec ts;
+	int64_t now, due;
+	int i = 0;
+
+	pthread_mutex_lock(&b->in_lock);
+	now = __fdelay_virt_elapsed_ps(v);
+	while (i < n) {
+		if (v->ops->peek(v->src, t + i) < 0) {
+			if (i)
+				break;
+			errno = ENODATA; /* a replay is over */
+			i = -1;
+			break;
+		}
+		due = __fdelay_virt_due_ps(v, t + i);
+		if (due > now)
+			now = __fdelay_virt_elapsed_ps(v);
+		if (due > now) {
+			if (i)
+				break;
+			if (flags == O_NONBLOCK) {
+				errno = EAGAIN;
+				i = -1;
+				break;
+			}
+			/* Like a ZIO read, don't keep other threads out */
+			pthread_mutex_unlock(&b->in_lock);
+			__fdelay_virt_at(v, due, &ts);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			pthread_mutex_lock(&b->in_lock);
+			now = __fdelay_virt_elapsed_ps(v);
+			continue;
+		}
+		v->ops->pop(v->src);
+		fd_time_add(t + i, &v->offset);
+		i++;
+	}
+	if (i > 0)
+		__fdelay_seq_extend(b, t, i, NULL);
+	__fdelay_virt_arm(v);
+	pthread_mutex_unlock(&b->in_lock);
+	return i;
+}
+
+static int __fdelay_virt_fileno_tdc(struct __fdelay_board *b)
+{
+	struct __fdelay_virt *v = b->priv;
+
+	return v->tfd;
+}
+
+static void __fdelay_virt_now(struct __fdelay_virt *v, struct fd_time *t)
+{
+	*t = v->base;
+	fd_time_add_ps(t, __fdelay_virt_elapsed_ps(v)
+		       * (v->speed ? v->speed : 1));
+	fd_time_add(t, &v->offset);
+}
+
+static struct __fdelay_virt_attr *__fdelay_virt_find(struct __fdelay_virt *v,
+						     char *name, int create)
+{
+	int i;
+
+	for (i = 0; i < v->nattr; i++)
+		if (!strcmp(v->attr[i].name, name))
+			return v->attr + i;
+	if (!create || v->nattr == ARRAY_SIZE(v->attr)
+	    || strlen(name) >= sizeof(v->attr[0].name)) {
+		errno = create ? ENOSPC : ENOENT;
+		return NULL;
+	}
+	strcpy(v->attr[i].name, name);
+	v->attr[i].v = 0;
+	v->nattr++;
+	return v->attr + i;
+}
+
+static int __fdelay_virt_attr_get(struct __fdelay_board *b, char *name,
+				  uint32_t *resp)
+{
+	struct __fdelay_virt *v = b->priv;
+	struct __fdelay_virt_attr *a;
+	int ret = 0;
+
+	pthread_mutex_lock(&b->in_lock);
+	if (!strcmp(name, "utc-h")) {
+		__fdelay_virt_now(v, &v->latch);
+		*resp = v->latch.utc >> 32;
+	} else if (!strcmp(name, "utc-l")) {
+		*resp = v->latch.utc;
+	} else if (!strcmp(name, "coarse")) {
+		*resp = v->latch.coarse;
+	} else if ((a = __fdelay_virt_find(v, name, 0))) {
+		*resp = a->v;
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&b->in_lock);
+	return ret;
+}
+
+static int __fdelay_virt_attr_set(struct __fdelay_board *b, char *name,
+				  uint32_t *value)
+{
+	struct __fdelay_virt *v = b->priv;
+	struct __fdelay_virt_attr *a;
+	struct fd_time t, d;
+	struct timespec ts;
+	int ret = 0;
+
+	pthread_mutex_lock(&b->in_lock);
+	if (!strcmp(name, "utc-h") || !strcmp(name, "utc-l")) {
+		v->latch.utc = name[4] == 'h'
+			? (uint64_t)*value << 32 | (uint32_t)v->latch.utc
+			: (v->latch.utc & ~0xffffffffULL) | *value;
+	} else if (!strcmp(name, "coarse")) {
+		v->latch.coarse = *value;
+		v->latch.frac = 0;
+	} else if (!strcmp(name, "command") && *value == FD_CMD_HOST_TIME) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		v->latch.utc = ts.tv_sec;
+		v->latch.coarse = ts.tv_nsec / 8;
+		v->latch.frac = 0;
+		name = "utc-h"; /* and set it, below */
+	} else if ((a = __fdelay_virt_find(v, name, 1))) {
+		a->v = *value;
+	} else {
+		ret = -1;
+	}
+	if (!strcmp(name, "utc-h")) { /* this one sets time */
+		/* Not in ps, they overflow after 106 days */
+		__fdelay_virt_now(v, &t);
+		d = v->latch;
+		fd_time_sub(&d, &t);
+		fd_time_add(&v->offset, &d);
+		__fdelay_virt_arm(v);
+	}
+	pthread_mutex_unlock(&b->in_lock);
+	return ret;
+}
+
+static void __fdelay_virt_release(struct __fdelay_board *b)
+{
+	struct __fdelay_virt *v = b->priv;
+
+	close(v->tfd);
+	if (v->ops->release)
+		v->ops->release(v->src);
+	free(v);
+}
+
+static struct __fdelay_ops __fdelay_virt_ops = {
+	.name =		"virtual",
+	.read =		__fdelay_virt_read,
+	.fileno_tdc =	__fdelay_virt_fileno_tdc,
+	.attr_get =	__fdelay_virt_attr_get,
+	.attr_set =	__fdelay_virt_attr_set,
+	.release =	__fdelay_virt_release,
+};
+
+/* "base" is the board time now; the source is released on error too */
+int __fdelay_virt_add(char *name, int dev_id, double speed,
+		      struct fd_time *base,
+		      struct __fdelay_virt_source *ops, void *src)
+{
+	struct __fdelay_virt *v;
+	int i;
+
+	v = calloc(1, sizeof(*v));
+	if (!v)
+		goto err;
+	v->ops = ops;
+	v->src = src;
+	v->speed = speed;
+	v->base = *base;
+	v->latch = *base;
+	clock_gettime(CLOCK_MONOTONIC, &v->start);
+	v->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v->tfd < 0)
+		goto err_free;
+	__fdelay_virt_find(v, "version", 1)->v = FDELAY_VERSION;
+	__fdelay_virt_find(v, "temperature", 1)->v = 40 * 16;
+	__fdelay_virt_arm(v);
+
+	i = __fdelay_board_add(name, dev_id, &__fdelay_virt_ops, v);
+	if (i < 0)
+		return -1; /* released with the board */
+	if (fdelay_is_verbose())
+		fprintf(stderr, "%s: %04x %s, speed %g\n", __func__, dev_id,
+			name, speed);
+	return i;
+
+err_free:
+	free(v);
+err:
+	if (ops->release)
+		ops->release(src);
+	return -1;
+}
+
+/* Arguments are "key=value,key=value": copy the value, or NULL */
+char *__fdelay_virt_arg(char *args, char *key, char *buf, int len)
+{
+	int klen = strlen(key), vlen;
+	char *s;
+
+	for (s = args; s && *s; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL) {
+		if (strncmp(s, key, klen) || s[klen] != '=')
+			continue;
+		s += klen + 1;
+		vlen = strchr(s, ',') ? strchr(s, ',') - s : strlen(s);
+		if (vlen >= len)
+			vlen = len - 1;
+		memcpy(buf, s, vlen);
+		buf[vlen] = '\0';
+		return buf;
+	}
+	return NULL;
+}
+
+double __fdelay_virt_num(char *args, char *key, double def)
+{
+	char buf[32];
+
+	if (!__fdelay_virt_arg(args, key, buf, sizeof(buf)))
+		return def;
+	return strtod(buf, NULL);
+}
+
+/*
+ * The simulator: pulses at "rate" (Hz), in bursts of "burst" pulses
+ * that start at "burst_rate" (Hz; 0 is back to back), each one moved
+ * by up to +/- "jitter" ps. One pulse in "loss" is lost (the sequence
+ * number shows it). Board time starts at host time.
+ */
+struct __fdelay_sim {
+	struct fd_time origin;
+	int64_t period_ps, burst_ps, jitter_ps;
+	uint64_t burst, loss;
+	uint64_t rnd;			/* xorshift state */
+	uint64_t k;			/* the next pulse */
+	int valid;
+	struct fd_time next;
+};
+
+static uint64_t __fdelay_sim_rand(struct __fdelay_sim *s)
+{
+	s->rnd ^= s->rnd << 13;
+	s->rnd ^= s->rnd >> 7;
+	s->rnd ^= s->rnd << 17;
+	return s->rnd;
+}
+
+static int __fdelay_sim_peek(void *src, struct fd_time *t)
+{
+	struct __fdelay_sim *s = src;
+	int64_t ps;
+
+	while (!s->valid) {
+		if (s->loss && __fdelay_sim_rand(s) % s->loss == 0) {
+			s->k++;
+			continue;
+		}
+		ps = (s->k / s->burst) * s->burst_ps
+			+ (s->k % s->burst) * s->period_ps;
+		if (s->jitter_ps)
+			ps += (int64_t)(__fdelay_sim_rand(s)
+					% (2 * s->jitter_ps + 1)) - s->jitter_ps;
+		s->next = s->origin;
+		fd_time_add_ps(&s->next, ps);
+		s->next.seq_id = s->k & 0xffff; /* as the hardware does */
+		s->next.channel = 0;
+		s->valid = 1;
+	}
+	*t = s->next;
+	return 0;
+}
+
+static void __fdelay_sim_pop(void *src)
+{
+	struct __fdelay_sim *s = src;
+
+	s->k++;
+	s->valid = 0;
+}
+
+static struct __fdelay_virt_source __fdelay_sim_source = {
+	.peek =		__fdelay_sim_peek,
+	.pop =		__fdelay_sim_pop,
+	.release =	free,
+};
+
+int __fdelay_sim_init(char *args)
+{
+	struct __fdelay_sim *s;
+	struct timespec now;
+	double rate, burst_rate;
+	char name[16];
+	int i, n;
+
+	n = __fdelay_virt_num(args, "boards", 1);
+	rate = __fdelay_virt_num(args, "rate", 1000);
+	if (n < 1 || rate <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (i = 0; i < n; i++) {
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			return -1;
+		s->origin.utc = now.tv_sec;
+		s->origin.coarse = now.tv_nsec / 8;
+		s->period_ps = FD_TIME_PS_PER_SEC / rate;
+		s->burst = __fdelay_virt_num(args, "burst", 1);
+		if (s->burst < 1)
+			s->burst = 1;
+		burst_rate = __fdelay_virt_num(args, "burst_rate", 0);
+		s->burst_ps = burst_rate > 0 ? FD_TIME_PS_PER_SEC / burst_rate
+			: s->burst * s->period_ps;
+		s->jitter_ps = __fdelay_virt_num(args, "jitter", 0);
+		s->loss = __fdelay_virt_num(args, "loss", 0);
+		if (s->loss < 2) /* one in one would be none at all */
+			s->loss = 0;
+		s->rnd = __fdelay_virt_num(args, "seed", 1) + i
+			* 0x9e3779b97f4a7c15ULL;
+		if (!s->rnd)
+			s->rnd = 1;
+		sprintf(name, "sim-%i", i);
+		if (__fdelay_virt_add(name, 0xf000 + i,
+				      __fdelay_virt_num(args, "speed", 1),
+				      &s->origin, &__fdelay_sim_source, s) < 0)
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,46 @@
+/* Simple demo that reads the stamps published by fdelay-publish */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fdelay-lib.h"
+
+int main(int argc, char **argv)
+{
+	struct fdelay_shm_reader *r;
+	struct fd_time t[64];
+	uint64_t lost = 0;
+	int i, j;
+
+	if (argc != 2) {
+		fprintf(stderr, "%s: Use \"%s <shm-name>\" (e.g. /fdelay-0)\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+
+	r = fdelay_shm_open(argv[1], 0);
+	if (!r) {
+		fprintf(stderr, "%s: fdelay_shm_open(%s): %s\n", argv[0],
+			argv[1], strerror(errno));
+		exit(1);
+	}
+
+	while ((i = fdelay_shm_read(r, t, 64, 0)) > 0) {
+		if (fdelay_shm_lost(r) != lost) {
+			printf("lost %lli stamps\n",
+			       (long long)(fdelay_shm_lost(r) - lost));
+			lost = fdelay_shm_lost(r);
+		}
+		for (j = 0; j < i; j++) {
+			printf("seq %5i: time %lli.%09li + %04x\n",
+			       t[j].seq_id, (long long)t[j].utc,
+			       (long)t[j].coarse * 8, t[j].frac);
+		}
+	}
+	if (errno != EPIPE)
+		fprintf(stderr, "%s: fdelay_shm_read(): %s\n", argv[0],
+			strerror(errno));
+
+	fdelay_shm_close(r);
+	return 0;
+}
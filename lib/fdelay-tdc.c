@@ -12,10 +12,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
@@ -55,12 +56,8 @@ int fdelay_get_config_tdc(struct fdelay_board *userb)
 
 static int __fdelay_open_tdc_data(struct __fdelay_board *b)
 {
-	char fname[128];
-	if (b->fdd <= 0) {
-		sprintf(fname, "%s-0-0-data", b->devbase);
-		b->fdd = open(fname, O_RDONLY | O_NONBLOCK);
-	}
-	return b->fdd;
+	return __fdelay_open_once(&b->fdd, O_RDONLY | O_NONBLOCK,
+				  "%s-0-0-data", b->devbase);
 }
 
 /* file-descriptor to data, when kernel-module loaded with raw_tdc=1 */
@@ -72,52 +69,77 @@ int fdelay_fileno_tdc_data(struct fdelay_board *userb)
 
 static int __fdelay_open_tdc(struct __fdelay_board *b)
 {
-	char fname[128];
-	if (b->fdc[0] <= 0) {
-		sprintf(fname, "%s-0-0-ctrl", b->devbase);
-		b->fdc[0] = open(fname, O_RDONLY | O_NONBLOCK);
-	}
-	return b->fdc[0];
+	return __fdelay_open_once(&b->fdc[0], O_RDONLY | O_NONBLOCK,
+				  "%s-0-0-ctrl", b->devbase);
+}
+
+int __fdelay_zio_fileno_tdc(struct __fdelay_board *b)
+{
+	return __fdelay_open_tdc(b);
 }
 
 int fdelay_fileno_tdc(struct fdelay_board *userb)
 {
 	__define_board(b, userb);
-	return __fdelay_open_tdc(b);
+	return b->ops->fileno_tdc(b);
+}
+
+
+/* The control block carries the first (or only) sample of a block */
+static void __fdelay_ctrl_to_time(struct zio_control *ctrl,
+				  struct fd_time *t)
+{
+	uint32_t *attrs = ctrl->attr_channel.ext_val;
+
+	t->utc = (uint64_t)attrs[FD_ATTR_TDC_UTC_H] << 32
+		| attrs[FD_ATTR_TDC_UTC_L];
+	t->coarse = attrs[FD_ATTR_TDC_COARSE];
+	t->frac = attrs[FD_ATTR_TDC_FRAC];
+	t->seq_id = attrs[FD_ATTR_TDC_SEQ];
+	t->channel = attrs[FD_ATTR_TDC_CHAN];
+}
+
+/* What the driver dropped so far, per channel, to check sequences */
+static inline uint32_t *__fdelay_ctrl_dropped(struct zio_control *ctrl)
+{
+	return ctrl->attr_channel.ext_val + FD_ATTR_TDC_DROPPED_0;
 }
 
+/* Blocking readers wait here; poll has no FD_SETSIZE limit */
+static int __fdelay_wait_in(int fd)
+{
+	struct pollfd pfd = {fd, POLLIN, 0};
+
+	return poll(&pfd, 1, -1) < 0 ? -1 : 0;
+}
 
 /* "read" behaves like the system call and obeys O_NONBLOCK */
-int fdelay_read(struct fdelay_board *userb, struct fdelay_time *t, int n,
-		       int flags)
+int __fdelay_zio_read(struct __fdelay_board *b, struct fd_time *t, int n,
+		      int flags)
 {
-	__define_board(b, userb);
 	struct zio_control ctrl;
-	uint32_t *attrs;
 	int i, j, fd;
-	fd_set set;
 
 	fd = __fdelay_open_tdc(b);
 	if (fd < 0)
 		return fd; /* errno already set */
 
 	for (i = 0; i < n;) {
+		/* Stamps must be sequenced in the order they are read */
+		pthread_mutex_lock(&b->in_lock);
 		j = read(fd, &ctrl, sizeof(ctrl));
-		if (j < 0 && errno != EAGAIN)
-			return -1;
 		if (j == sizeof(ctrl)) {
 			/* one sample: pick it */
-			attrs = ctrl.attr_channel.ext_val;
-			t->utc = (uint64_t)attrs[FD_ATTR_TDC_UTC_H] << 32
-				| attrs[FD_ATTR_TDC_UTC_L];
-			t->coarse = attrs[FD_ATTR_TDC_COARSE];
-			t->frac = attrs[FD_ATTR_TDC_FRAC];
-			t->seq_id = attrs[FD_ATTR_TDC_SEQ];
-			t->channel = attrs[FD_ATTR_TDC_CHAN];
-
+			__fdelay_ctrl_to_time(&ctrl, t + i);
+			__fdelay_seq_extend(b, t + i, 1,
+					    __fdelay_ctrl_dropped(&ctrl));
+			pthread_mutex_unlock(&b->in_lock);
 			i++;
 			continue;
 		}
+		pthread_mutex_unlock(&b->in_lock);
+		if (j < 0 && errno != EAGAIN)
+			return -1;
 		if (j > 0) {
 			errno = EIO;
 			return -1;
@@ -130,17 +152,22 @@ int fdelay_read(struct fdelay_board *userb, struct fdelay_time *t, int n,
 			return -1;
 
 		/* So, first sample and blocking read. Wait.. */
-		FD_ZERO(&set);
-		FD_SET(fd, &set);
-		if (select(fd+1, &set, NULL, NULL, NULL) < 0)
+		if (__fdelay_wait_in(fd) < 0)
 			return -1;
 		continue;
 	}
 	return i;
 }
 
+int fdelay_read(struct fdelay_board *userb, struct fd_time *t, int n,
+		       int flags)
+{
+	__define_board(b, userb);
+	return b->ops->read(b, t, n, flags);
+}
+
 /* "fread" behaves like stdio: it reads all the samples */
-int fdelay_fread(struct fdelay_board *userb, struct fdelay_time *t, int n)
+int fdelay_fread(struct fdelay_board *userb, struct fd_time *t, int n)
 {
 	int i, loop;
 
@@ -162,48 +189,65 @@ int fdelay_fread(struct fdelay_board *userb, struct fdelay_time *t, int n)
  * 
  * maximum number of samples in one block: fd-input/trigger/post-samples
 */
-int fdelay_read_raw(struct fdelay_board *userb, struct fdelay_time *t, int n,
+int fdelay_read_raw(struct fdelay_board *userb, struct fd_time *t, int n,
 				unsigned char *databuffer, int *nsamples,
 		       int flags)
 {
 	__define_board(b, userb);
 	struct zio_control ctrl;
-	uint32_t *attrs;
 	int i, j, m;
 	int cfd; // control
 	int dfd; // data
-	fd_set set;
+
+	/* Other backends have no blocks: each stamp is one of its own */
+	if (b->ops != &__fdelay_zio_ops) {
+		i = b->ops->read(b, t, 1, flags);
+		if (i == 1) {
+			memcpy(databuffer, t, sizeof(*t));
+			*nsamples = 1;
+		}
+		return i;
+	}
 
 	cfd = __fdelay_open_tdc(b); // fd of ctrl
 	dfd = __fdelay_open_tdc_data(b); // fd of data
-	if (cfd < 0)
-		return cfd; /* errno already set */
+	if (cfd < 0 || dfd < 0)
+		return -1; /* errno already set */
 
 	for (i = 0; i < n;) {
 		
+		/* Another thread must not get our data, nor we its own */
+		pthread_mutex_lock(&b->in_lock);
 		j = read(cfd, &ctrl, sizeof(ctrl)); // read ctrl data
+		if (j != sizeof(ctrl))
+			pthread_mutex_unlock(&b->in_lock);
 		if (j < 0 && errno != EAGAIN)
 			return -1;
 		if (j == sizeof(ctrl)) { /* one sample: pick it */
-			attrs = ctrl.attr_channel.ext_val;
-			t->utc = (uint64_t)attrs[FD_ATTR_TDC_UTC_H] << 32
-				| attrs[FD_ATTR_TDC_UTC_L];
-			t->coarse = attrs[FD_ATTR_TDC_COARSE];
-			t->frac = attrs[FD_ATTR_TDC_FRAC];
-			t->seq_id = attrs[FD_ATTR_TDC_SEQ];
-			t->channel = attrs[FD_ATTR_TDC_CHAN];
+			__fdelay_ctrl_to_time(&ctrl, t);
 			
 			*nsamples = ctrl.nsamples; // should be?? attrd[FD_ATTR_TDC_RAW_NSAMPLES];
 
 			// now read data
 			m = read(dfd, databuffer, ctrl.nsamples * ctrl.ssize);
-			if (m < 0) {
-				fprintf(stderr, "ERROR! read data %i\n",m);
-				return; 
+			if (m < 0 || m != ctrl.nsamples * ctrl.ssize) {
+				pthread_mutex_unlock(&b->in_lock);
+				if (m >= 0)
+					errno = EIO; /* the block is lost */
+				return -1;
 			}
-			if (m != ctrl.nsamples * ctrl.ssize) {
-				fprintf(stderr, "ERROR! got %i, expected %i\n",m,ctrl.nsamples * ctrl.ssize);
+			/* The first record is the control's own stamp */
+			if (ctrl.ssize == sizeof(*t) && ctrl.nsamples) {
+				__fdelay_seq_extend(b, (void *)databuffer,
+						    ctrl.nsamples,
+						    __fdelay_ctrl_dropped(&ctrl));
+				t->seq_id = ((struct fd_time *)
+					     databuffer)->seq_id;
+			} else {
+				__fdelay_seq_extend(b, t, 1,
+						    __fdelay_ctrl_dropped(&ctrl));
 			}
+			pthread_mutex_unlock(&b->in_lock);
 			
 			i++;
 			continue;
@@ -220,11 +264,201 @@ int fdelay_read_raw(struct fdelay_board *userb, struct fdelay_time *t, int n,
 			return -1;
 
 		/* So, first sample and blocking read. Wait.. */
-		FD_ZERO(&set);
-		FD_SET(cfd, &set);
-		if (select(cfd+1, &set, NULL, NULL, NULL) < 0)
+		if (__fdelay_wait_in(cfd) < 0)
 			return -1;
 		continue;
 	}
 	return i;
 }
+
+/*
+ * Block-level reading: whole blocks are read into an arena, where the
+ * records can be used in place (see fdelay_arena_for_each). With
+ * raw_tdc=0 each control is one record, so the same code works.
+ */
+struct fdelay_arena *fdelay_arena_alloc(int size)
+{
+	struct fdelay_arena *a;
+
+	if (size <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	/* Aligned to a cache line, for the benefit of vector code */
+	if (posix_memalign((void **)&a->t, 64, size * sizeof(*a->t))) {
+		free(a);
+		errno = ENOMEM;
+		return NULL;
+	}
+	a->size = size;
+	return a;
+}
+
+void fdelay_arena_free(struct fdelay_arena *a)
+{
+	if (!a)
+		return;
+	free(a->t);
+	free(a);
+}
+
+/*
+ * Read one block, if any, at the end of the arena. Returns records read.
+ * If the data doesn't fit after other blocks, the control is kept in
+ * the board and the data is read by the next call, in an empty arena.
+ */
+static int __fdelay_read_block_locked(struct __fdelay_board *b, int cfd,
+				      struct fdelay_arena *a)
+{
+	struct zio_control ctrl;
+	uint32_t nsamples, *dropped;
+	int j, len, dfd;
+
+	if (b->in_pending) {
+		nsamples = b->in_pending;
+		dropped = b->in_pending_dropped;
+		b->in_pending = 0;
+	} else {
+		j = read(cfd, &ctrl, sizeof(ctrl));
+		if (j < 0)
+			return -1;
+		if (j != sizeof(ctrl)) {
+			errno = EIO;
+			return -1;
+		}
+		dropped = __fdelay_ctrl_dropped(&ctrl);
+		if (ctrl.ssize == 0) { /* normal mode: sample in the control */
+			__fdelay_ctrl_to_time(&ctrl, a->t + a->n);
+			__fdelay_seq_extend(b, a->t + a->n, 1, dropped);
+			return 1;
+		}
+		if (ctrl.ssize != sizeof(*a->t)) {
+			errno = EPROTO; /* driver and library don't match */
+			return -1;
+		}
+		nsamples = ctrl.nsamples;
+	}
+	if (nsamples > a->size - a->n) {
+		/* post-samples changed while reading */
+		if (a->n) {
+			b->in_pending = nsamples;
+			memcpy(b->in_pending_dropped, dropped,
+			       sizeof(b->in_pending_dropped));
+		} else {
+			/* Not even the empty arena fits it: it is lost */
+			b->seq[0].st.overflow += nsamples;
+		}
+		errno = EOVERFLOW;
+		return -1;
+	}
+	dfd = __fdelay_open_tdc_data(b);
+	if (dfd < 0)
+		return -1;
+	len = nsamples * sizeof(*a->t);
+	j = read(dfd, a->t + a->n, len);
+	if (j < 0)
+		return -1;
+	if (j != len) {
+		errno = EIO;
+		return -1;
+	}
+	__fdelay_seq_extend(b, a->t + a->n, nsamples, dropped);
+	return nsamples;
+}
+
+/*
+ * Another thread must not get our data, nor we its own; and stamps
+ * must be sequenced in the order they are read
+ */
+static int __fdelay_read_block(struct __fdelay_board *b, int cfd,
+			       struct fdelay_arena *a)
+{
+	int ret;
+
+	pthread_mutex_lock(&b->in_lock);
+	ret = __fdelay_read_block_locked(b, cfd, a);
+	pthread_mutex_unlock(&b->in_lock);
+	return ret;
+}
+
+/*
+ * Empty the arena and fill it with as many blocks as are ready and fit.
+ * Only the first block is waited for, unless O_NONBLOCK is passed.
+ * Returns the number of records, or -1 with errno.
+ */
+int fdelay_read_blocks(struct fdelay_board *userb, struct fdelay_arena *a,
+		       int flags)
+{
+	__define_board(b, userb);
+	uint32_t blk;
+	int cfd, i;
+
+	/* Other backends have no blocks: each stamp is one of its own */
+	if (b->ops != &__fdelay_zio_ops) {
+		i = b->ops->read(b, a->t, a->size, flags);
+		a->n = a->nblocks = i < 0 ? 0 : i;
+		return i;
+	}
+
+	cfd = __fdelay_open_tdc(b);
+	if (cfd < 0)
+		return -1;
+	/* A block can't be read in pieces: we need room for the biggest */
+	if (fdelay_sysfs_get(b, "fd-input/trigger/post-samples", &blk) < 0
+	    || blk == 0)
+		blk = 1;
+	if ((int)blk > a->size) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	a->n = a->nblocks = 0;
+	while (a->size - a->n >= (int)blk) {
+		i = __fdelay_read_block(b, cfd, a);
+		/* A block that doesn't fit waits: return what we have */
+		if (i < 0 && errno == EOVERFLOW && a->nblocks)
+			break;
+		if (i < 0 && errno != EAGAIN)
+			return -1;
+		if (i >= 0) {
+			a->n += i;
+			a->nblocks++;
+			continue;
+		}
+		/* EAGAIN: we are done, unless we must wait for the first */
+		if (a->nblocks || flags == O_NONBLOCK)
+			break;
+		if (__fdelay_wait_in(cfd) < 0)
+			return -1;
+	}
+	if (!a->nblocks) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return a->n;
+}
+
+/*
+ * Structure-of-arrays decoding, for vector code: seconds, picoseconds
+ * within the second and sequence numbers. Any array may be NULL; each
+ * one is filled by its own simple loop, which the compiler vectorizes.
+ */
+int fdelay_decode_soa(struct fd_time *t, int n, uint64_t *utc,
+		      uint64_t *ps, uint32_t *seq)
+{
+	int i;
+
+	if (utc)
+		for (i = 0; i < n; i++)
+			utc[i] = t[i].utc;
+	if (ps)
+		for (i = 0; i < n; i++)
+			ps[i] = fd_time_cf_to_ps(t[i].coarse, t[i].frac);
+	if (seq)
+		for (i = 0; i < n; i++)
+			seq[i] = t[i].seq_id;
+	return n;
+}
@@ -20,6 +20,8 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
@@ -34,7 +36,7 @@ static char *names[] = {
 	"coarse"
 };
 
-int fdelay_set_time(struct fdelay_board *userb, struct fdelay_time *t)
+int fdelay_set_time(struct fdelay_board *userb, struct fd_time *t)
 {
 	__define_board(b, userb);
 	uint32_t attrs[ARRAY_SIZE(names)];
@@ -44,22 +46,29 @@ int fdelay_set_time(struct fdelay_board *userb, struct fdelay_time *t)
 	attrs[1] = t->utc;
 	attrs[2] = t->coarse;
 
+	/* Writing utc-h sets time: other threads must not mix their values */
+	pthread_mutex_lock(&b->time_lock);
 	for (i = ARRAY_SIZE(names) - 1; i >= 0; i--)
 		if (fdelay_sysfs_set(b, names[i], attrs + i) < 0)
-			return -1;
-	return 0;
+			break;
+	pthread_mutex_unlock(&b->time_lock);
+	return i < 0 ? 0 : -1;
 }
 
-int fdelay_get_time(struct fdelay_board *userb, struct fdelay_time *t)
+int fdelay_get_time(struct fdelay_board *userb, struct fd_time *t)
 {
 	__define_board(b, userb);
 	uint32_t attrs[ARRAY_SIZE(names)];
 	int i;
 
 
+	pthread_mutex_lock(&b->time_lock);
 	for (i = 0; i < ARRAY_SIZE(names); i++)
 		if (fdelay_sysfs_get(b, names[i], attrs + i) < 0)
-			return -1;
+			break;
+	pthread_mutex_unlock(&b->time_lock);
+	if (i < ARRAY_SIZE(names))
+		return -1;
 	t->utc = (long long)attrs[0] << 32;
 	t->utc += attrs[1];
 	t->coarse = attrs[2];
@@ -72,3 +81,129 @@ int fdelay_set_host_time(struct fdelay_board *userb)
 	return __fdelay_command(b, FD_CMD_HOST_TIME);
 }
 
+
+/* The time page is mapped at first use (by any thread), kept until close */
+static struct fd_time_page *__fdelay_time_page(struct __fdelay_board *b)
+{
+	char pathname[128];
+	void *p;
+	int fd;
+
+	p = *(void * volatile *)&b->time_page;
+	if (p)
+		return p;
+	sprintf(pathname, "%s/time-page", b->sysbase);
+	fd = open(pathname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	p = mmap(NULL, sizeof(*b->time_page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	/* Another thread may have mapped it meanwhile: keep one only */
+	if (!__sync_bool_compare_and_swap(&b->time_page, NULL, p)) {
+		munmap(p, sizeof(*b->time_page));
+		p = *(void * volatile *)&b->time_page;
+	}
+	return p;
+}
+
+/* Take a consistent copy of the page, and read the host clock within it */
+static int __fdelay_time_snapshot(struct __fdelay_board *b,
+				  struct fd_time_page *p, struct timespec *now)
+{
+	struct fd_time_page *page;
+	uint32_t seq;
+
+	page = __fdelay_time_page(b);
+	if (!page)
+		return -1; /* errno already set */
+	do {
+		seq = *(volatile uint32_t *)&page->seq;
+		__sync_synchronize();
+		*p = *page;
+		if (now)
+			clock_gettime(CLOCK_MONOTONIC, now);
+		__sync_synchronize();
+	} while ((seq & 1) || seq != *(volatile uint32_t *)&page->seq);
+
+	if (p->version != FD_TIME_PAGE_VERSION) {
+		errno = EIO;
+		return -1;
+	}
+	if (!(p->flags & FD_TIME_PAGE_VALID)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/* Return v * rate >> 32, without overflowing for big values of v */
+static inline int64_t __fdelay_scale(int64_t v, int64_t rate)
+{
+	return (v >> 32) * rate + (((v & 0xffffffffLL) * rate) >> 32);
+}
+
+/*
+ * Extrapolate board time from the time page, with no system call.
+ * The error bound (in nanoseconds) is returned in err_ns, if not NULL.
+ * If the driver has no valid sample, this fails with EAGAIN and the
+ * caller should fall back to fdelay_get_time().
+ */
+int fdelay_get_time_fast(struct fdelay_board *userb, struct fd_time *t,
+			 uint32_t *err_ns)
+{
+	__define_board(b, userb);
+	struct fd_time_page p;
+	struct timespec now;
+	int64_t dt;
+	uint64_t ns, err;
+
+	if (__fdelay_time_snapshot(b, &p, &now) < 0)
+		return -1;
+	dt = now.tv_sec * 1000LL * 1000 * 1000 + now.tv_nsec - p.host_ns;
+	ns = p.board_ns + dt + __fdelay_scale(dt, p.rate);
+	if (err_ns) {
+		err = p.uncert_ns
+			+ __fdelay_scale(dt < 0 ? -dt : dt, p.rate_uncert);
+		*err_ns = err > ~0U ? ~0U : err;
+	}
+
+	t->utc = ns / (1000 * 1000 * 1000);
+	ns %= 1000 * 1000 * 1000;
+	t->coarse = ns / 8;
+	t->frac = (ns % 8) * 4096 / 8;
+	return 0;
+}
+
+/*
+ * Convert n board stamps (e.g. input events) to host time, in
+ * nanoseconds of CLOCK_MONOTONIC or CLOCK_REALTIME, using a single
+ * snapshot of the time page. Returns n or -1 with errno set.
+ */
+int fdelay_time_to_host(struct fdelay_board *userb, clockid_t clock,
+			struct fd_time *t, int64_t *host_ns, int n)
+{
+	__define_board(b, userb);
+	struct fd_time_page p;
+	int64_t db, base;
+	int i;
+
+	if (clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__fdelay_time_snapshot(b, &p, NULL) < 0)
+		return -1;
+	base = p.host_ns;
+	if (clock == CLOCK_REALTIME)
+		base += p.real_offset_ns;
+
+	/* host = board / (1 + rate): first order is plenty for ppm rates */
+	for (i = 0; i < n; i++, t++) {
+		db = t->utc * 1000LL * 1000 * 1000 + t->coarse * 8LL
+			+ ((t->frac * 8) >> 12) - p.board_ns;
+		host_ns[i] = base + db - __fdelay_scale(db, p.rate);
+	}
+	return n;
+}
@@ -0,0 +1,358 @@
+/*
+ * C++ interface to the fine-delay library: header only (C++14 or later)
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2 as published by the Free Software Foundation or, at your
+ * option, any later version.
+ */
+#ifndef __FDELAY_HPP__
+#define __FDELAY_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <system_error>
+#include <utility>
+
+#include "fdelay-lib.h"
+
+namespace fdelay {
+
+/*
+ * A time in hardware units, like struct fd_time without seq_id and
+ * channel. Everything is constexpr; the arithmetic is the one in
+ * fd-time.h (same truncation, same branch-free carries), so at run
+ * time it compiles to what the C code does.
+ */
+class Time {
+public:
+	static constexpr uint32_t frac_n = FD_TIME_FRAC_N;
+	static constexpr uint32_t coarse_n = FD_TIME_COARSE_N;
+	static constexpr uint64_t ps_per_coarse = FD_TIME_PS_PER_COARSE;
+	static constexpr uint64_t ps_per_sec = FD_TIME_PS_PER_SEC;
+
+	uint64_t utc;
+	uint32_t coarse;
+	uint32_t frac;
+
+	constexpr Time() : utc(0), coarse(0), frac(0) {}
+	constexpr Time(uint64_t u, uint32_t c, uint32_t f)
+		: utc(u), coarse(c), frac(f) {}
+	constexpr Time(const struct fd_time &t)
+		: utc(t.utc), coarse(t.coarse), frac(t.frac) {}
+
+	/* Same steps as fd_time_from_ps: 10^12 is 2^12 * 5^12 */
+	static constexpr Time from_ps(uint64_t ps)
+	{
+		uint64_t s = (ps >> 12) / 244140625;
+		uint64_t x = (ps >> 12) % 244140625 << 12 | (ps & 0xfff);
+		uint32_t r = (x >> 6) % 125 << 6 | (x & 63);
+
+		return Time(s, (x >> 6) / 125, (r << 12) / ps_per_coarse);
+	}
+
+	/* This overflows after 213 days: use it for durations */
+	constexpr uint64_t ps() const
+	{
+		return utc * ps_per_sec + coarse * ps_per_coarse
+			+ ((frac * 125) >> 6);
+	}
+
+	/* For the C functions: seq_id and channel are zero */
+	struct fd_time c() const
+	{
+		struct fd_time t = {};
+
+		t.utc = utc;
+		t.coarse = coarse;
+		t.frac = frac;
+		return t;
+	}
+
+	constexpr Time &operator+=(const Time &d)
+	{
+		uint32_t c = 0;
+
+		frac += d.frac;
+		c = frac >= frac_n;
+		frac -= c * frac_n;
+		coarse += d.coarse + c;
+		c = coarse >= coarse_n;
+		coarse -= c * coarse_n;
+		utc += d.utc + c;
+		return *this;
+	}
+
+	constexpr Time &operator-=(const Time &d)
+	{
+		uint32_t b = 0, dc = 0;
+
+		b = frac < d.frac;
+		frac = frac + b * frac_n - d.frac;
+		dc = d.coarse + b;
+		b = coarse < dc;
+		coarse = coarse + b * coarse_n - dc;
+		utc -= d.utc + b;
+		return *this;
+	}
+
+	/* Signed offsets, truncated towards zero like fd_time_add_ps */
+	constexpr Time &add_ps(int64_t ps)
+	{
+		if (ps >= 0)
+			return *this += from_ps(ps);
+		return *this -= from_ps(-(uint64_t)ps);
+	}
+};
+
+constexpr Time operator+(Time a, const Time &b) { return a += b; }
+constexpr Time operator-(Time a, const Time &b) { return a -= b; }
+
+/* a - b, in picoseconds: the result overflows after 106 days */
+constexpr int64_t diff_ps(const Time &a, const Time &b)
+{
+	return (int64_t)(a.utc - b.utc) * (int64_t)Time::ps_per_sec
+		+ (int64_t)Time(0, a.coarse, a.frac).ps()
+		- (int64_t)Time(0, b.coarse, b.frac).ps();
+}
+
+constexpr bool operator==(const Time &a, const Time &b)
+{
+	return a.utc == b.utc && a.coarse == b.coarse && a.frac == b.frac;
+}
+constexpr bool operator!=(const Time &a, const Time &b) { return !(a == b); }
+constexpr bool operator<(const Time &a, const Time &b)
+{
+	return a.utc != b.utc ? a.utc < b.utc
+		: a.coarse != b.coarse ? a.coarse < b.coarse : a.frac < b.frac;
+}
+constexpr bool operator>(const Time &a, const Time &b) { return b < a; }
+constexpr bool operator<=(const Time &a, const Time &b) { return !(b < a); }
+constexpr bool operator>=(const Time &a, const Time &b) { return !(a < b); }
+
+/* Durations: "using namespace fdelay::literals;" then 5_ns, 20_us */
+namespace literals {
+constexpr Time operator"" _ps(unsigned long long v)
+	{ return Time::from_ps(v); }
+constexpr Time operator"" _ns(unsigned long long v)
+	{ return Time::from_ps(v * 1000); }
+constexpr Time operator"" _us(unsigned long long v)
+	{ return Time::from_ps(v * 1000 * 1000); }
+constexpr Time operator"" _ms(unsigned long long v)
+	{ return Time::from_ps(v * 1000 * 1000 * 1000); }
+constexpr Time operator"" _s(unsigned long long v)
+	{ return Time(v, 0, 0); }
+}
+
+/* The C++ code is checked by the compiler, every time it's used */
+namespace check {
+using namespace literals;
+static_assert(8_ns == Time(0, 1, 0), "_ns");
+static_assert(7999_ps == Time(0, 0, 4095), "_ps");
+static_assert(999_ms + 2_ms == Time(1, 125000, 0), "carry");
+static_assert(Time(5, 0, 0).add_ps(-8000) == Time(4, 124999999, 0), "add_ps");
+static_assert(Time(5, 0, 0) - 1_ps - 8_ns == Time(4, 124999999, 0), "borrow");
+static_assert(20_us .ps() == 20000000, "ps");
+static_assert(diff_ps(1_s, 999_ms) == 1000000000, "diff");
+}
+
+/*
+ * A view of caller memory, so reading never allocates: it is built
+ * from an array, a pointer and size, or anything with data() and size()
+ * (std::vector, std::array). C++20 users can pass a std::span too.
+ */
+template <typename T> class span {
+public:
+	constexpr span() : p_(nullptr), n_(0) {}
+	constexpr span(T *p, std::size_t n) : p_(p), n_(n) {}
+	template <std::size_t N> constexpr span(T (&a)[N]) : p_(a), n_(N) {}
+	template <typename C, typename = decltype(std::declval<C &>().data())>
+	constexpr span(C &c) : p_(c.data()), n_(c.size()) {}
+
+	constexpr T *data() const { return p_; }
+	constexpr std::size_t size() const { return n_; }
+	constexpr T *begin() const { return p_; }
+	constexpr T *end() const { return p_ + n_; }
+	constexpr T &operator[](std::size_t i) const { return p_[i]; }
+	constexpr span first(std::size_t n) const { return span(p_, n); }
+private:
+	T *p_;
+	std::size_t n_;
+};
+
+/* Library initialization: one object, for the life of the program */
+class Library {
+public:
+	Library()
+	{
+		n_ = fdelay_init();
+		if (n_ < 0)
+			throw std::system_error(errno, std::generic_category(),
+						"fdelay_init");
+	}
+	~Library() { fdelay_exit(); }
+	Library(const Library &) = delete;
+	Library &operator=(const Library &) = delete;
+
+	int boards() const { return n_; }
+private:
+	int n_;
+};
+
+/* An input arena (see fdelay_read_blocks), allocated once */
+class Arena {
+public:
+	explicit Arena(int size) : a_(fdelay_arena_alloc(size))
+	{
+		if (!a_)
+			throw std::system_error(errno, std::generic_category(),
+						"fdelay_arena_alloc");
+	}
+	~Arena() { if (a_) fdelay_arena_free(a_); }
+	Arena(Arena &&o) noexcept : a_(o.a_) { o.a_ = nullptr; }
+	Arena &operator=(Arena &&o) noexcept
+		{ std::swap(a_, o.a_); return *this; }
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	/* The records of the last fill, valid until the next one */
+	span<struct fd_time> records() const
+		{ return span<struct fd_time>(a_->t, a_->n); }
+	int blocks() const { return a_->nblocks; }
+	struct fdelay_arena *get() const { return a_; }
+private:
+	struct fdelay_arena *a_;
+};
+
+/*
+ * An open board. Opening failures throw std::system_error; the other
+ * methods return what the C functions return (-1 with errno on error),
+ * so the reading path has no exceptions and no allocation.
+ */
+class Board {
+public:
+	/* Either argument (not both) may be -1, as in fdelay_open() */
+	explicit Board(int index, int dev_id = -1)
+		: b_(fdelay_open(index, dev_id))
+	{
+		if (!b_)
+			throw std::system_error(errno, std::generic_category(),
+						"fdelay_open");
+	}
+	~Board() { if (b_) fdelay_close(b_); }
+	Board(Board &&o) noexcept : b_(o.b_) { o.b_ = nullptr; }
+	Board &operator=(Board &&o) noexcept
+		{ std::swap(b_, o.b_); return *this; }
+	Board(const Board &) = delete;
+	Board &operator=(const Board &) = delete;
+
+	struct fdelay_board *get() const { return b_; }
+
+	/* Time */
+	int set_time(const Time &t)
+		{ struct fd_time c = t.c(); return fdelay_set_time(b_, &c); }
+	int get_time(Time &t)
+	{
+		struct fd_time c;
+		int ret = fdelay_get_time(b_, &c);
+
+		t = c;
+		return ret;
+	}
+	int get_time_fast(Time &t, uint32_t *err_ns = nullptr)
+	{
+		struct fd_time c;
+		int ret = fdelay_get_time_fast(b_, &c, err_ns);
+
+		t = c;
+		return ret;
+	}
+	int set_host_time() { return fdelay_set_host_time(b_); }
+	int time_to_host(clockid_t clock, span<struct fd_time> t,
+			 span<int64_t> host_ns)
+	{
+		if (host_ns.size() < t.size()) {
+			errno = EINVAL;
+			return -1;
+		}
+		return fdelay_time_to_host(b_, clock, t.data(), host_ns.data(),
+					   t.size());
+	}
+
+	/* Input: the records are written in place */
+	int read(span<struct fd_time> t, int flags = 0)
+		{ return fdelay_read(b_, t.data(), t.size(), flags); }
+	int fread(span<struct fd_time> t)
+		{ return fdelay_fread(b_, t.data(), t.size()); }
+	int read_blocks(Arena &a, int flags = 0)
+		{ return fdelay_read_blocks(b_, a.get(), flags); }
+	int fileno_tdc() { return fdelay_fileno_tdc(b_); }
+	int set_config_tdc(int flags)
+		{ return fdelay_set_config_tdc(b_, flags); }
+	int get_config_tdc() { return fdelay_get_config_tdc(b_); }
+
+	/* Output */
+	int config_pulse(int channel, struct fdelay_pulse p)
+		{ return fdelay_config_pulse(b_, channel, &p); }
+	int config_pulses(unsigned mask, span<struct fdelay_pulse> p)
+	{
+		if (p.size() < 4) {
+			errno = EINVAL;
+			return -1;
+		}
+		return fdelay_config_pulses(b_, mask, p.data());
+	}
+	int queue_pulse(int channel, struct fdelay_pulse p)
+		{ return fdelay_queue_pulse(b_, channel, &p); }
+	int has_triggered(int channel)
+		{ return fdelay_has_triggered(b_, channel); }
+	int read_triggers(span<struct fd_time> t)
+	{
+		if (t.size() < 4) {
+			errno = EINVAL;
+			return -1;
+		}
+		return fdelay_read_triggers(b_, t.data());
+	}
+	int fileno_triggers() { return fdelay_fileno_triggers(b_); }
+
+	/* White Rabbit and the rest */
+	int wr_mode(bool on) { return fdelay_wr_mode(b_, on); }
+	int check_wr_mode() { return fdelay_check_wr_mode(b_); }
+	int set_config(const struct fd_config &c)
+		{ struct fd_config tmp = c; return fdelay_set_config(b_, &tmp); }
+	int get_config(struct fd_config &c)
+		{ return fdelay_get_config(b_, &c); }
+	float temperature() { return fdelay_read_temperature(b_); }
+private:
+	struct fdelay_board *b_;
+};
+
+/* Batch conversions over caller arrays (see fdelay-batch.c) */
+inline int to_pico(span<struct fd_time> t, span<uint64_t> ps)
+{
+	if (ps.size() < t.size()) {
+		errno = EINVAL;
+		return -1;
+	}
+	fdelay_time_to_pico_n(t.data(), ps.data(), t.size());
+	return t.size();
+}
+
+inline int to_time(span<uint64_t> ps, span<struct fd_time> t)
+{
+	if (t.size() < ps.size()) {
+		errno = EINVAL;
+		return -1;
+	}
+	fdelay_pico_to_time_n(ps.data(), t.data(), ps.size());
+	return ps.size();
+}
+
+} /* namespace fdelay */
+
+#endif /* __FDELAY_HPP__ */
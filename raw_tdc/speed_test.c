@@ -58,22 +58,6 @@ struct board_def {
 	} outs [4]; */
 };
 
-/* Add two timestamps */
-struct fdelay_time my_ts_add(struct fdelay_time a, struct fdelay_time b) {
-    a.frac += b.frac;
-    if(a.frac >= 4096)    {
-        a.frac -= 4096;
-		a.coarse++;
-    }
-    a.coarse += b.coarse;
-    if(a.coarse >= 125000000) {
-        a.coarse -= 125000000;
-		a.utc ++;
-    }
-    a.utc += b.utc;
-    return a;
-}
-
 struct board_def my_board;
 
 void enable_termination(struct fdelay_board *b, int enable) {
@@ -125,7 +109,7 @@ int configure_board(struct board_def *bdef) {
 	{
 	    if(bdef->outs[i].enabled)
 	    {
-		struct fdelay_time t_cur, pps_offset, width;
+		struct fd_time t_cur, pps_offset, width;
 		struct fdelay_pulse p;
 		
 		printf("Configure output %d\n", i+1);
@@ -138,12 +122,13 @@ int configure_board(struct board_def *bdef) {
 		t_cur.utc += 2;
 		t_cur.coarse = 0;
 		t_cur.frac = 0;
-		t_cur = my_ts_add(pps_offset, t_cur);
+		fd_time_add(&t_cur, &pps_offset);
 		
 		p.rep = -1;
 		p.mode = FD_OUT_MODE_PULSE;
 		p.start = t_cur;
-		p.end = my_ts_add(t_cur, width);
+		p.end = t_cur;
+		fd_time_add(&p.end, &width);
 		fdelay_pico_to_time(&bdef->outs[i].period, &p.loop);
 		fdelay_config_pulse(bdef->b, i, &p);
 	    }
@@ -166,35 +151,21 @@ void coarse_fract_to_picos(struct fd_time *time, uint64_t *pico) {
   	*pico = p;
 }
 
-/* 
- * reminder to self: timestamp looks like this (fdelay-lib.h)
-   struct fdelay_time {
-		uint64_t utc;
-		uint32_t coarse;
-		uint32_t frac;
-		uint32_t seq_id;
-		uint32_t channel;
-    };
- 
- each raw sample is in fd_time format (fine-delay.h)
- * struct fd_time {
-	uint64_t utc;      // 8 bytes
-	uint32_t coarse;   // 4
-	uint32_t frac;     // 4
-	uint32_t channel;  // 4
-	uint32_t seq_id;   // 4
-};
- * */
+/*
+ * Each raw sample is a struct fd_time (fine-delay.h), 24 bytes, which is
+ * also the library's struct fd_time: samples can be used in place.
+ */
 
-unsigned char buf[1024*1024]; // large buffer
-int next=0; // keep track of missing samples
+unsigned char buf[1024*1024] __attribute__((aligned(8))); // large buffer
+uint64_t lost=0; // keep track of missing samples (the library counts them)
 uint64_t previous_utc=0; // keep track of seconds
 uint64_t nstamps;
 uint64_t nblocks;
 
 void handle_readout(struct board_def *bdef) {
-    struct fdelay_time t;
+    struct fd_time t;
     struct fd_time ts;
+    struct fdelay_seq_stats st;
 	uint32_t nsamples;
 	int i,j;
     uint64_t picos;
@@ -204,12 +175,11 @@ void handle_readout(struct board_def *bdef) {
 		// data is now contained in buf, but we do nothing with it!
 		
 		// check for missing samples
-		if ( next != t.seq_id  )
-			printf("ERROR! seq_id = %06d but expected next_id = %06d \n",t.seq_id, next);
-			
-		next = t.seq_id+nsamples;
-		if (next > 65535 )
-			next = next % 65536; 
+		fdelay_get_seq_stats(bdef->b, t.channel, &st);
+		if ( st.lost != lost )
+			printf("ERROR! %lli samples missing before seq_id = %u \n",
+			       (long long)(st.lost - lost), t.seq_id);
+		lost = st.lost;
 		nstamps += nsamples;
 		//if (nsamples>nsamples_max)
 		//	nsamples_max = nsamples;
@@ -58,22 +58,6 @@ struct board_def {
 	} outs [4]; */
 };
 
-/* Add two timestamps */
-struct fdelay_time my_ts_add(struct fdelay_time a, struct fdelay_time b) {
-    a.frac += b.frac;
-    if(a.frac >= 4096)    {
-        a.frac -= 4096;
-		a.coarse++;
-    }
-    a.coarse += b.coarse;
-    if(a.coarse >= 125000000) {
-        a.coarse -= 125000000;
-		a.utc ++;
-    }
-    a.utc += b.utc;
-    return a;
-}
-
 struct board_def my_board;
 
 void enable_termination(struct fdelay_board *b, int enable) {
@@ -125,7 +109,7 @@ int configure_board(struct board_def *bdef) {
 	{
 	    if(bdef->outs[i].enabled)
 	    {
-		struct fdelay_time t_cur, pps_offset, width;
+		struct fd_time t_cur, pps_offset, width;
 		struct fdelay_pulse p;
 		
 		printf("Configure output %d\n", i+1);
@@ -138,12 +122,13 @@ int configure_board(struct board_def *bdef) {
 		t_cur.utc += 2;
 		t_cur.coarse = 0;
 		t_cur.frac = 0;
-		t_cur = my_ts_add(pps_offset, t_cur);
+		fd_time_add(&t_cur, &pps_offset);
 		
 		p.rep = -1;
 		p.mode = FD_OUT_MODE_PULSE;
 		p.start = t_cur;
-		p.end = my_ts_add(t_cur, width);
+		p.end = t_cur;
+		fd_time_add(&p.end, &width);
 		fdelay_pico_to_time(&bdef->outs[i].period, &p.loop);
 		fdelay_config_pulse(bdef->b, i, &p);
 	    }
@@ -166,32 +151,18 @@ void coarse_fract_to_picos(struct fd_time *time, uint64_t *pico) {
   	*pico = p;
 }
 
-/* 
- * reminder to self: timestamp looks like this (fdelay-lib.h)
-   struct fdelay_time {
-		uint64_t utc;
-		uint32_t coarse;
-		uint32_t frac;
-		uint32_t seq_id;
-		uint32_t channel;
-    };
- 
- each raw sample is in fd_time format (fine-delay.h)
- * struct fd_time {
-	uint64_t utc;      // 8 bytes
-	uint32_t coarse;   // 4
-	uint32_t frac;     // 4
-	uint32_t channel;  // 4
-	uint32_t seq_id;   // 4
-};
- * */
+/*
+ * Each raw sample is a struct fd_time (fine-delay.h), 24 bytes, which is
+ * also the library's struct fd_time: samples can be used in place.
+ */
 
-unsigned char buf[1024*1024]; // large buffer
-int next=0; // keep track of missing samples
+unsigned char buf[1024*1024] __attribute__((aligned(8))); // large buffer
+uint64_t lost=0; // keep track of missing samples (the library counts them)
 
 void handle_readout(struct board_def *bdef) {
-    struct fdelay_time t;
+    struct fd_time t;
     struct fd_time ts;
+    struct fdelay_seq_stats st;
 	int nsamples;
 	int i,j;
     uint64_t picos;
@@ -213,25 +184,9 @@ void handle_readout(struct board_def *bdef) {
 			printf("\n");
 			*/
 			
-			// unpack data into human-readable form:
-			ts.utc = (uint64_t)(buf[j*24]) + 
-			         (uint64_t)(buf[j*24+1]<<8)+
-			         (uint64_t)(buf[j*24+2]<<16)+
-			         (uint64_t)(buf[j*24+3]<<24)+
-			         (uint64_t)(buf[j*24+4]<<32)+ // this byte, and onwards, 
-			         (uint64_t)(buf[j*24+5]<<40)+ // will be zero in the foreseeable future..
-			         (uint64_t)(buf[j*24+6]<<48)+
-			         (uint64_t)(buf[j*24+7]<<56);
-			         
-			ts.coarse = (uint32_t)buf[j*24+8] + (uint32_t)(buf[j*24+9]<<8) + 
-			           (uint32_t)(buf[j*24+10]<<16) + (uint32_t)(buf[j*24+11]<<24);
-			ts.frac = (uint32_t)buf[j*24+12] + (uint32_t)(buf[j*24+13]<<8)+
-				      (uint32_t)(buf[j*24+14]<<16) + (uint32_t)(buf[j*24+15]<<24);
-			ts.channel = (uint32_t)buf[j*24+16] + (uint32_t)(buf[j*24+17]<<8)+
-			                (uint32_t)(buf[j*24+18]<<16) + (uint32_t)(buf[j*24+19]<<24);
-			ts.seq_id = (uint32_t)buf[j*24+20] + (uint32_t)(buf[j*24+21]<<8)+ 
-			            (uint32_t)(buf[j*24+22]<<16) + (uint32_t)(buf[j*24+23]<<24);
-			            
+			// no unpacking: the buffer is an array of records
+			ts = ((struct fd_time *)buf)[j];
+
 			printf("   %5i  %lli.%09lli + %04x ",
 		      ts.seq_id, ts.utc, (long long)ts.coarse * 8, ts.frac);
 		    coarse_fract_to_picos(&ts, &picos);
@@ -241,12 +196,11 @@ void handle_readout(struct board_def *bdef) {
 		printf("\n");
 		
 		// check for missing samples
-		if ( next != t.seq_id  )
-			printf("ERROR! next seq_id = %06d but current seq_id = %06d\n",next,t.seq_id);
-			
-		next = t.seq_id+nsamples;
-		if (next > 65535 )
-			next = 0;
+		fdelay_get_seq_stats(bdef->b, t.channel, &st);
+		if ( st.lost != lost )
+			printf("ERROR! %lli samples missing before seq_id = %u\n",
+			       (long long)(st.lost - lost), t.seq_id);
+		lost = st.lost;
 		
 
 		//prev_id = t.seq_id;
@@ -19,13 +19,14 @@
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
 #include <fine-delay.h>
+#include <fd-time.h>
 
 enum {
 	MODE_HEX = 1,
@@ -45,9 +46,9 @@ void event(uint32_t *a, char *name, int *seq, int modemask, long double *t1,
 	static int64_t guess;
 
 	if (*seq != -1) {
-		if (sequence  != ((*seq + 1) & 0xffff)) {
+		if (fd_time_seq_gap(*seq, sequence)) {
 			printf("%s: LOST %i events\n", name,
-			       (sequence - (*seq + 1)) & 0xffff);
+			       fd_time_seq_gap(*seq, sequence));
 			*t1 = 0.0;
 			*p1 = 0LL;
 		}
@@ -116,20 +117,39 @@ void event(uint32_t *a, char *name, int *seq, int modemask, long double *t1,
 	}
 }
 
-#define MAXFD 16
+#define MAXEV 64 /* per epoll_wait: the others come at the next one */
 struct zio_control ctrl;
 
+/* Edge-triggered: read until EAGAIN, or we'd miss the next edge */
+void drain(char *prog, int fd, char *name, int *seq, int modemask,
+	   long double *t1, uint64_t *p1)
+{
+	int j;
+
+	while ((j = read(fd, &ctrl, sizeof(ctrl))) > 0) {
+		if (j != sizeof(ctrl)) {
+			fprintf(stderr, "%s: read(): got %i not %i\n",
+				prog, j, (int)sizeof(ctrl));
+			exit(1);
+		}
+		event(ctrl.attr_channel.ext_val, name, seq, modemask, t1, p1);
+	}
+	if (errno != EAGAIN) {
+		fprintf(stderr, "%s: %s: read(): %s\n", prog, name,
+			strerror(errno));
+		exit(1);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	glob_t glob_buf;
-	int i, j, tout = 0, maxfd = 0;
-	int fd[MAXFD], seq[MAXFD];
-	struct timeval tv, *tvp = NULL;
-	fd_set allset, curset;
+	int i, j, n, ep, tout = 0, tms = -1;
+	int *fd, *seq;
+	struct epoll_event ev, evs[MAXEV];
 	int modemask = MODE_HEX;
-	long double t1[MAXFD] = {0.0,};
-	uint64_t p1[MAXFD] = {0LL,};
-	uint32_t *attrs;
+	long double *t1;
+	uint64_t *p1;
 
 	if (getenv("FD_EXPECTED_RATE"))
 		expect = atoi(getenv("FD_EXPECTED_RATE"));
@@ -181,60 +201,60 @@ int main(int argc, char **argv)
 		exit(1);
 	};
 
-	if (argc >= MAXFD) {
-		fprintf(stderr, "%s: too many file names\n", argv[0]);
+	fd = calloc(argc, sizeof(*fd));
+	seq = calloc(argc, sizeof(*seq));
+	t1 = calloc(argc, sizeof(*t1));
+	p1 = calloc(argc, sizeof(*p1));
+	ep = epoll_create1(0);
+	if (!fd || !seq || !t1 || !p1 || ep < 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
 		exit(1);
-	};
+	}
 
-	FD_ZERO(&allset);
+	/* Edge-triggered: each wakeup lists only the devices with data */
 	for (i = 1; i < argc; i++) {
-		fd[i] = open(argv[i], O_RDONLY);
+		fd[i] = open(argv[i], O_RDONLY | O_NONBLOCK);
 		if (fd[i] < 0) {
 			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1],
 			       strerror(errno));
 			exit(1);
 		}
-		if (fd[i] > maxfd)
-			maxfd = fd[i];
-		FD_SET(fd[i], &allset);
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u32 = i;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd[i], &ev) < 0) {
+			fprintf(stderr, "%s: %s: epoll: %s\n", argv[0],
+				argv[i], strerror(errno));
+			exit(1);
+		}
 		seq[i] = -1;
 	}
 
 	if (tout == 0)
 		setlinebuf(stdout);
-	tvp = NULL;
+	/* Data may be there already, with no edge for it */
+	for (i = 1; i < argc; i++)
+		drain(argv[0], fd[i], argv[i], seq + i, modemask,
+		      t1 + i, p1 + i);
 	/* Ok, now wait for each of them to spit a timestamp */
 	while (1) {
-		curset = allset;
-		switch(select(maxfd + 1, &curset, NULL, NULL, tvp)) {
-		case -1:
-			if (errno == EINTR)
+		n = epoll_wait(ep, evs, MAXEV, tms);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
 				continue;
-			fprintf(stderr, "%s: select: %s\n", argv[0],
+			}
+			fprintf(stderr, "%s: epoll_wait: %s\n", argv[0],
 				strerror(errno));
 			exit(1);
-		case 0:
-			exit(0);
 		}
-		if (tout) {
-			/* prepare timeout for next time */
-			tv.tv_sec = tout / (1000 * 1000);
-			tv.tv_usec = tout % (1000 * 1000);
-			tvp = &tv;
-		}
-
-		for (i = 1; i < argc; i++) {
-			if (!FD_ISSET(fd[i], &curset))
-				continue;
-			/* Ok, it's there: read and decode */
-			j = read(fd[i], &ctrl, sizeof(ctrl));
-			if (j != sizeof(ctrl)) {
-				fprintf(stderr, "%s: read(): got %i not %i\n",
-					argv[0], j, sizeof(ctrl));
-				exit(1);
-			}
-			attrs = ctrl.attr_channel.ext_val;
-			event(attrs, argv[i], seq + i, modemask,
+		if (n == 0)
+			exit(0);
+		/* prepare timeout for next time (it's in microseconds) */
+		if (tout)
+			tms = (tout + 999) / 1000;
+		for (j = 0; j < n; j++) {
+			i = evs[j].data.u32;
+			drain(argv[0], fd[i], argv[i], seq + i, modemask,
 			      t1 + i, p1 + i);
 		}
 	}
@@ -26,6 +26,7 @@
 #include <linux/zio.h>
 #include <linux/zio-user.h>
 #include <fine-delay.h>
+#include <fd-time.h>
 
 /*
  * Lazily, we ignore the "seconds" part, and assume we run at 5Hz minimum
@@ -64,7 +65,7 @@ static void perf_one(struct fd_perf *p, uint32_t *a /* attrs */)
 		goto set_prev;
 	}
 
-	p->lost += (int16_t)(a[FD_ATTR_TDC_SEQ] - p->prev - 1);
+	p->lost += fd_time_seq_gap(p->prev, a[FD_ATTR_TDC_SEQ]);
 
 	/* count hardware-reported pico */
 	diff = pico - p->pico_prev;